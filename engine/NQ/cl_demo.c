@@ -24,6 +24,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "client.h"
 #include "cmd.h"
 #include "console.h"
+#include "fisheye.h"
 #include "host.h"
 #include "net.h"
 #include "protocol.h"
@@ -380,6 +381,8 @@ CL_FinishTimeDemo(void)
 	time = 1;
     Con_Printf("%i frames %5.1f seconds %5.1f fps\n", frames, time,
 	       frames / time);
+
+    F_FinishBenchmark();
 }
 
 /*
@@ -242,6 +242,12 @@ LUA DETAILS
          - lens_forward (function (x,y,z) -> (x,y))
          - lens_inverse (function (x,y) -> (x,y,z))
 
+         BATCHED MAPPING FUNCTIONS (optional, faster versions of the above)
+         - lens_inverse_row (function (y,x0,dx,n,rays))
+            fills rays[3i+1..3i+3] with the ray at (x0+i*dx, y), or rays[3i+1] = nil
+         - lens_forward_batch (function (rays,n,xy))
+            fills xy[2i+1..2i+2] with the point of rays[3i+1..3i+3], or xy[2i+1] = nil
+
          BOUNDARIES
          - lens_width (double)
          - lens_height (double)
@@ -251,6 +257,9 @@ LUA DETAILS
          (optional command to be called when lens is loaded)
          - onload (string)
 
+         (optional name of a built-in C version of the mapping functions)
+         - native (string)
+
    Variables/Functions provided to you:
    
       - numplates (int)
@@ -263,6 +272,7 @@ LUA DETAILS
 #include "bspfile.h"
 #include "client.h"
 #include "cmd.h"
+#include "common.h"
 #include "console.h"
 #include "cvar.h"
 #include "draw.h"
@@ -273,13 +283,30 @@ LUA DETAILS
 #include "r_local.h"
 #include "screen.h"
 #include "sys.h"
+#include "thread.h"
 #include "view.h"
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
+// LuaJIT implements the Lua 5.1 API
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen lua_objlen
+#endif
+
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <utime.h>
+
+// AVX2 gathers for the lens renderer (selected at runtime, see render_span)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define LENS_SIMD_AVX2
+#include <immintrin.h>
+#endif
 
 // -------------------------------------------------------------------------------- 
 // |                                                                              |
@@ -295,14 +322,16 @@ qboolean fisheye_enabled;
 qboolean shortcutkeys_enabled;
 
 // This is a globally accessible variable that is used to set the fov of each
-// camera view that we render.
-double fisheye_plate_fov;
+// camera view that we render.  (one per thread, since the plates can be
+// rendered at the same time)
+VIEWSTATE double fisheye_plate_fov;
 
 // Lens computation is slow, so we don't want to block the game while its busy.
-// Instead of dealing with threads, we are just limiting the time that the
-// lens builder can work each frame.  It keeps track of its work between frames
-// so it can resume without problems.  This allows the user to watch the lens
-// pixels become visible as they are calculated.
+// Inverse maps are built by worker threads (see lens_workers below) while the
+// main thread just polls for completion each frame.  Otherwise, we are just
+// limiting the time that the lens builder can work each frame.  It keeps track
+// of its work between frames so it can resume without problems.  This allows
+// the user to watch the lens pixels become visible as they are calculated.
 static struct _lens_builder
 {
    qboolean working;
@@ -310,17 +339,143 @@ static struct _lens_builder
    float seconds_per_frame;
    struct _inverse_state
    {
+      // next unit of work (a row of pixels, or a row of grid cells)
+      // (counts down, units are built from the center of the screen outward)
       int ly;
+
+      // rows of the coarse preview drawn so far, out of preview_rows
+      // (preview_rows = 0 when there is no preview)
+      int preview_row;
+      int preview_rows;
+
+      // set when the rows hold an older map that is still drawn (the preview,
+      // or a map interpolated from the ray field), which each unit clears
+      // from its rows before drawing them
+      qboolean replace;
+
+      // grid settings for this build (copied from "grid" below when it starts)
+      int cellsize;
+      double cos_maxerror;
    } inverse_state;
+
+   // Instead of following the ray of every pixel, the inverse builder can
+   // follow the rays at the corners of a grid of cells, and interpolate the
+   // rays inside each cell.  A cell is split into four smaller cells when the
+   // ray at its center is too far from the interpolated one, or when part of
+   // it is outside the lens.
+   struct _inverse_grid
+   {
+      // size of the largest cells (power of 2, 1 = follow every pixel's ray)
+      int cellsize;
+
+      // largest angle allowed between an interpolated ray and the real one (degrees)
+      float maxerror;
+   } grid;
+
+   // Inverse lenses can first draw a coarse preview of the whole view, by
+   // following the ray of one pixel in every block and filling the block
+   // with it.  Each unit of the full build clears the preview in its rows
+   // before drawing them.
+   qboolean preview;
+   #define LENS_PREVIEW_STEP 4
+   #define MAX_LENS_GRID_CELLSIZE 64
+   struct _field_state
+   {
+      // set when the lensmap is filled from the ray field
+      qboolean active;
+      int ly;
+   } field_state;
+
+   // The forward builder maps the corners of every plate texel to the screen
+   // and fills the quad between them.  The corners are kept in a grid of two
+   // rows of platesize+1 corners that is reused between builds (which one is
+   // on top alternates as the rows are walked).
    struct _forward_state
    {
-      int *top;
-      int *bot;
+      struct _lens_vertex
+      {
+         float x, y;
+         qboolean valid;
+      } *grid;
+      int gridsize;
+      int top;
       int plate_index;
       int py;
    } forward_state;
+   #define FORWARD_ROW(i) (lens_builder.forward_state.grid + (i)*(globe.platesize+1))
+
+   // a quad is dropped as a seam crossing when it is this many times bigger
+   // than the smaller of the quads next to it in its row
+   #define FORWARD_SEAM_RATIO 4
+
+   // set when a lens function fails, so we don't cache a partial lensmap
+   qboolean failed;
 } lens_builder;
 
+#define LENSCACHE_MAGIC "LMAP"
+#define LENSCACHE_VERSION 1
+#define LENSCACHE_NOPLATE 255
+#define LENSCACHE_DIR "lens-cache"
+#define LENSCACHE_EXT ".lmp"
+
+// room for a cache file path: the game dir, the cache dir and a file name
+#define LENSCACHE_PATHSIZE \
+   (MAX_OSPATH + sizeof(LENSCACHE_DIR) + sizeof(((struct dirent *)0)->d_name))
+
+// header at the start of each lens cache file
+//    (followed by width_px*height_px plate indexes (bytes),
+//     and width_px*height_px plate offsets (ints))
+struct _lens_cache_header
+{
+   char magic[4];
+   int version;
+   unsigned int key;
+   int width_px, height_px;
+   int platesize;
+   int numplates;
+};
+
+// a file in the lens cache directory (for removing the least recently used)
+struct _lens_cache_file
+{
+   char name[LENSCACHE_PATHSIZE];
+   long long size;
+   time_t used;
+};
+
+// Finished lensmaps are saved to disk so that switching back to a lens (or
+// restarting the game) does not have to recompute it.  Each file holds the
+// plate index and plate offset of every lens pixel.  It is keyed by a hash of
+// everything the lensmap depends on: the lens and globe scripts, the zoom, and
+// the screen and plate sizes.  The files are written on a background thread,
+// and the least recently used ones are removed when they exceed max_mb.
+static struct _lens_cache
+{
+   qboolean enabled;
+
+   // most megabytes of lensmaps to keep on disk
+   int max_mb;
+
+   // key of the lensmap currently being built or displayed
+   unsigned int key;
+
+   // file holding the lensmap for the current key
+   // (empty if the path is too long, which disables the cache)
+   char filename[LENSCACHE_PATHSIZE];
+
+   // the lensmap being written in the background
+   struct _lens_cache_write {
+      thread_t *thread;
+      char filename[LENSCACHE_PATHSIZE];
+      long long max_bytes;
+      struct _lens_cache_header header;
+      int area;
+      byte *plates;
+      int *offsets;
+      qboolean failed;
+   } write;
+} lens_cache;
+
 // the Lua state pointer
 static lua_State *lua;
 
@@ -329,13 +484,131 @@ static struct _lua_refs {
    int lens_forward;
    int lens_inverse;
    int globe_plate;
+
+   // optional batched lens functions, and the tables we pass them
+   int lens_inverse_row;
+   int lens_forward_batch;
+   int ray_buffer;
+   int xy_buffer;
+
+   // LuaJIT shims that hand the batched functions our C buffers through the
+   // ffi instead of the tables above (-1 if unavailable, or if the lens
+   // failed to use them)
+   int ffi_inverse_row;
+   int ffi_forward_batch;
 } lua_refs;
 
+// A Lua state along with the references to the functions loaded in it.
+// The main thread's context (lua_main) points to "lua" and "lua_refs" above,
+// and each lens worker thread has its own.
+struct _lua_ctx {
+   lua_State *L;
+   struct _lua_refs *refs;
+
+   // if set, errors are written here instead of printed to the console
+   // (the console is not safe to use from worker threads)
+   char *error;
+   size_t errorsize;
+
+   // buffers for the results of the batched lens functions
+   vec3_t *batch_rays;
+   double *batch_xy;
+   byte *batch_valid;
+   int batch_size;
+
+#ifdef USE_LUAJIT
+   // rays as doubles, for the ffi calls
+   double *batch_ffi;
+#endif
+
+   // rays followed and lua calls made since the last flush_lens_counters
+   unsigned int rays;
+   unsigned int lua_calls;
+};
+static struct _lua_ctx lua_main;
+
+// Each lens worker thread owns a Lua state with the lens loaded, and takes
+// bands of rows from a shared counter until the inverse lensmap is complete.
+// Pixels are written straight into the lensmap.
+#define MAX_LENS_WORKERS 32
+#define LENS_WORKER_ROWS 4
+static struct _lens_workers
+{
+   // number of workers to start (0 = build on the main thread between frames)
+   int wanted;
+
+   // number of workers currently started
+   int count;
+
+   // shared between threads (only changed with Thread_AtomicAdd)
+   volatile int next_row;
+   volatile int num_finished;
+   volatile int abort;
+
+   struct _lens_worker
+   {
+      thread_t *thread;
+      struct _lua_refs refs;
+      struct _lua_ctx ctx;
+      qboolean failed;
+      char error[256];
+   } worker[MAX_LENS_WORKERS];
+} lens_workers;
+
+// The rays of an inverse lens only depend on the lens image coordinates, so a
+// zoom change (which only changes lens.scale) does not need to run the lens
+// again.  When the zoom changes, the rays are sampled on a grid in lens units
+// that covers more than the visible image, and the lensmap is then filled by
+// interpolating between them.  Later zooms reuse the same samples until the
+// view leaves the sampled area or gets too far between samples.
+#define RAYFIELD_SPACING 2          // pixels between samples when the field is built
+#define RAYFIELD_MAX_SPACING 8      // resample the lens when zoomed in further than this
+#define RAYFIELD_MARGIN 2           // sampled area relative to the visible area
+#define RAYFIELD_MAX_SAMPLES (1<<21)
+#define RAYFIELD_MIN_DOT 0.996      // (cos 5 degrees) closer samples are not interpolated across
+static struct _ray_field
+{
+   // identifies the lens that was sampled
+   unsigned int key;
+
+   // lens coordinates of the top left sample, and the distance between samples
+   double x0, y0;
+   double step;
+
+   // number of samples across and down, and how many rows have been taken
+   int width, height;
+   int rows_done;
+
+   // normalized rays (a zero vector where the lens has no ray)
+   vec3_t *rays;
+   int capacity;
+} ray_field;
+
+// Native C implementations of the stock lenses.  A lens script selects one by
+// setting "native" to its name, and the builder then calls it instead of the
+// lua mapping functions.  The script is still used for everything else
+// (boundaries, onload, and the lua functions as a reference), and any
+// parameters of the projection are read from the script's globals.
+#define MAX_NATIVE_PARAMS 2
+struct _native_lens {
+   const char *name;
+
+   // names of the lua globals passed to the functions as p[0], p[1], ...
+   const char *params[MAX_NATIVE_PARAMS];
+
+   // same return values as the lua functions (1 = valid, 0 = nil)
+   int (*inverse)(const double *p, double x, double y, vec3_t ray);
+   int (*forward)(const double *p, vec3_t ray, double *x, double *y);
+};
+
 static struct _globe {
 
    // name of the current globe
    char name[50];
 
+   // hash of the globe script (used for the lens cache key)
+   unsigned int script_hash;
+
    // indicates if the current globe is valid
    qboolean valid;
 
@@ -348,6 +621,9 @@ static struct _globe {
    // retrieves a pointer to a pixel in the platemap
    #define GLOBEPIXEL(plate,x,y) (globe.pixels + (plate)*(globe.platesize)*(globe.platesize) + (x) + (y)*(globe.platesize))
 
+   // extra bytes allocated after the pixels (the lens renderer gathers 4 bytes at a time)
+   #define GLOBE_PIXELS_PAD 4
+
    // globe plates
    #define MAX_PLATES 6
    struct {
@@ -358,14 +634,102 @@ static struct _globe {
       vec_t dist;
       byte palette[256];
       int display;
+
+      // the texels sampled by the finished lensmap (plus a margin),
+      // which is all of the plate we need to render
+      vrect_t bounds;
+
+      // width and height this plate is rendered at (<= platesize)
+      // (its pixels are still stored at GLOBEPIXEL(plate,0,0), but with rows this long)
+      int size;
+
+      // frames between renders of this plate, from the globe's "refresh" field
+      // (0 = use f_platerefresh)
+      int refresh;
+
+      // set when the pixels hold a render that can be shown again, along with
+      // the absolute view vectors it was rendered with and the part rendered
+      qboolean rendered;
+      vec3_t rendered_forward;
+      vec3_t rendered_right;
+      vec3_t rendered_up;
+      vrect_t rendered_rect;
+
+      // set when the plate was not rendered this frame and the view has turned
+      // since, so render_lensmap has to look up its texels through "warp"
+      // (rotates a ray in the plate's current frame (right,up,forward) into
+      // the frame of its last render)
+      qboolean reproject;
+      float warp[3][3];
    } plates[MAX_PLATES];
 
+   // Plates away from the center of the view can be rendered less often than
+   // every frame, reusing their last render in between ("f_platerefresh").
+   struct {
+      int frames;       // render every Nth frame (1 = every frame)
+      float maxangle;   // or when the view turns this many degrees (0 = never)
+      int front;        // plate at the center of the view (always rendered)
+      unsigned int frame;
+
+      // correct stale plates for the view turning since their last render
+      qboolean reproject_enabled;
+
+      // set when any plate needs reprojecting this frame
+      qboolean reproject;
+   } refresh;
+
+   // how far (in degrees) the view can turn while a plate is stale before the
+   // reprojection runs off the part that was rendered, if maxangle is 0
+   #define PLATE_REPROJECT_MARGIN 10
+
+   // smallest fraction of platesize that a sparsely sampled plate can be reduced to
+   // (1 = always render plates at platesize)
+   float min_plate_scale;
+   #define PLATE_DENSITY_BLOCK 8
+
+   // set when the plate bounds are known (i.e. the lensmap is finished)
+   qboolean bounds_valid;
+   #define PLATE_BOUNDS_MARGIN 1
+
    // number of plates used by the current globe
    int numplates;
 
-   // size of each rendered square plate in the vid buffer
+   // The globe_plate function baked into a cube map of ray directions, so the
+   // lens builders don't have to call into lua for every ray.  Each of the 6
+   // faces is a PLATE_LOOKUP_SIZE square of plate indexes, sampled at the
+   // cell corners.  Cells whose corners disagree are marked to still call
+   // globe_plate.  This is only as fine as the cells: a plate region that
+   // fits inside one cell without reaching its corners is not seen, and
+   // rays there get the plate of the corners instead.
+   byte *plate_lookup;
+   #define PLATE_LOOKUP_SIZE 128
+   #define PLATE_LOOKUP_NONE 255  // globe_plate returns nil
+   #define PLATE_LOOKUP_EXACT 254 // call globe_plate
+
+   // size of each rendered square plate
    int platesize;
 
+   // plate size requested with f_platesize (0 = fit the screen)
+   int platesize_wanted;
+   #define MIN_PLATESIZE 16
+   #define MAX_PLATESIZE MAXHEIGHT
+
+   // depth buffers of the plates (platesize*platesize each, so that they
+   // can be rendered at the same time)
+   short *zbuffer;
+
+   // render the plates at the same time on the job pool ("f_platethreads")
+   qboolean threaded;
+
+   // the plates to render this frame, with their absolute view vectors
+   int numrenders;
+   struct {
+      int plate;
+      vec3_t forward;
+      vec3_t right;
+      vec3_t up;
+   } renders[MAX_PLATES];
+
    // set when we want to save each globe plate
    // (make sure they are visible (i.e. current lens is using all plates))
    struct {
@@ -376,6 +740,75 @@ static struct _globe {
 
 } globe;
 
+// "f_benchmark" plays a demo as a timedemo and records how long each stage
+// of every fisheye frame takes, then writes a summary of the stages to the
+// console and (optionally) a CSV or JSON file.
+enum {
+   BENCH_FRAME,      // all of F_RenderView
+   BENCH_LENS_BUILD, // creating/resuming the lensmap (only frames that build)
+   BENCH_PLATES,     // rendering all the plates
+   BENCH_LENSMAP,    // render_lensmap
+   BENCH_PLATE0,     // rendering each plate (BENCH_PLATE0 + plate index)
+   NUM_BENCH_STAGES = BENCH_PLATE0 + MAX_PLATES
+};
+static struct _benchmark
+{
+   qboolean running;
+
+   // quit when the benchmark is done (started with -fisheyebench)
+   qboolean quit;
+
+   // file to write the results to ("" = console only)
+   char output[MAX_OSPATH];
+
+   // lens cache setting to restore afterwards
+   // (the cache is turned off so that the lens build is measured)
+   qboolean lens_cache_enabled;
+
+   // seconds taken by each stage, one sample per frame
+   struct _bench_stage
+   {
+      float *samples;
+      int count;
+      int size;
+   } stage[NUM_BENCH_STAGES];
+} benchmark;
+
+// "f_stats" draws counters for tuning the globe and lens over the view, and
+// "f_statsdump" prints the same counters to the console.
+#define STATS_MAX_LINES (16 + MAX_PLATES)
+#define STATS_LINE_LEN 48
+static struct _fisheye_stats
+{
+   qboolean show;
+
+   // seconds taken by each stage of the last frame (see BENCH_*)
+   // (-1 for stages that did not run, such as plates that were reused)
+   double seconds[NUM_BENCH_STAGES];
+
+   // plates displayed, rendered, and reprojected in the last frame
+   int displayed;
+   int rendered;
+   int reprojected;
+
+   // surface cache lookups by the plates in the last frame
+   unsigned int surf_hits;
+   unsigned int surf_misses;
+   unsigned int surf_rebuilds;
+
+   // rays followed and lua calls made by all the lua contexts
+   // (only changed with Thread_AtomicAdd, see flush_lens_counters)
+   volatile unsigned int rays;
+   volatile unsigned int lua_calls;
+
+   // rates over the last second
+   double rate_start;
+   unsigned int rate_rays;
+   unsigned int rate_lua_calls;
+   float rays_per_sec;
+   float lua_calls_per_sec;
+} fisheye_stats;
+
 static struct _lens {
 
    // boolean signaling if the lens is properly loaded
@@ -387,9 +820,16 @@ static struct _lens {
    // name of the current lens
    char name[50];
 
+   // hash of the lens script (used for the lens cache key)
+   unsigned int script_hash;
+
    // the type of map projection (inverse/forward)
    enum { MAP_NONE, MAP_INVERSE, MAP_FORWARD } map_type;
 
+   // native implementation of the mapping functions (NULL = use lua)
+   struct _native_lens *native;
+   double native_params[MAX_NATIVE_PARAMS];
+
    // size of the lens image in its arbitrary units
    double width, height;
 
@@ -411,7 +851,7 @@ static struct _lens {
    //    |----------------|
    int width_px, height_px;
 
-   // array of pointers (*) to plate pixels
+   // array of packed plate pixel references (*)
    // (the view constructed by the lens)
    //
    //    **************************    ^
@@ -424,32 +864,53 @@ static struct _lens {
    // 
    //    <------- width_px ------->
    // 
-   byte **pixels;
-
-   // retrieves a pointer to a lens pixel
-   #define LENSPIXEL(x,y) (lens.pixels + (x) + (y)*lens.width_px)
-
-   // a color tint index (i) for each pixel (255 = no filter)
+   // Each entry is 32 bits: the low bits hold an offset into globe.pixels,
+   // and the top bits hold a color tint index (i)
    // (new color = globe.plates[i].palette[old color])
    // (used for displaying transparent colored overlays over certain pixels)
    //
-   //    iiiiiiiiiiiiiiiiiiiiiiiiii    ^
-   //    iiiiiiiiiiiiiiiiiiiiiiiiii    |
-   //    iiiiiiiiiiiiiiiiiiiiiiiiii    |
-   //    iiiiiiiiiiiiiiiiiiiiiiiiii  height_px
-   //    iiiiiiiiiiiiiiiiiiiiiiiiii    |
-   //    iiiiiiiiiiiiiiiiiiiiiiiiii    |
-   //    iiiiiiiiiiiiiiiiiiiiiiiiii    v
-   // 
-   //    <------- width_px ------->
-   // 
-   byte *pixel_tints;
+   //    |tint|-------------- offset ---------------|
+   //     31 28 27                                 0
+   //
+   // Keeping both in one word halves the memory read per pixel compared to a
+   // pointer plus a separate tint array, and lets a pixel be set with a single store.
+   unsigned int *pixels;
+
+   #define LENSMAP_OFFSET_BITS 28
+   #define LENSMAP_OFFSET_MASK ((1u << LENSMAP_OFFSET_BITS) - 1)
+   #define LENSMAP_NOTINT 15
+   #define LENSMAP_NONE 0xFFFFFFFFu
+   #define LENSMAP_PACK(offset,tint) ((unsigned int)(offset) | ((unsigned int)(tint) << LENSMAP_OFFSET_BITS))
+   #define LENSMAP_OFFSET(v) ((v) & LENSMAP_OFFSET_MASK)
+   #define LENSMAP_TINT(v) ((v) >> LENSMAP_OFFSET_BITS)
 
-   // retrieves a pointer to a lens pixel tint
-   #define LENSPIXELTINT(x,y) (lens.pixel_tints + (x) + (y)*lens.width_px)
+   // retrieves a pointer to a lens pixel
+   #define LENSPIXEL(x,y) (lens.pixels + (x) + (y)*lens.width_px)
 
 } lens;
 
+// Runs of covered pixels in each lensmap row, found once the lensmap is
+// finished.  The renderer only visits these, so the empty regions outside the
+// lens boundary are skipped without testing each pixel, and the pixels inside
+// a run can be copied without checking for LENSMAP_NONE.
+static struct _lens_spans
+{
+   // false while the lensmap is still being built (render every pixel instead)
+   qboolean valid;
+
+   int count;
+   int size;
+   struct _lens_span
+   {
+      int x, y;
+      int len;
+   } *span;
+
+   // use the vectorised span copy when the cpu supports it
+   qboolean simd_enabled;
+   qboolean simd_supported;
+} lens_spans;
+
 static struct _zoom {
 
    qboolean changed;
@@ -538,6 +999,8 @@ void F_Init(void);
 void F_Shutdown(void);
 void F_WriteConfig(FILE* f);
 void F_RenderView(void);
+void F_FinishBenchmark(void);
+void F_DrawStats(void);
 
 // console commands
 static void cmd_fisheye(void);
@@ -553,6 +1016,22 @@ static void cmd_cover(void);
 static void cmd_contain(void);
 static void cmd_saveglobe(void);
 static void cmd_shortcutkeys(void);
+static void cmd_lenscache(void);
+static void cmd_lensthreads(void);
+static void cmd_lenssimd(void);
+static void cmd_drawthreads(void);
+static void cmd_platethreads(void);
+static void cmd_platesize(void);
+static int max_platesize(void);
+static void cmd_plateminscale(void);
+static void cmd_platerefresh(void);
+static void cmd_platereproject(void);
+static void cmd_stats(void);
+static void cmd_statsdump(void);
+static void cmd_lensgrid(void);
+static void cmd_lensgridcheck(void);
+static void cmd_lenspreview(void);
+static void cmd_benchmark(void);
 
 // console autocomplete helpers
 static struct stree_root * cmdarg_lens(const char *arg);
@@ -562,11 +1041,23 @@ static struct stree_root * cmdarg_globe(const char *arg);
 static void start_lens_builder_clock(void);
 static qboolean is_lens_builder_time_up(void);
 
+// benchmark functions
+static const char *bench_stage_name(int stage);
+static double bench_record(int stage, double start);
+static void bench_clear(void);
+
+// stats functions
+static void flush_lens_counters(struct _lua_ctx *ctx);
+static void update_stats(void);
+static float lens_build_progress(void);
+static int get_stats_lines(char (*lines)[STATS_LINE_LEN]);
+
 // palette functions
 static int find_closest_pal_index(int r, int g, int b);
 static void create_palmap(void);
 
-// lua initializer
+// lua initializers
+static lua_State *new_lua_state(void);
 static void init_lua(void);
 
 // c->lua (c functions for use in lua)
@@ -575,18 +1066,40 @@ static int CtoLUA_ray_to_latlon(lua_State *L);
 static int CtoLUA_plate_to_ray(lua_State *L);
 
 // lua->c (lua functions for use in c)
-static int LUAtoC_lens_inverse(double x, double y, vec3_t ray);
-static int LUAtoC_lens_forward(vec3_t ray, double *x, double *y);
-static int LUAtoC_globe_plate(vec3_t ray, int *plate);
+static int LUAtoC_lens_inverse(struct _lua_ctx *ctx, double x, double y, vec3_t ray);
+static int LUAtoC_lens_forward(struct _lua_ctx *ctx, vec3_t ray, double *x, double *y);
+static int LUAtoC_globe_plate(struct _lua_ctx *ctx, vec3_t ray, int *plate);
+static int LUAtoC_lens_inverse_row(struct _lua_ctx *ctx, double y, double x0, double dx, int n);
+static int LUAtoC_lens_forward_batch(struct _lua_ctx *ctx, int n);
+#ifdef USE_LUAJIT
+static int LUAtoC_lens_inverse_row_ffi(struct _lua_ctx *ctx, double y, double x0, double dx, int n);
+static int LUAtoC_lens_forward_batch_ffi(struct _lua_ctx *ctx, int n);
+#endif
+static qboolean lua_ctx_reserve(struct _lua_ctx *ctx, int n);
+static void lua_ctx_free(struct _lua_ctx *ctx);
+static qboolean batch_isnan(double x);
+static void lua_ctx_error(struct _lua_ctx *ctx, const char *fmt, ...)
+   __attribute__((format(printf,2,3)));
 
 // functions to manage the data and functions in the Lua interpreter state
 static qboolean LUA_load_lens(void);
 static qboolean LUA_load_globe(void);
+static qboolean LUA_load_worker(struct _lens_worker *worker);
 static void LUA_clear_lens(void);
 static void LUA_clear_globe(void);
 
+// lens mapping functions (native if available, lua otherwise)
+static int lens_inverse(struct _lua_ctx *ctx, double x, double y, vec3_t ray);
+static int lens_forward(struct _lua_ctx *ctx, vec3_t ray, double *x, double *y);
+
+// native lenses
+static qboolean load_native_lens(void);
+
 // lua helpers
 static qboolean lua_func_exists(const char* name);
+static void lua_ref_batch_funcs(lua_State *L, struct _lua_refs *refs);
+static void lua_clear_refs(struct _lua_refs *refs);
+static void lua_unref(lua_State *L, int *ref);
 
 // zoom functions
 static qboolean calc_zoom(void);
@@ -594,13 +1107,14 @@ static void clear_zoom(void);
 static void print_zoom(void);
 
 // lens pixel setters
-static void set_lensmap_grid(int lx, int ly, int px, int py, int plate_index);
+static int set_lensmap_grid(int px, int py, int plate_index);
 static void set_lensmap_from_plate(int lx, int ly, int px, int py, int plate_index);
 static void set_lensmap_from_plate_uv(int lx, int ly, double u, double v, int plate_index);
-static void set_lensmap_from_ray(int lx, int ly, double sx, double sy, double sz);
+static void set_lensmap_from_ray(struct _lua_ctx *ctx, int lx, int ly, double sx, double sy, double sz);
 
 // globe plate getters
-static int ray_to_plate_index(vec3_t ray);
+static int ray_to_plate_index(struct _lua_ctx *ctx, vec3_t ray);
+static void bake_plate_lookup(void);
 static qboolean ray_to_plate_uv(int plate_index, vec3_t ray, double *u, double *v);
 
 // pure coordinate convertors
@@ -609,22 +1123,79 @@ static void ray_to_latlon(vec3_t ray, double *lat, double *lon);
 static void plate_uv_to_ray(int plate_index, double u, double v, vec3_t ray);
 
 // forward map getter/setter helpers
-static int uv_to_screen(int plate_index, double u, double v, int *lx, int *ly);
-static void draw_quad(int *tl, int *tr, int *bl, int *br, int plate_index, int px, int py);
+static int uv_to_screen(int plate_index, double u, double v, struct _lens_vertex *vert);
+static int uv_row_to_screen(int plate_index, double v, double u0, int count,
+      struct _lens_vertex *verts);
+static qboolean is_quad_split(const struct _lens_vertex *top, const struct _lens_vertex *bot,
+      int px, int platesize);
+static void draw_triangle(const struct _lens_vertex *a, const struct _lens_vertex *b,
+      const struct _lens_vertex *c, int plate_index, int px, int py, qboolean owned);
+static void draw_quad(const struct _lens_vertex *tl, const struct _lens_vertex *tr,
+      const struct _lens_vertex *bl, const struct _lens_vertex *br,
+      int plate_index, int px, int py, qboolean owned);
 
 // lens builder resumers
 static void resume_lensmap(void);
 static qboolean resume_lensmap_inverse(void);
 static qboolean resume_lensmap_forward(void);
+static qboolean resume_lensmap_field(void);
+static qboolean build_lensmap_inverse_row(struct _lua_ctx *ctx, int ly);
+static int inverse_lensmap_units(void);
+static qboolean build_lensmap_inverse_unit(struct _lua_ctx *ctx, int unit);
+static qboolean build_lensmap_inverse_cells(struct _lua_ctx *ctx, int cy);
+static int center_out_index(int k, int n);
+static qboolean build_lensmap_preview_row(struct _lua_ctx *ctx, int row);
+
+// lens worker threads
+static void lens_worker_main(void *arg);
+static qboolean start_lens_workers(void);
+static qboolean poll_lens_workers(void);
+static void stop_lens_workers(void);
+
+// lens cache functions
+static unsigned int hash_bytes(unsigned int hash, const void *data, size_t len);
+static unsigned int hash_file(unsigned int hash, const char *filename);
+static void set_lens_cache_key(void);
+static qboolean load_lens_cache(void);
+static void save_lens_cache(void);
+static void finish_lens_cache_write(void);
+
+// ray field functions
+static unsigned int ray_field_key(void);
+static void ray_field_view(double *halfw, double *halfh);
+static qboolean ray_field_covers_view(void);
+static qboolean create_ray_field(void);
+static qboolean build_ray_field_row(struct _lua_ctx *ctx, int row);
+static void build_lensmap_field_row(struct _lua_ctx *ctx, int ly);
 
 // lens creators
-static void create_lensmap_inverse(void);
+static void create_lensmap_inverse(qboolean replace);
+static void create_lensmap_field(void);
 static void create_lensmap_forward(void);
 static void create_lensmap(void);
+static void refine_lensmap(void);
+
+// lens finishing functions
+static void finish_lensmap(void);
+static void resize_plates(void);
+static void unresize_plates(void);
+static void build_lens_spans(void);
+static void find_plate_bounds(void);
+static void render_lensmap_band(void *arg, int band);
+static void render_span(byte *dst, const unsigned int *src, int len);
+static void render_span_tinted(byte *dst, const unsigned int *src, int len);
+static qboolean render_span_simd_supported(void);
 
 // renderers
 static void render_lensmap(void);
 static void render_plate(int plate_index, vec3_t forward, vec3_t right, vec3_t up);
+static void render_plate_job(void *arg, int index);
+static int plate_refresh_frames(int plate_index);
+static qboolean plate_needs_render(int plate_index, vec3_t forward, vec3_t up);
+static int plates_surface_cache_size(void);
+static void set_plate_warp(int plate_index, vec3_t forward, vec3_t right, vec3_t up);
+static unsigned int reproject_texel(int plate_index, unsigned int offset);
+static void render_span_reprojected(byte *dst, const unsigned int *src, int len);
 
 // globe saver functions
 static void WritePCXplate(char *filename, int plate_index, int with_margins);
@@ -633,6 +1204,10 @@ static void save_globe(void);
 // retrieves a pointer to a pixel in the video buffer
 #define VBUFFER(x,y) (vid.buffer + (x) + (y)*vid.rowbytes)
 
+// FNV-1a hash constants (for the lens cache key)
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
 // -------------------------------------------------------------------------------- 
 // |                                                                              |
 // |                        PUBLIC MAIN FUNCTIONS                                 |
@@ -643,9 +1218,30 @@ void F_Init(void)
 {
    lens_builder.working = false;
    lens_builder.seconds_per_frame = 1.0f / 60;
+   lens_builder.grid.cellsize = 8;
+   lens_builder.grid.maxerror = 0.05f;
+   lens_builder.preview = true;
+
+   lens_cache.enabled = true;
+   lens_cache.max_mb = 256;
+
+   // leave a cpu for the main thread, which renders while the workers build
+   lens_workers.wanted = qmax(Thread_NumCPUs() - 1, 1);
+
+   lens_spans.simd_supported = render_span_simd_supported();
+   lens_spans.simd_enabled = lens_spans.simd_supported;
+
+   // the main thread draws too, so we only need one pool thread per extra cpu
+   Thread_SetPoolSize(Thread_NumCPUs() - 1);
 
    rubix.enabled = false;
 
+   globe.min_plate_scale = 0.5f;
+   globe.refresh.frames = 1;
+   globe.refresh.maxangle = 5;
+   globe.refresh.reproject_enabled = true;
+   globe.threaded = true;
+
    init_lua();
 
    Cmd_AddCommand("fisheye", cmd_fisheye);
@@ -663,6 +1259,21 @@ void F_Init(void)
    Cmd_SetCompletion("f_globe", cmdarg_globe);
    Cmd_AddCommand("f_saveglobe", cmd_saveglobe);
    Cmd_AddCommand("f_shortcutkeys", cmd_shortcutkeys);
+   Cmd_AddCommand("f_lenscache", cmd_lenscache);
+   Cmd_AddCommand("f_lensthreads", cmd_lensthreads);
+   Cmd_AddCommand("f_lenssimd", cmd_lenssimd);
+   Cmd_AddCommand("f_drawthreads", cmd_drawthreads);
+   Cmd_AddCommand("f_platethreads", cmd_platethreads);
+   Cmd_AddCommand("f_platesize", cmd_platesize);
+   Cmd_AddCommand("f_plateminscale", cmd_plateminscale);
+   Cmd_AddCommand("f_platerefresh", cmd_platerefresh);
+   Cmd_AddCommand("f_platereproject", cmd_platereproject);
+   Cmd_AddCommand("f_stats", cmd_stats);
+   Cmd_AddCommand("f_statsdump", cmd_statsdump);
+   Cmd_AddCommand("f_lensgrid", cmd_lensgrid);
+   Cmd_AddCommand("f_lensgridcheck", cmd_lensgridcheck);
+   Cmd_AddCommand("f_lenspreview", cmd_lenspreview);
+   Cmd_AddCommand("f_benchmark", cmd_benchmark);
 
    // defaults
    Cmd_ExecuteString("fisheye 1", src_command);
@@ -671,12 +1282,33 @@ void F_Init(void)
    Cmd_ExecuteString("f_fov 180", src_command);
    Cmd_ExecuteString("f_rubixgrid 10 4 1", src_command);
 
+   // run a benchmark after the config has been executed, then quit
+   // (-fisheyebench <demo> [outfile] [lens] [globe])
+   int i = COM_CheckParm("-fisheyebench");
+   if (i) {
+      char cmd[MAX_OSPATH * 2];
+      snprintf(cmd, sizeof(cmd), "f_benchmark");
+      for (++i; i < com_argc && com_argv[i][0] != '-' && com_argv[i][0] != '+'; ++i) {
+         strncat(cmd, va(" \"%s\"", com_argv[i]), sizeof(cmd) - strlen(cmd) - 1);
+      }
+      strncat(cmd, "\n", sizeof(cmd) - strlen(cmd) - 1);
+      Cbuf_AddText("%s", cmd);
+      benchmark.quit = true;
+   }
+
    // create palette maps
    create_palmap();
 }
 
 void F_Shutdown(void)
 {
+   stop_lens_workers();
+   finish_lens_cache_write();
+   Thread_SetPoolSize(0);
+   free(lens_spans.span);
+   free(lens_builder.forward_state.grid);
+   free(ray_field.rays);
+   bench_clear();
    lua_close(lua);
 }
 
@@ -686,6 +1318,12 @@ void F_WriteConfig(FILE* f)
    fprintf(f,"f_lens \"%s\"\n", lens.name);
    fprintf(f,"f_globe \"%s\"\n", globe.name);
    fprintf(f,"f_rubixgrid %d %f %f\n", rubix.numcells, rubix.cell_size, rubix.pad_size);
+   fprintf(f,"f_platesize %d\n", globe.platesize_wanted);
+   fprintf(f,"f_plateminscale %g\n", globe.min_plate_scale);
+   fprintf(f,"f_platerefresh %d %g\n", globe.refresh.frames, globe.refresh.maxangle);
+   fprintf(f,"f_platereproject %d\n", globe.refresh.reproject_enabled);
+   fprintf(f,"f_lensgrid %d %g\n", lens_builder.grid.cellsize, lens_builder.grid.maxerror);
+   fprintf(f,"f_lenspreview %d\n", lens_builder.preview);
    switch (zoom.type) {
       case ZOOM_FOV:     fprintf(f,"f_fov %d\n", zoom.fov); break;
       case ZOOM_VFOV:    fprintf(f,"f_vfov %d\n", zoom.fov); break;
@@ -699,50 +1337,82 @@ void F_RenderView(void)
 {
    static int pwidth = -1;
    static int pheight = -1;
+   static int pplatesize = -1;
+
+   double frame_start = Sys_DoubleTime();
+
+   int i;
+   for (i=0; i<NUM_BENCH_STAGES; i++) {
+      fisheye_stats.seconds[i] = -1;
+   }
 
    // update screen size
    lens.width_px = scr_vrect.width;
    lens.height_px = scr_vrect.height;
    #define MIN(a,b) ((a) < (b) ? (a) : (b))
-   int platesize = globe.platesize = MIN(lens.height_px, lens.width_px);
+   int platesize = globe.platesize_wanted ? globe.platesize_wanted : MIN(lens.height_px, lens.width_px);
+   if (platesize > max_platesize()) {
+      if (pplatesize != max_platesize()) {
+         Con_Printf("f_platesize %d is too large, using the maximum of %d\n", platesize, max_platesize());
+      }
+      platesize = max_platesize();
+   }
+   globe.platesize = platesize;
    int area = lens.width_px * lens.height_px;
-   int sizechange = (pwidth!=lens.width_px) || (pheight!=lens.height_px);
+   int sizechange = (pwidth!=lens.width_px) || (pheight!=lens.height_px) || (pplatesize!=platesize);
+
+   // stop the lens workers before touching the lensmap they are writing to
+   if (sizechange || zoom.changed || lens.changed || globe.changed) {
+      stop_lens_workers();
+   }
 
    // allocate new buffers if size changes
    if(sizechange)
    {
       if(globe.pixels) free(globe.pixels);
+      if(globe.zbuffer) free(globe.zbuffer);
       if(lens.pixels) free(lens.pixels);
-      if(lens.pixel_tints) free(lens.pixel_tints);
 
-      globe.pixels = (byte*)malloc(platesize*platesize*MAX_PLATES*sizeof(byte));
-      lens.pixels = (byte**)malloc(area*sizeof(byte*));
-      lens.pixel_tints = (byte*)malloc(area*sizeof(byte));
+      // (padded so the span renderer can read whole words at the last pixel)
+      globe.pixels = (byte*)malloc(platesize*platesize*MAX_PLATES*sizeof(byte) + GLOBE_PIXELS_PAD);
+      globe.zbuffer = (short*)malloc(platesize*platesize*MAX_PLATES*sizeof(short));
+      lens.pixels = (unsigned int*)malloc(area*sizeof(unsigned int));
       
       // the rude way
-      if(!globe.pixels || !lens.pixels || !lens.pixel_tints) {
+      if(!globe.pixels || !globe.zbuffer || !lens.pixels) {
          Con_Printf("Quake-Lenses: could not allocate enough memory\n");
          exit(1); 
       }
    }
 
    // recalculate lens
+   double build_start = Sys_DoubleTime();
    if (sizechange || zoom.changed || lens.changed || globe.changed) {
-      memset(lens.pixels, 0, area*sizeof(byte*));
-      memset(lens.pixel_tints, 255, area*sizeof(byte));
+      memset(lens.pixels, 0xFF, area*sizeof(unsigned int));
 
       // load lens again
       // (NOTE: this will be the second time this lens will be loaded in this frame if it has just changed)
       // (I'm just trying to force re-evaluation of lens variables that are dependent on globe variables (e.g. "lens_width = numplates" in debug.lua))
-      lens.valid = LUA_load_lens();
-      if (!lens.valid) {
-         strcpy(lens.name,"");
-         Con_Printf("not a valid lens\n");
+      // (the zoom does not change any lens variables, so zooming skips this)
+      qboolean zoomonly = zoom.changed && !sizechange && !lens.changed && !globe.changed;
+      if (!zoomonly || !lens.valid) {
+         lens.valid = LUA_load_lens();
+         if (!lens.valid) {
+            strcpy(lens.name,"");
+            Con_Printf("not a valid lens\n");
+         }
       }
       create_lensmap();
+      bench_record(BENCH_LENS_BUILD, build_start);
    }
    else if (lens_builder.working) {
       resume_lensmap();
+      bench_record(BENCH_LENS_BUILD, build_start);
+   }
+   else if (lens_builder.field_state.active && !lens_builder.failed) {
+      // the zoom has stopped, so build the exact lensmap
+      refine_lensmap();
+      bench_record(BENCH_LENS_BUILD, build_start);
    }
 
    // get the orientations required to render the plates
@@ -760,14 +1430,30 @@ void F_RenderView(void)
    R_SetVrect(&vrect, &scr_vrect, sb_lines);
 
    // render plates
-   int i;
+   double plates_start = Sys_DoubleTime();
+   globe.refresh.reproject = false;
+   fisheye_stats.displayed = fisheye_stats.rendered = fisheye_stats.reprojected = 0;
+
+   // the plates are all views of the same scene, so the world traversal and
+   // the dynamic lights are done once for all of them, and they share the
+   // lit surfaces.  The cache must hold all of those at once or each plate
+   // evicts the surfaces built for the last one.
+   surfcache_stats_t surfstats = d_surfcache_stats;
+   R_BeginScene();
+   R_PushDlights();
+   D_ReserveSurfaceCache(plates_surface_cache_size());
+   globe.numrenders = 0;
    for (i=0; i<globe.numplates; ++i)
    {
-      if (globe.plates[i].display) {
+      globe.plates[i].reproject = false;
 
-         // set view to change plate FOV
-         fisheye_plate_fov = globe.plates[i].fov;
-         R_ViewChanged(&vrect, sb_lines, vid.aspect);
+      // (plates can be displayed and then covered over by the forward builder)
+      qboolean unused = globe.bounds_valid && !globe.plates[i].bounds.width && !globe.save.should;
+      if (!globe.plates[i].display || unused) {
+         globe.plates[i].rendered = false;
+      }
+      else {
+         fisheye_stats.displayed++;
 
          // compute absolute view vectors
          // right = x
@@ -789,9 +1475,31 @@ void F_RenderView(void)
          VectorMA(f, globe.plates[i].forward[1], up, f);
          VectorMA(f, globe.plates[i].forward[2], forward, f);
 
-         render_plate(i, f, r, u);
+         if (plate_needs_render(i, f, u)) {
+            int n = globe.numrenders++;
+            globe.renders[n].plate = i;
+            VectorCopy(f, globe.renders[n].forward);
+            VectorCopy(r, globe.renders[n].right);
+            VectorCopy(u, globe.renders[n].up);
+         }
+         else if (globe.refresh.reproject_enabled) {
+            set_plate_warp(i, f, r, u);
+            fisheye_stats.reprojected += globe.plates[i].reproject;
+         }
+      }
+   }
+   if (!globe.threaded || !R_RenderViews(render_plate_job, NULL, globe.numrenders)) {
+      for (i=0; i<globe.numrenders; ++i) {
+         render_plate_job(NULL, i);
       }
    }
+   fisheye_stats.rendered = globe.numrenders;
+   globe.refresh.frame++;
+   bench_record(BENCH_PLATES, plates_start);
+
+   fisheye_stats.surf_hits = d_surfcache_stats.hits - surfstats.hits;
+   fisheye_stats.surf_misses = d_surfcache_stats.misses - surfstats.misses;
+   fisheye_stats.surf_rebuilds = d_surfcache_stats.rebuilds - surfstats.rebuilds;
 
    // save plates upon request from the "saveglobe" command
    if (globe.save.should) {
@@ -800,14 +1508,20 @@ void F_RenderView(void)
 
    // render our view
    Draw_TileClear(0, 0, vid.width, vid.height);
+   double lensmap_start = Sys_DoubleTime();
    render_lensmap();
+   bench_record(BENCH_LENSMAP, lensmap_start);
 
    // store current values for change detection
    pwidth = lens.width_px;
    pheight = lens.height_px;
+   pplatesize = platesize;
 
    // reset change flags
    lens.changed = globe.changed = zoom.changed = false;
+
+   bench_record(BENCH_FRAME, frame_start);
+   update_stats();
 }
 
 // -------------------------------------------------------------------------------- 
@@ -825,6 +1539,323 @@ static qboolean is_lens_builder_time_up(void) {
    return (s >= lens_builder.seconds_per_frame);
 }
 
+// -------------------------------------------------------------------------------- 
+// |                                                                              |
+// |                           BENCHMARK FUNCTIONS                                |
+// |                                                                              |
+// --------------------------------------------------------------------------------
+
+static const char *bench_stage_name(int stage)
+{
+   static char name[16];
+   switch (stage) {
+      case BENCH_FRAME:      return "frame";
+      case BENCH_LENS_BUILD: return "lens_build";
+      case BENCH_PLATES:     return "plates";
+      case BENCH_LENSMAP:    return "render_lensmap";
+   }
+   snprintf(name, sizeof(name), "plate%d", stage - BENCH_PLATE0);
+   return name;
+}
+
+// records the time since start for a stage of this frame (also kept for f_stats)
+static double bench_record(int stage, double start)
+{
+   double seconds = Sys_DoubleTime() - start;
+   fisheye_stats.seconds[stage] = seconds;
+   if (!benchmark.running) {
+      return seconds;
+   }
+
+   struct _bench_stage *s = &benchmark.stage[stage];
+   if (s->count == s->size) {
+      int size = s->size ? s->size*2 : 1024;
+      float *samples = realloc(s->samples, size*sizeof(float));
+      if (!samples) {
+         return seconds;
+      }
+      s->samples = samples;
+      s->size = size;
+   }
+   s->samples[s->count++] = seconds;
+   return seconds;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+   float fa = *(const float *)a, fb = *(const float *)b;
+   return (fa > fb) - (fa < fb);
+}
+
+// summary of a stage, in milliseconds
+struct _bench_summary
+{
+   int count;
+   double mean, p50, p99, max, total;
+};
+static void bench_summarize(struct _bench_stage *s, struct _bench_summary *sum)
+{
+   int i;
+   memset(sum, 0, sizeof(*sum));
+   sum->count = s->count;
+   if (!s->count) {
+      return;
+   }
+
+   qsort(s->samples, s->count, sizeof(float), bench_compare);
+   for (i=0; i<s->count; i++) {
+      sum->total += s->samples[i];
+   }
+   sum->mean = 1000 * sum->total / s->count;
+   sum->p50 = 1000 * s->samples[(s->count-1)/2];
+   sum->p99 = 1000 * s->samples[(int)ceil(0.99*s->count) - 1];
+   sum->max = 1000 * s->samples[s->count-1];
+   sum->total *= 1000;
+}
+
+static void bench_write_csv(FILE *f, struct _bench_summary *sums)
+{
+   int i;
+
+   // (appended to, so a header is only needed for a new file)
+   fseek(f, 0, SEEK_END);
+   if (ftell(f) == 0) {
+      fprintf(f, "lens,globe,width,height,platesize,stage,count,mean_ms,p50_ms,p99_ms,max_ms,total_ms\n");
+   }
+   for (i=0; i<NUM_BENCH_STAGES; i++) {
+      if (!sums[i].count) {
+         continue;
+      }
+      fprintf(f, "%s,%s,%d,%d,%d,%s,%d,%.4f,%.4f,%.4f,%.4f,%.2f\n",
+            lens.name, globe.name, lens.width_px, lens.height_px, globe.platesize,
+            bench_stage_name(i), sums[i].count,
+            sums[i].mean, sums[i].p50, sums[i].p99, sums[i].max, sums[i].total);
+   }
+}
+
+static void bench_write_json(FILE *f, struct _bench_summary *sums)
+{
+   int i;
+   qboolean first = true;
+
+   fprintf(f, "{\n");
+   fprintf(f, "  \"lens\": \"%s\",\n", lens.name);
+   fprintf(f, "  \"globe\": \"%s\",\n", globe.name);
+   fprintf(f, "  \"width\": %d,\n", lens.width_px);
+   fprintf(f, "  \"height\": %d,\n", lens.height_px);
+   fprintf(f, "  \"platesize\": %d,\n", globe.platesize);
+   fprintf(f, "  \"stages\": {\n");
+   for (i=0; i<NUM_BENCH_STAGES; i++) {
+      if (!sums[i].count) {
+         continue;
+      }
+      fprintf(f, "%s    \"%s\": { \"count\": %d, \"mean_ms\": %.4f, \"p50_ms\": %.4f, "
+            "\"p99_ms\": %.4f, \"max_ms\": %.4f, \"total_ms\": %.2f }",
+            first ? "" : ",\n", bench_stage_name(i), sums[i].count,
+            sums[i].mean, sums[i].p50, sums[i].p99, sums[i].max, sums[i].total);
+      first = false;
+   }
+   fprintf(f, "\n  }\n}\n");
+}
+
+static void bench_clear(void)
+{
+   int i;
+   for (i=0; i<NUM_BENCH_STAGES; i++) {
+      free(benchmark.stage[i].samples);
+   }
+   memset(benchmark.stage, 0, sizeof(benchmark.stage));
+}
+
+void F_FinishBenchmark(void)
+{
+   struct _bench_summary sums[NUM_BENCH_STAGES];
+   int i;
+
+   if (!benchmark.running) {
+      return;
+   }
+   benchmark.running = false;
+   lens_cache.enabled = benchmark.lens_cache_enabled;
+
+   for (i=0; i<NUM_BENCH_STAGES; i++) {
+      bench_summarize(&benchmark.stage[i], &sums[i]);
+   }
+
+   Con_Printf("fisheye benchmark: %s %s %dx%d\n", lens.name, globe.name, lens.width_px, lens.height_px);
+   Con_Printf("%-16s %6s %9s %9s %9s %9s\n", "stage", "count", "mean ms", "p50 ms", "p99 ms", "max ms");
+   for (i=0; i<NUM_BENCH_STAGES; i++) {
+      if (sums[i].count) {
+         Con_Printf("%-16s %6d %9.3f %9.3f %9.3f %9.3f\n", bench_stage_name(i), sums[i].count,
+               sums[i].mean, sums[i].p50, sums[i].p99, sums[i].max);
+      }
+   }
+
+   if (benchmark.output[0]) {
+      char path[MAX_OSPATH + sizeof(benchmark.output)];
+      FILE *f = NULL;
+      qboolean json = COM_CheckExtension(benchmark.output, "json");
+      if (snprintf(path, sizeof(path), "%s/%s", com_gamedir, benchmark.output) >= sizeof(path)) {
+         Con_Printf("benchmark output path is too long\n");
+      }
+      else if ((f = fopen(path, json ? "w" : "a")) == NULL) {
+         Con_Printf("could not write %s\n", path);
+      }
+      else {
+         if (json) {
+            bench_write_json(f, sums);
+         }
+         else {
+            bench_write_csv(f, sums);
+         }
+         fclose(f);
+         Con_Printf("wrote %s\n", path);
+      }
+   }
+
+   bench_clear();
+
+   if (benchmark.quit) {
+      Cbuf_AddText("quit\n");
+   }
+}
+
+// -------------------------------------------------------------------------------- 
+// |                                                                              |
+// |                             STATS FUNCTIONS                                  |
+// |                                                                              |
+// --------------------------------------------------------------------------------
+
+// add a lua context's counters to the totals
+// (each context is only used by one thread, so it counts on its own and flushes now and then)
+static void flush_lens_counters(struct _lua_ctx *ctx)
+{
+   if (ctx->rays) {
+      Thread_AtomicAdd(&fisheye_stats.rays, ctx->rays);
+      ctx->rays = 0;
+   }
+   if (ctx->lua_calls) {
+      Thread_AtomicAdd(&fisheye_stats.lua_calls, ctx->lua_calls);
+      ctx->lua_calls = 0;
+   }
+}
+
+// update the rates once a second
+static void update_stats(void)
+{
+   flush_lens_counters(&lua_main);
+
+   double now = Sys_DoubleTime();
+   double elapsed = now - fisheye_stats.rate_start;
+   if (elapsed < 1) {
+      return;
+   }
+
+   unsigned int rays = fisheye_stats.rays;
+   unsigned int lua_calls = fisheye_stats.lua_calls;
+   fisheye_stats.rays_per_sec = (rays - fisheye_stats.rate_rays) / elapsed;
+   fisheye_stats.lua_calls_per_sec = (lua_calls - fisheye_stats.rate_lua_calls) / elapsed;
+   fisheye_stats.rate_rays = rays;
+   fisheye_stats.rate_lua_calls = lua_calls;
+   fisheye_stats.rate_start = now;
+}
+
+// fraction of the current lensmap that has been built (0 to 1)
+static float lens_build_progress(void)
+{
+   if (!lens_builder.working) {
+      return 1;
+   }
+
+   if (lens_builder.field_state.active) {
+      int done = ray_field.rows_done + (lens.height_px-1 - lens_builder.field_state.ly);
+      return (float)done / (ray_field.height + lens.height_px);
+   }
+
+   if (lens.map_type == MAP_FORWARD) {
+      struct _forward_state *state = &lens_builder.forward_state;
+      int done = state->plate_index*globe.platesize + (globe.platesize-1 - state->py);
+      return (float)done / (globe.numplates*globe.platesize);
+   }
+
+   // (the workers claim units in order, so count the claimed ones)
+   int units = inverse_lensmap_units();
+   int done = lens_workers.count > 0 ?
+      qmin(lens_workers.next_row, units) : units-1 - lens_builder.inverse_state.ly;
+   return (float)done / units;
+}
+
+// print the stats into lines of text, returning the number of lines
+static int get_stats_lines(char (*lines)[STATS_LINE_LEN])
+{
+   const double *seconds = fisheye_stats.seconds;
+   int n = 0;
+   int i;
+
+   #define STATS_LINE(...) snprintf(lines[n++], STATS_LINE_LEN, __VA_ARGS__)
+
+   // (long lens and globe names are cut to fit the line)
+   int namelen = (STATS_LINE_LEN - (int)sizeof("fisheye:  / ")) / 2;
+   STATS_LINE("fisheye: %.*s / %.*s", namelen, lens.name, namelen, globe.name);
+   STATS_LINE("frame        %7.2f ms", seconds[BENCH_FRAME]*1000);
+   if (lens_builder.working) {
+      STATS_LINE("lens build   %7.2f ms %3d%%",
+            qmax(seconds[BENCH_LENS_BUILD], 0.0)*1000, (int)(lens_build_progress()*100));
+   }
+   else {
+      STATS_LINE("lens build      done");
+   }
+   STATS_LINE("  rays/s     %9.0f", fisheye_stats.rays_per_sec);
+   STATS_LINE("  lua calls/s%9.0f", fisheye_stats.lua_calls_per_sec);
+   STATS_LINE("plates       %7.2f ms", seconds[BENCH_PLATES]*1000);
+   STATS_LINE("  %d shown, %d drawn, %d reprojected",
+         fisheye_stats.displayed, fisheye_stats.rendered, fisheye_stats.reprojected);
+   for (i=0; i<globe.numplates; i++) {
+      double s = seconds[BENCH_PLATE0 + i];
+      if (s >= 0) {
+         STATS_LINE("  plate %d    %7.2f ms %dpx", i, s*1000, globe.plates[i].size);
+      }
+      else if (globe.plates[i].reproject) {
+         STATS_LINE("  plate %d     reprojected", i);
+      }
+      else if (globe.plates[i].rendered) {
+         STATS_LINE("  plate %d        reused", i);
+      }
+      else {
+         STATS_LINE("  plate %d        hidden", i);
+      }
+   }
+   STATS_LINE("lensmap      %7.2f ms", seconds[BENCH_LENSMAP]*1000);
+
+   int platearea = globe.platesize*globe.platesize;
+   int area = lens.width_px*lens.height_px;
+   STATS_LINE("globe pixels %7.2f MB", (platearea*MAX_PLATES + GLOBE_PIXELS_PAD) / (1024.0*1024));
+   STATS_LINE("globe zbuffer%7.2f MB", platearea*MAX_PLATES*sizeof(short) / (1024.0*1024));
+   STATS_LINE("lens pixels  %7.2f MB", area*sizeof(unsigned int) / (1024.0*1024));
+   STATS_LINE("surf cache   %7.2f MB", D_SurfaceCacheSize() / (1024.0*1024));
+   STATS_LINE("  %u hit %u miss %u rebuilt",
+         fisheye_stats.surf_hits, fisheye_stats.surf_misses, fisheye_stats.surf_rebuilds);
+
+   #undef STATS_LINE
+
+   return n;
+}
+
+// draw the stats over the top left of the view
+void F_DrawStats(void)
+{
+   char lines[STATS_MAX_LINES][STATS_LINE_LEN];
+
+   if (!fisheye_enabled || !fisheye_stats.show) {
+      return;
+   }
+
+   int i, n = get_stats_lines(lines);
+   for (i=0; i<n; i++) {
+      Draw_String(scr_vrect.x + 8, scr_vrect.y + 8 + i*8, lines[i]);
+   }
+}
+
 // -------------------------------------------------------------------------------- 
 // |                                                                              |
 // |                           PALLETE FUNCTIONS                                  |
@@ -1015,21 +2046,324 @@ static void cmd_shortcutkeys(void)
    }
 }
 
-static void cmd_help(void)
+static void cmd_lenscache(void)
 {
-   Con_Printf("-----------------------------\n");
-   Con_Printf("Welcome to the FISHEYE ADDON!\n");
-   Con_Printf("-> fisheye 1    (ENABLE)\n");
-   Con_Printf("-> fisheye 0    (DISABLE)\n");
-   Con_Printf("\n");
-   Con_Printf("-> f_lens <tab>    (CHANGE LENS)\n");
-   Con_Printf("-> f_fov <degrees> (SET FOV)\n");
-   Con_Printf("\n");
-   Con_Printf("-> f_<tab>         (MORE COMMANDS)\n");
-   Con_Printf("-----------------------------\n");
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_lenscache <0|1> [max MB]: save/load finished lensmaps to/from disk\n");
+      Con_Printf("   (the least recently used are removed past max MB)\n");
+      Con_Printf("Currently: f_lenscache %d %d\n", lens_cache.enabled, lens_cache.max_mb);
+      return;
+   }
+   lens_cache.enabled = Q_atoi(Cmd_Argv(1));
+   if (Cmd_Argc() >= 3) {
+      lens_cache.max_mb = Q_atoi(Cmd_Argv(2));
+      if (lens_cache.max_mb < 0) lens_cache.max_mb = 0;
+   }
 }
 
-static void cmd_fov(void)
+static void cmd_lensthreads(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_lensthreads <n>: number of threads used to build inverse lenses\n");
+      Con_Printf("   (0 = build on the main thread between frames)\n");
+      Con_Printf("Currently: f_lensthreads %d\n", lens_workers.wanted);
+      return;
+   }
+   lens_workers.wanted = Q_atoi(Cmd_Argv(1));
+   if (lens_workers.wanted < 0) lens_workers.wanted = 0;
+   if (lens_workers.wanted > MAX_LENS_WORKERS) lens_workers.wanted = MAX_LENS_WORKERS;
+}
+
+static void cmd_lenssimd(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_lenssimd <0|1>: use vector instructions to draw the lens\n");
+      Con_Printf("   (supported by this cpu: %s)\n", lens_spans.simd_supported ? "yes" : "no");
+      Con_Printf("Currently: f_lenssimd %d\n", lens_spans.simd_enabled);
+      return;
+   }
+   lens_spans.simd_enabled = Q_atoi(Cmd_Argv(1)) && lens_spans.simd_supported;
+}
+
+static void cmd_drawthreads(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_drawthreads <n>: number of threads used to draw the lens\n");
+      Con_Printf("Currently: f_drawthreads %d\n", Thread_PoolSize() + 1);
+      return;
+   }
+   Thread_SetPoolSize(Q_atoi(Cmd_Argv(1)) - 1);
+}
+
+static void cmd_platethreads(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_platethreads <0|1>: render the plates at the same time on the\n");
+      Con_Printf("   f_drawthreads threads (otherwise one after the other)\n");
+      Con_Printf("Currently: f_platethreads %d\n", globe.threaded);
+      return;
+   }
+   globe.threaded = Q_atoi(Cmd_Argv(1)) != 0;
+}
+
+static void cmd_platesize(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_platesize <n>: width and height of each globe plate in pixels\n");
+      Con_Printf("   (0 = fit the screen, otherwise %d to %d)\n", MIN_PLATESIZE, max_platesize());
+      Con_Printf("Currently: f_platesize %d\n", globe.platesize_wanted);
+      return;
+   }
+   int size = Q_atoi(Cmd_Argv(1));
+   if (size != 0) {
+      if (size < MIN_PLATESIZE) size = MIN_PLATESIZE;
+      if (size > max_platesize()) {
+         Con_Printf("f_platesize %d is too large, the maximum is %d\n", size, max_platesize());
+         size = max_platesize();
+      }
+   }
+   globe.platesize_wanted = size;
+}
+
+// largest plate size whose plate offsets fit in the packed lensmap entries
+static int max_platesize(void)
+{
+   int size = MAX_PLATESIZE;
+   while ((unsigned int)size*size*MAX_PLATES - 1 > LENSMAP_OFFSET_MASK) {
+      --size;
+   }
+   return size;
+}
+
+static void cmd_lensgrid(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_lensgrid <cellsize> [maxerror]: build inverse lenses by interpolating\n");
+      Con_Printf("   rays across cells of up to <cellsize> pixels (1 = follow every pixel's ray),\n");
+      Con_Printf("   splitting cells until the error is under [maxerror] degrees\n");
+      Con_Printf("Currently: f_lensgrid %d %g\n", lens_builder.grid.cellsize, lens_builder.grid.maxerror);
+      return;
+   }
+
+   // round down to a power of 2
+   int size = Q_atoi(Cmd_Argv(1));
+   int cellsize = 1;
+   while (cellsize*2 <= size && cellsize*2 <= MAX_LENS_GRID_CELLSIZE) {
+      cellsize *= 2;
+   }
+   lens_builder.grid.cellsize = cellsize;
+
+   if (Cmd_Argc() > 2) {
+      float maxerror = Q_atof(Cmd_Argv(2));
+      lens_builder.grid.maxerror = maxerror > 0 ? maxerror : 0;
+   }
+
+   lens.changed = true; // need to recompute lens with the new grid
+}
+
+static void cmd_lenspreview(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_lenspreview <0|1>: draw a coarse preview of inverse lenses\n");
+      Con_Printf("   before building them from the center of the screen outward\n");
+      Con_Printf("Currently: f_lenspreview %d\n", lens_builder.preview);
+      return;
+   }
+
+   lens_builder.preview = Q_atoi(Cmd_Argv(1)) != 0;
+}
+
+static void cmd_benchmark(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_benchmark <demo> [outfile] [lens] [globe]: play a timedemo and report\n");
+      Con_Printf("   the time taken by each stage of the fisheye view (building the lens,\n");
+      Con_Printf("   rendering each plate, and drawing the lensmap).  The results are\n");
+      Con_Printf("   appended to <outfile> as CSV, or written as JSON if it ends in .json\n");
+      Con_Printf("   (the lens cache is turned off while it runs)\n");
+      return;
+   }
+
+   if (benchmark.running) {
+      F_FinishBenchmark();
+   }
+
+   char demo[MAX_QPATH];
+   snprintf(demo, sizeof(demo), "%s", Cmd_Argv(1));
+   snprintf(benchmark.output, sizeof(benchmark.output), "%s", Cmd_Argc() > 2 ? Cmd_Argv(2) : "");
+   if (!strcmp(benchmark.output, "-")) {
+      benchmark.output[0] = 0;
+   }
+
+   // (the lens and globe are loaded when their commands run, so the lens
+   //  is built from scratch in the first frames of the demo)
+   benchmark.lens_cache_enabled = lens_cache.enabled;
+   lens_cache.enabled = false;
+   if (Cmd_Argc() > 3) {
+      Cmd_ExecuteString(va("f_lens \"%s\"", Cmd_Argv(3)), src_command);
+   }
+   if (Cmd_Argc() > 4) {
+      Cmd_ExecuteString(va("f_globe \"%s\"", Cmd_Argv(4)), src_command);
+   }
+   lens.changed = true;
+
+   bench_clear();
+   Cmd_ExecuteString(va("timedemo \"%s\"", demo), src_command);
+   if (!cls.timedemo) {
+      Con_Printf("f_benchmark: could not play %s\n", demo);
+      lens_cache.enabled = benchmark.lens_cache_enabled;
+      if (benchmark.quit) {
+         Cbuf_AddText("quit\n");
+      }
+      return;
+   }
+
+   fisheye_enabled = true;
+   benchmark.running = true;
+}
+
+// compare the current lensmap against the exact rays of the lens
+static void cmd_lensgridcheck(void)
+{
+   if (!lens.valid || !globe.valid || lens.map_type != MAP_INVERSE) {
+      Con_Printf("f_lensgridcheck: the current lens does not have an inverse map\n");
+      return;
+   }
+   if (lens_builder.working) {
+      Con_Printf("f_lensgridcheck: wait for the lens to finish building\n");
+      return;
+   }
+
+   int platearea = globe.platesize * globe.platesize;
+   int lx, ly;
+   int compared = 0, missing = 0, extra = 0;
+   double maxerror = 0, sumerror = 0;
+   for (ly=0; ly<lens.height_px; ly++) {
+      for (lx=0; lx<lens.width_px; lx++) {
+         unsigned int v = *LENSPIXEL(lx,ly);
+
+         // exact ray of this pixel (and the plate it should sample)
+         vec3_t ray;
+         double x = (lx-lens.width_px/2) * lens.scale;
+         double y = -(ly-lens.height_px/2) * lens.scale;
+         int status = lens_inverse(&lua_main, x, y, ray);
+         if (status == -1) {
+            return;
+         }
+         if (status == 1 && ray_to_plate_index(&lua_main, ray) < 0) {
+            status = 0;
+         }
+
+         if (status == 0 || v == LENSMAP_NONE) {
+            if (status == 1) missing++;
+            if (v != LENSMAP_NONE) extra++;
+            continue;
+         }
+
+         // ray through the center of the texel the lensmap samples
+         int offset = LENSMAP_OFFSET(v);
+         int plate = offset / platearea;
+         int size = globe.plates[plate].size;
+         int px = (offset % platearea) % size;
+         int py = (offset % platearea) / size;
+         vec3_t texel;
+         plate_uv_to_ray(plate, (px+0.5)/size, (py+0.5)/size, texel);
+
+         VectorNormalize(ray);
+         double dot = DotProduct(ray, texel);
+         double error = acos(dot > 1 ? 1 : dot) * 180 / M_PI;
+         if (error > maxerror) maxerror = error;
+         sumerror += error;
+         compared++;
+      }
+   }
+
+   Con_Printf("lens grid %d %g: %d pixels compared to the exact lens\n",
+         lens_builder.inverse_state.cellsize, lens_builder.grid.maxerror, compared);
+   Con_Printf("   error to sampled texel: mean %.4f, max %.4f degrees\n",
+         compared ? sumerror/compared : 0, maxerror);
+   Con_Printf("   pixels missing: %d, extra: %d\n", missing, extra);
+}
+
+static void cmd_plateminscale(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_plateminscale <scale>: smallest size (0 to 1) of f_platesize that plates\n");
+      Con_Printf("   can be rendered at when the lens samples them sparsely (1 = never reduce)\n");
+      Con_Printf("Currently: f_plateminscale %g\n", globe.min_plate_scale);
+      return;
+   }
+   float scale = Q_atof(Cmd_Argv(1));
+   if (scale < 0) scale = 0;
+   if (scale > 1) scale = 1;
+   if (scale != globe.min_plate_scale) {
+      globe.min_plate_scale = scale;
+      lens.changed = true; // need to recompute lens to resize plates
+   }
+}
+
+static void cmd_platerefresh(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_platerefresh <frames> [degrees]: render the plates away from the center of\n");
+      Con_Printf("   the view only every Nth frame, or when the view turns more than the given\n");
+      Con_Printf("   degrees since (0 = ignore turning).  The other frames reuse their last render.\n");
+      Con_Printf("   (plates with a \"refresh\" field in the globe script use that instead)\n");
+      Con_Printf("Currently: f_platerefresh %d %g\n", globe.refresh.frames, globe.refresh.maxangle);
+      return;
+   }
+   globe.refresh.frames = qmax(Q_atoi(Cmd_Argv(1)), 1);
+   if (Cmd_Argc() >= 3) {
+      globe.refresh.maxangle = qmax(Q_atof(Cmd_Argv(2)), 0.0f);
+   }
+}
+
+static void cmd_platereproject(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_platereproject <0|1>: correct the plates that were not rendered this frame\n");
+      Con_Printf("   (see f_platerefresh) for how far the view has turned since they were\n");
+      Con_Printf("Currently: f_platereproject %d\n", globe.refresh.reproject_enabled);
+      return;
+   }
+   globe.refresh.reproject_enabled = Q_atoi(Cmd_Argv(1)) != 0;
+}
+
+static void cmd_stats(void)
+{
+   if (Cmd_Argc() < 2) {
+      Con_Printf("f_stats <0|1>: show the fisheye timings and counters over the view\n");
+      Con_Printf("   (f_statsdump prints them to the console)\n");
+      Con_Printf("Currently: f_stats %d\n", fisheye_stats.show);
+      return;
+   }
+   fisheye_stats.show = Q_atoi(Cmd_Argv(1)) != 0;
+}
+
+static void cmd_statsdump(void)
+{
+   char lines[STATS_MAX_LINES][STATS_LINE_LEN];
+   int i, n = get_stats_lines(lines);
+   for (i=0; i<n; i++) {
+      Con_Printf("%s\n", lines[i]);
+   }
+}
+
+static void cmd_help(void)
+{
+   Con_Printf("-----------------------------\n");
+   Con_Printf("Welcome to the FISHEYE ADDON!\n");
+   Con_Printf("-> fisheye 1    (ENABLE)\n");
+   Con_Printf("-> fisheye 0    (DISABLE)\n");
+   Con_Printf("\n");
+   Con_Printf("-> f_lens <tab>    (CHANGE LENS)\n");
+   Con_Printf("-> f_fov <degrees> (SET FOV)\n");
+   Con_Printf("\n");
+   Con_Printf("-> f_<tab>         (MORE COMMANDS)\n");
+   Con_Printf("-----------------------------\n");
+}
+
+static void cmd_fov(void)
 {
    if (Cmd_Argc() < 2) { // no fov given
       Con_Printf("f_fov <degrees>: set horizontal FOV\n");
@@ -1066,6 +2400,9 @@ static void cmd_lens(void)
       return;
    }
 
+   // the lens workers have their own copy of the lens, but they share the globe
+   stop_lens_workers();
+
    // trigger change
    lens.changed = true;
 
@@ -1143,6 +2480,9 @@ static void cmd_globe(void)
       return;
    }
 
+   // stop the lens workers, since they read the globe we are about to change
+   stop_lens_workers();
+
    // trigger change
    globe.changed = true;
 
@@ -1219,10 +2559,11 @@ static void plate_uv_to_ray(int plate_index, double u, double v, vec3_t ray)
 // |                                                                              |
 // --------------------------------------------------------------------------------
 
-static void init_lua(void)
+// create a Lua state with our math aliases and C functions
+static lua_State *new_lua_state(void)
 {
    // create Lua state
-   lua = luaL_newstate();
+   lua_State *lua = luaL_newstate();
 
    // open Lua standard libraries
    luaL_openlibs(lua);
@@ -1245,7 +2586,8 @@ static void init_lua(void)
       "exp = math.exp\n"
       "pi = math.pi\n"
       "tau = math.pi*2\n"
-      "pow = math.pow\n";
+      "pow = math.pow\n"
+      "table.unpack = table.unpack or unpack\n";
 
    int error = luaL_loadbuffer(lua, aliases, strlen(aliases), "aliases") ||
       lua_pcall(lua, 0, 0, 0);
@@ -1262,6 +2604,76 @@ static void init_lua(void)
 
    lua_pushcfunction(lua, CtoLUA_plate_to_ray);
    lua_setglobal(lua, "plate_to_ray");
+
+#ifdef USE_LUAJIT
+   // The JIT cannot compile across calls to C functions, so the converters are
+   // redefined in Lua.  The __ffi_* shims give a batched lens function a
+   // pointer to our buffers (offset so it can keep using 1-based indexes), and
+   // the __lens_* loops batch the lenses that only have per-pixel functions.
+   char *prelude =
+      "local ffi = require('ffi')\n"
+      "local doubles = ffi.typeof('double *')\n"
+      "local cos, sin, atan2, sqrt = math.cos, math.sin, math.atan2, math.sqrt\n"
+      "function latlon_to_ray(lat,lon)\n"
+      "   local clat = cos(lat)\n"
+      "   return sin(lon)*clat, sin(lat), cos(lon)*clat\n"
+      "end\n"
+      "function ray_to_latlon(x,y,z)\n"
+      "   return atan2(y,sqrt(x*x+z*z)), atan2(x,z)\n"
+      "end\n"
+      "function __ffi_inverse_row(f,y,x0,dx,n,rays)\n"
+      "   f(y,x0,dx,n,ffi.cast(doubles,rays)-1)\n"
+      "end\n"
+      "function __ffi_forward_batch(f,rays,n,xy)\n"
+      "   f(ffi.cast(doubles,rays)-1,n,ffi.cast(doubles,xy)-1)\n"
+      "end\n"
+      "function __lens_inverse_row(y,x0,dx,n,rays)\n"
+      "   local inverse = lens_inverse\n"
+      "   for i=0,n-1 do\n"
+      "      local x,y,z = inverse(x0+i*dx,y)\n"
+      "      if x then rays[3*i+1],rays[3*i+2],rays[3*i+3] = x,y,z\n"
+      "      else rays[3*i+1] = 0/0 end\n"
+      "   end\n"
+      "end\n"
+      "function __lens_forward_batch(rays,n,xy)\n"
+      "   local forward = lens_forward\n"
+      "   for i=0,n-1 do\n"
+      "      local x,y = forward(rays[3*i+1],rays[3*i+2],rays[3*i+3])\n"
+      "      if x then xy[2*i+1],xy[2*i+2] = x,y\n"
+      "      else xy[2*i+1] = 0/0 end\n"
+      "   end\n"
+      "end\n";
+
+   error = luaL_loadbuffer(lua, prelude, strlen(prelude), "prelude") ||
+      lua_pcall(lua, 0, 0, 0);
+   if (error) {
+      fprintf(stderr, "%s", lua_tostring(lua, -1));
+      lua_pop(lua, 1);  // pop error message from the stack
+   }
+#endif
+
+   return lua;
+}
+
+static void init_lua(void)
+{
+   lua = new_lua_state();
+
+   lua_main.L = lua;
+   lua_main.refs = &lua_refs;
+   lua_clear_refs(&lua_refs);
+   lua_main.error = NULL;
+   lua_main.errorsize = 0;
+   lua_main.batch_size = 0;
+}
+
+// true if x is a NaN (which the batched lens functions use for "no point")
+// (tested on the bits, since -ffast-math lets the compiler assume x == x)
+static qboolean batch_isnan(double x)
+{
+   uint64_t bits;
+   memcpy(&bits, &x, sizeof(bits));
+   return (bits & 0x7fffffffffffffffULL) > 0x7ff0000000000000ULL;
 }
 
 // -------------------------------------------------------------------------------- 
@@ -1313,13 +2725,13 @@ static qboolean calc_zoom(void)
       }
 
       // try to scale based on FOV using the forward map
-      if (lua_refs.lens_forward != -1) {
+      if (lua_refs.lens_forward != -1 || (lens.native && lens.native->forward)) {
          vec3_t ray;
          double x,y;
          double fovr = zoom.fov * M_PI / 180;
          if (zoom.type == ZOOM_FOV) {
             latlon_to_ray(0,fovr*0.5,ray);
-            if (LUAtoC_lens_forward(ray,&x,&y)) {
+            if (lens_forward(&lua_main,ray,&x,&y)) {
                lens.scale = x / (lens.width_px * 0.5);
             }
             else {
@@ -1329,7 +2741,7 @@ static qboolean calc_zoom(void)
          }
          else if (zoom.type == ZOOM_VFOV) {
             latlon_to_ray(fovr*0.5,0,ray);
-            if (LUAtoC_lens_forward(ray,&x,&y)) {
+            if (lens_forward(&lua_main,ray,&x,&y)) {
                lens.scale = y / (lens.height_px * 0.5);
             }
             else {
@@ -1396,7 +2808,7 @@ static qboolean calc_zoom(void)
 static void WritePCXplate(char *filename, int plate_index, int with_margins)
 {
     // parameters from WritePCXfile
-    int platesize = globe.platesize;
+    int platesize = globe.plates[plate_index].size;
     byte *data = GLOBEPIXEL(plate_index,0,0);
     int width = platesize;
     int height = platesize;
@@ -1440,7 +2852,7 @@ static void WritePCXplate(char *filename, int plate_index, int with_margins)
           // 
           vec3_t ray;
           plate_uv_to_ray(plate_index, u, v, ray);
-          byte col = with_margins || plate_index == ray_to_plate_index(ray) ? *data : 0xFE;
+          byte col = with_margins || plate_index == ray_to_plate_index(&lua_main, ray) ? *data : 0xFE;
 
           if ((col & 0xc0) == 0xc0) {
              *pack++ = 0xc1;
@@ -1542,10 +2954,12 @@ static int CtoLUA_plate_to_ray(lua_State *L)
 // |                                                                              |
 // --------------------------------------------------------------------------------
 
-static int LUAtoC_lens_inverse(double x, double y, vec3_t ray)
+static int LUAtoC_lens_inverse(struct _lua_ctx *ctx, double x, double y, vec3_t ray)
 {
+   lua_State *lua = ctx->L;
+   ctx->lua_calls++;
    int top = lua_gettop(lua);
-   lua_rawgeti(lua, LUA_REGISTRYINDEX, lua_refs.lens_inverse);
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->lens_inverse);
    lua_pushnumber(lua, x);
    lua_pushnumber(lua, y);
    lua_call(lua, 2, LUA_MULTRET);
@@ -1563,7 +2977,7 @@ static int LUAtoC_lens_inverse(double x, double y, vec3_t ray)
             status = 1;
          }
          else {
-            Con_Printf("lens_inverse returned a non-number value for x,y,z\n");
+            lua_ctx_error(ctx, "lens_inverse returned a non-number value for x,y,z\n");
             status = -1;
          }
          break;
@@ -1574,12 +2988,12 @@ static int LUAtoC_lens_inverse(double x, double y, vec3_t ray)
          }
          else {
             status = -1;
-            Con_Printf("lens_inverse returned a single non-nil value\n");
+            lua_ctx_error(ctx, "lens_inverse returned a single non-nil value\n");
          }
          break;
 
       default:
-         Con_Printf("lens_inverse returned %d values instead of 3\n", numret);
+         lua_ctx_error(ctx, "lens_inverse returned %d values instead of 3\n", numret);
          status = -1;
    }
 
@@ -1587,10 +3001,12 @@ static int LUAtoC_lens_inverse(double x, double y, vec3_t ray)
    return status;
 }
 
-static int LUAtoC_lens_forward(vec3_t ray, double *x, double *y)
+static int LUAtoC_lens_forward(struct _lua_ctx *ctx, vec3_t ray, double *x, double *y)
 {
+   lua_State *lua = ctx->L;
+   ctx->lua_calls++;
    int top = lua_gettop(lua);
-   lua_rawgeti(lua, LUA_REGISTRYINDEX, lua_refs.lens_forward);
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->lens_forward);
    lua_pushnumber(lua,ray[0]);
    lua_pushnumber(lua,ray[1]);
    lua_pushnumber(lua,ray[2]);
@@ -1607,7 +3023,7 @@ static int LUAtoC_lens_forward(vec3_t ray, double *x, double *y)
             status = 1;
          }
          else {
-            Con_Printf("lens_forward returned a non-number value for x,y\n");
+            lua_ctx_error(ctx, "lens_forward returned a non-number value for x,y\n");
             status = -1;
          }
          break;
@@ -1618,12 +3034,12 @@ static int LUAtoC_lens_forward(vec3_t ray, double *x, double *y)
          }
          else {
             status = -1;
-            Con_Printf("lens_forward returned a single non-nil value\n");
+            lua_ctx_error(ctx, "lens_forward returned a single non-nil value\n");
          }
          break;
 
       default:
-         Con_Printf("lens_forward returned %d values instead of 2\n", numret);
+         lua_ctx_error(ctx, "lens_forward returned %d values instead of 2\n", numret);
          status = -1;
    }
 
@@ -1631,9 +3047,11 @@ static int LUAtoC_lens_forward(vec3_t ray, double *x, double *y)
    return status;
 }
 
-static int LUAtoC_globe_plate(vec3_t ray, int *plate)
+static int LUAtoC_globe_plate(struct _lua_ctx *ctx, vec3_t ray, int *plate)
 {
-   lua_rawgeti(lua, LUA_REGISTRYINDEX, lua_refs.globe_plate);
+   lua_State *lua = ctx->L;
+   ctx->lua_calls++;
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->globe_plate);
    lua_pushnumber(lua, ray[0]);
    lua_pushnumber(lua, ray[1]);
    lua_pushnumber(lua, ray[2]);
@@ -1650,689 +3068,2543 @@ static int LUAtoC_globe_plate(vec3_t ray, int *plate)
    return 1;
 }
 
-// -------------------------------------------------------------------------------- 
-// |                                                                              |
-// |                    Lua state management functions                            |
-// |                                                                              |
-// --------------------------------------------------------------------------------
-
-static qboolean LUA_load_lens(void)
+#ifdef USE_LUAJIT
+// Call lens_inverse_row through the ffi shim, which lets it write the rays
+// straight into ctx->batch_ffi.  Returns 0 if the lens could not be called
+// this way (e.g. it stores nil for missing rays), so the caller can fall back
+// to the buffer tables.
+static int LUAtoC_lens_inverse_row_ffi(struct _lua_ctx *ctx, double y, double x0, double dx, int n)
 {
-   // clear Lua variables
-   LUA_clear_lens();
-
-   // set full filename
-   char filename[100];
-   sprintf(filename,"%s/lua-scripts/lenses/%s.lua", com_basedir, lens.name);
-
-   // check if loaded correctly
-   int errcode = 0;
-   if ((errcode=luaL_loadfile(lua, filename))) {
-      Con_Printf("could not loadfile (%d) \nERROR: %s", errcode, lua_tostring(lua,-1));
-      lua_pop(lua,1); // pop error message
-      return false;
+   lua_State *lua = ctx->L;
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->ffi_inverse_row);
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->lens_inverse_row);
+   lua_pushnumber(lua, y);
+   lua_pushnumber(lua, x0);
+   lua_pushnumber(lua, dx);
+   lua_pushinteger(lua, n);
+   lua_pushlightuserdata(lua, ctx->batch_ffi);
+   if (lua_pcall(lua, 6, 0, 0)) {
+      lua_pop(lua, 1); // pop error message
+      lua_unref(lua, &ctx->refs->ffi_inverse_row);
+      return 0;
    }
-   else {
-      if ((errcode=lua_pcall(lua, 0, 0, 0))) {
-         Con_Printf("could not pcall (%d) \nERROR: %s", errcode, lua_tostring(lua,-1));
-         lua_pop(lua,1); // pop error message
-         return false;
+
+   int i;
+   for (i=0; i<n; ++i) {
+      const double *r = &ctx->batch_ffi[3*i];
+      if (batch_isnan(r[0])) {
+         ctx->batch_valid[i] = 0;
+      }
+      else {
+         float *ray = ctx->batch_rays[i];
+         ray[0] = r[0];
+         ray[1] = r[1];
+         ray[2] = r[2];
+         VectorNormalize(ray);
+         ctx->batch_valid[i] = 1;
       }
    }
 
-   // clear current maps
-   lens.map_type = MAP_NONE;
-   lua_refs.lens_forward = lua_refs.lens_inverse = -1;
+   return 1;
+}
+#endif
 
-   // check if the inverse map function is provided
-   lua_getglobal(lua, "lens_inverse");
-   if (!lua_isfunction(lua,-1)) {
-      // Con_Printf("lens_inverse is not found\n");
-      lua_pop(lua,1); // pop lens_inverse
-   }
-   else {
-      lua_refs.lens_inverse = luaL_ref(lua, LUA_REGISTRYINDEX);
-      lens.map_type = MAP_INVERSE;
+// Call lens_inverse_row for the n pixels (x0+i*dx, y).  The rays are read into
+// ctx->batch_rays, with ctx->batch_valid set for the pixels that have one.
+static int LUAtoC_lens_inverse_row(struct _lua_ctx *ctx, double y, double x0, double dx, int n)
+{
+   lua_State *lua = ctx->L;
+   if (!lua_ctx_reserve(ctx, n)) {
+      lua_ctx_error(ctx, "could not allocate lens batch buffers\n");
+      return -1;
    }
+   ctx->rays += n;
+   ctx->lua_calls++;
 
-   // check if the forward map function is provided
-   lua_getglobal(lua, "lens_forward");
-   if (!lua_isfunction(lua,-1)) {
-      // Con_Printf("lens_forward is not found\n");
-      lua_pop(lua,1); // pop lens_forward
-   }
-   else {
-      lua_refs.lens_forward = luaL_ref(lua, LUA_REGISTRYINDEX);
-      if (lens.map_type == MAP_NONE) {
-         lens.map_type = MAP_FORWARD;
-      }
+#ifdef USE_LUAJIT
+   if (ctx->refs->ffi_inverse_row != -1 && LUAtoC_lens_inverse_row_ffi(ctx, y, x0, dx, n)) {
+      return 1;
    }
+#endif
 
-   // get map function preference if provided
-   lua_getglobal(lua, "map");
-   if (lua_isstring(lua, -1))
-   {
-      // get desired map function name
-      const char* funcname = lua_tostring(lua, -1);
-
-      // check for valid map function name
-      if (!strcmp(funcname, "lens_inverse")) {
-         lens.map_type = MAP_INVERSE;
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->lens_inverse_row);
+   lua_pushnumber(lua, y);
+   lua_pushnumber(lua, x0);
+   lua_pushnumber(lua, dx);
+   lua_pushinteger(lua, n);
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->ray_buffer);
+   lua_call(lua, 5, 0);
+
+   // read the rays out of the buffer table
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->ray_buffer);
+   int i;
+   for (i=0; i<n; ++i) {
+      lua_rawgeti(lua, -1, 3*i+1);
+      lua_rawgeti(lua, -2, 3*i+2);
+      lua_rawgeti(lua, -3, 3*i+3);
+      if (lua_isnil(lua,-3) || (lua_isnumber(lua,-3) && batch_isnan(lua_tonumber(lua,-3)))) {
+         ctx->batch_valid[i] = 0;
       }
-      else if (!strcmp(funcname, "lens_forward")) {
-         lens.map_type = MAP_FORWARD;
+      else if (lua_isnumber(lua,-3) && lua_isnumber(lua,-2) && lua_isnumber(lua,-1)) {
+         float *ray = ctx->batch_rays[i];
+         ray[0] = lua_tonumber(lua, -3);
+         ray[1] = lua_tonumber(lua, -2);
+         ray[2] = lua_tonumber(lua, -1);
+         VectorNormalize(ray);
+         ctx->batch_valid[i] = 1;
       }
       else {
-         Con_Printf("Unsupported map function: %s\n", funcname);
-         lua_pop(lua, 1); // pop map
-         return false;
+         lua_ctx_error(ctx, "lens_inverse_row returned a non-number value for x,y,z\n");
+         lua_pop(lua, 4); // pop x, y, z, and buffer
+         return -1;
       }
+      lua_pop(lua, 3); // pop x, y, z
    }
-   lua_pop(lua,1); // pop map
+   lua_pop(lua, 1); // pop buffer
 
-   lua_getglobal(lua, "max_fov");
-   zoom.max_fov = (int)lua_isnumber(lua,-1) ? lua_tonumber(lua,-1) : 0;
-   lua_pop(lua,1); // pop max_fov
+   return 1;
+}
 
-   lua_getglobal(lua, "max_vfov");
-   zoom.max_vfov = (int)lua_isnumber(lua,-1) ? lua_tonumber(lua,-1) : 0;
-   lua_pop(lua,1); // pop max_vfov
+#ifdef USE_LUAJIT
+// Call lens_forward_batch through the ffi shim, which lets it read the rays
+// from ctx->batch_ffi and write the points straight into ctx->batch_xy.
+// Returns 0 if the lens could not be called this way.
+static int LUAtoC_lens_forward_batch_ffi(struct _lua_ctx *ctx, int n)
+{
+   lua_State *lua = ctx->L;
+   int i;
 
-   lua_getglobal(lua, "lens_width");
-   lens.width = lua_isnumber(lua,-1) ? lua_tonumber(lua,-1) : 0;
-   lua_pop(lua,1); // pop lens_width
+   for (i=0; i<n; ++i) {
+      const float *ray = ctx->batch_rays[i];
+      ctx->batch_ffi[3*i] = ray[0];
+      ctx->batch_ffi[3*i+1] = ray[1];
+      ctx->batch_ffi[3*i+2] = ray[2];
+   }
 
-   lua_getglobal(lua, "lens_height");
-   lens.height = lua_isnumber(lua,-1) ? lua_tonumber(lua,-1) : 0;
-   lua_pop(lua,1); // pop lens_height
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->ffi_forward_batch);
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->lens_forward_batch);
+   lua_pushlightuserdata(lua, ctx->batch_ffi);
+   lua_pushinteger(lua, n);
+   lua_pushlightuserdata(lua, ctx->batch_xy);
+   if (lua_pcall(lua, 4, 0, 0)) {
+      lua_pop(lua, 1); // pop error message
+      lua_unref(lua, &ctx->refs->ffi_forward_batch);
+      return 0;
+   }
 
-   return true;
+   for (i=0; i<n; ++i) {
+      ctx->batch_valid[i] = !batch_isnan(ctx->batch_xy[2*i]);
+   }
+
+   return 1;
 }
+#endif
 
-static qboolean LUA_load_globe(void)
+// Call lens_forward_batch for the first n rays in ctx->batch_rays.  The points
+// are read into ctx->batch_xy, with ctx->batch_valid set for the rays that
+// have one.
+static int LUAtoC_lens_forward_batch(struct _lua_ctx *ctx, int n)
+{
+   lua_State *lua = ctx->L;
+   int i;
+
+   ctx->rays += n;
+   ctx->lua_calls++;
+
+#ifdef USE_LUAJIT
+   if (ctx->refs->ffi_forward_batch != -1 && LUAtoC_lens_forward_batch_ffi(ctx, n)) {
+      return 1;
+   }
+#endif
+
+   // write the rays into the buffer table
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->ray_buffer);
+   for (i=0; i<n; ++i) {
+      float *ray = ctx->batch_rays[i];
+      lua_pushnumber(lua, ray[0]);
+      lua_rawseti(lua, -2, 3*i+1);
+      lua_pushnumber(lua, ray[1]);
+      lua_rawseti(lua, -2, 3*i+2);
+      lua_pushnumber(lua, ray[2]);
+      lua_rawseti(lua, -2, 3*i+3);
+   }
+
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->lens_forward_batch);
+   lua_insert(lua, -2); // ray buffer is the first argument
+   lua_pushinteger(lua, n);
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->xy_buffer);
+   lua_call(lua, 3, 0);
+
+   // read the points out of the buffer table
+   lua_rawgeti(lua, LUA_REGISTRYINDEX, ctx->refs->xy_buffer);
+   for (i=0; i<n; ++i) {
+      lua_rawgeti(lua, -1, 2*i+1);
+      lua_rawgeti(lua, -2, 2*i+2);
+      if (lua_isnil(lua,-2) || (lua_isnumber(lua,-2) && batch_isnan(lua_tonumber(lua,-2)))) {
+         ctx->batch_valid[i] = 0;
+      }
+      else if (lua_isnumber(lua,-2) && lua_isnumber(lua,-1)) {
+         ctx->batch_xy[2*i] = lua_tonumber(lua, -2);
+         ctx->batch_xy[2*i+1] = lua_tonumber(lua, -1);
+         ctx->batch_valid[i] = 1;
+      }
+      else {
+         lua_ctx_error(ctx, "lens_forward_batch returned a non-number value for x,y\n");
+         lua_pop(lua, 3); // pop x, y, and buffer
+         return -1;
+      }
+      lua_pop(lua, 2); // pop x, y
+   }
+   lua_pop(lua, 1); // pop buffer
+
+   return 1;
+}
+
+// make sure the batch buffers can hold n pixels
+static qboolean lua_ctx_reserve(struct _lua_ctx *ctx, int n)
+{
+   if (n <= ctx->batch_size) {
+      return true;
+   }
+
+   lua_ctx_free(ctx);
+   ctx->batch_rays = malloc(n*sizeof(vec3_t));
+   ctx->batch_xy = malloc(n*2*sizeof(double));
+   ctx->batch_valid = malloc(n*sizeof(byte));
+#ifdef USE_LUAJIT
+   ctx->batch_ffi = malloc(n*3*sizeof(double));
+   if (!ctx->batch_ffi) {
+      lua_ctx_free(ctx);
+      return false;
+   }
+#endif
+   if (!ctx->batch_rays || !ctx->batch_xy || !ctx->batch_valid) {
+      lua_ctx_free(ctx);
+      return false;
+   }
+
+   ctx->batch_size = n;
+   return true;
+}
+
+static void lua_ctx_free(struct _lua_ctx *ctx)
+{
+   free(ctx->batch_rays);
+   free(ctx->batch_xy);
+   free(ctx->batch_valid);
+   ctx->batch_rays = NULL;
+   ctx->batch_xy = NULL;
+   ctx->batch_valid = NULL;
+#ifdef USE_LUAJIT
+   free(ctx->batch_ffi);
+   ctx->batch_ffi = NULL;
+#endif
+   ctx->batch_size = 0;
+}
+
+// report an error from a lua function
+static void lua_ctx_error(struct _lua_ctx *ctx, const char *fmt, ...)
+{
+   va_list args;
+   va_start(args, fmt);
+   if (ctx->error) {
+      vsnprintf(ctx->error, ctx->errorsize, fmt, args);
+   }
+   else {
+      char msg[MAX_PRINTMSG];
+      vsnprintf(msg, sizeof(msg), fmt, args);
+      Con_Printf("%s", msg);
+   }
+   va_end(args);
+}
+
+// -------------------------------------------------------------------------------- 
+// |                                                                              |
+// |                           NATIVE LENSES                                      |
+// |                                                                              |
+// --------------------------------------------------------------------------------
+
+// (these are direct translations of the stock lens scripts of the same name)
+
+// radial lenses map the distance from the lens center to the angle from the
+// forward vector, so they only differ by the functions between the two
+static void radial_to_ray(double x, double y, double theta, vec3_t ray)
+{
+   double r = sqrt(x*x+y*y);
+   if (r == 0) {
+      ray[0] = ray[1] = 0;
+      ray[2] = 1;
+      return;
+   }
+   double s = sin(theta);
+   ray[0] = x/r*s;
+   ray[1] = y/r*s;
+   ray[2] = cos(theta);
+}
+
+static void radial_to_xy(vec3_t ray, double r, double *x, double *y)
+{
+   double c = r/sqrt(ray[0]*ray[0]+ray[1]*ray[1]);
+   *x = ray[0]*c;
+   *y = ray[1]*c;
+}
+
+static int native_rectilinear_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   radial_to_ray(x, y, atan(sqrt(x*x+y*y)), ray);
+   return 1;
+}
+
+static int native_rectilinear_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   radial_to_xy(ray, tan(acos(ray[2])), x, y);
+   return 1;
+}
+
+// p[0] = angleScale
+static int native_stereographic_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   radial_to_ray(x, y, atan(sqrt(x*x+y*y))/p[0], ray);
+   return 1;
+}
+
+static int native_stereographic_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   radial_to_xy(ray, tan(acos(ray[2])*p[0]), x, y);
+   return 1;
+}
+
+static int native_fisheye1_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   double r = sqrt(x*x+y*y);
+   if (r > M_PI) {
+      return 0;
+   }
+   radial_to_ray(x, y, r, ray);
+   return 1;
+}
+
+static int native_fisheye1_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   radial_to_xy(ray, acos(ray[2]), x, y);
+   return 1;
+}
+
+// p[0] = maxr
+static int native_fisheye2_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   double r = sqrt(x*x+y*y);
+   if (r > p[0]) {
+      return 0;
+   }
+   radial_to_ray(x, y, 2*asin(r*0.5), ray);
+   return 1;
+}
+
+static int native_fisheye2_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   radial_to_xy(ray, 2*sin(acos(ray[2])*0.5), x, y);
+   return 1;
+}
+
+// p[0] = d
+static int native_panini_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   double d = p[0];
+   double k = x*x/((d+1)*(d+1));
+   double dscr = k*k*d*d - (k+1)*(k*d*d-1);
+   double clon = (-k*d+sqrt(dscr))/(k+1);
+   double S = (d+1)/(d+clon);
+   double lon = atan2(x,S*clon);
+   double lat = atan2(y,S);
+   latlon_to_ray(lat, lon, ray);
+   return 1;
+}
+
+static int native_panini_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   double d = p[0];
+   double lat, lon;
+   ray_to_latlon(ray, &lat, &lon);
+   double S = (d+1)/(d+cos(lon));
+   *x = S*sin(lon);
+   *y = S*tan(lat);
+   return 1;
+}
+
+static int native_equirect_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   if (fabs(y) > M_PI/2 || fabs(x) > M_PI) {
+      return 0;
+   }
+   latlon_to_ray(y, x, ray);
+   return 1;
+}
+
+static int native_equirect_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   ray_to_latlon(ray, y, x);
+   return 1;
+}
+
+static int native_mercator_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   if (fabs(x) > M_PI) {
+      return 0;
+   }
+   latlon_to_ray(atan(sinh(y)), x, ray);
+   return 1;
+}
+
+static int native_mercator_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   double lat, lon;
+   ray_to_latlon(ray, &lat, &lon);
+   *x = lon;
+   *y = log(tan(M_PI*0.25+lat*0.5));
+   return 1;
+}
+
+static int native_cylinder_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   if (fabs(x) > M_PI) {
+      return 0;
+   }
+   latlon_to_ray(atan(y), x, ray);
+   return 1;
+}
+
+static int native_cylinder_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   double lat, lon;
+   ray_to_latlon(ray, &lat, &lon);
+   *x = lon;
+   *y = tan(lat);
+   return 1;
+}
+
+// p[0] = maxy
+static int native_miller_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   if (fabs(y) > p[0] || fabs(x) > M_PI) {
+      return 0;
+   }
+   latlon_to_ray(5.0/4*atan(sinh(4.0/5*y)), x, ray);
+   return 1;
+}
+
+static int native_miller_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   double lat, lon;
+   ray_to_latlon(ray, &lat, &lon);
+   *x = lon;
+   *y = 1.25*log(tan(0.25*M_PI+0.4*lat));
+   return 1;
+}
+
+static int native_hammer_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   if (x*x/8+y*y/2 > 1) {
+      return 0;
+   }
+   double z = sqrt(1-0.0625*x*x-0.25*y*y);
+   double lon = 2*atan(z*x/(2*(2*z*z-1)));
+   double lat = asin(z*y);
+   latlon_to_ray(lat, lon, ray);
+   return 1;
+}
+
+static int native_hammer_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   double lat, lon;
+   ray_to_latlon(ray, &lat, &lon);
+   double s = sqrt(1+cos(lat)*cos(lon*0.5));
+   *x = 2*sqrt(2)*cos(lat)*sin(lon*0.5) / s;
+   *y = sqrt(2)*sin(lat) / s;
+   return 1;
+}
+
+static int native_mollweide_inverse(const double *p, double x, double y, vec3_t ray)
+{
+   if (x*x/8 + y*y/2 > 1) {
+      return 0;
+   }
+   double root2 = sqrt(2);
+   double t = asin(y/root2);
+   double lon = M_PI*x/(2*root2*cos(t));
+   double lat = asin((2*t+sin(2*t))/M_PI);
+   latlon_to_ray(lat, lon, ray);
+   return 1;
+}
+
+static int native_mollweide_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   double lat, lon;
+   ray_to_latlon(ray, &lat, &lon);
+
+   // solveTheta
+   double t = lat;
+   double dt;
+   do {
+      dt = -(t + sin(t) - M_PI*sin(lat))/(1+cos(t));
+      t = t+dt;
+   } while (!(dt < 0.001));
+   t /= 2;
+
+   *x = 2*sqrt(2)/M_PI*lon*cos(t);
+   *y = sqrt(2)*sin(t);
+   return 1;
+}
+
+static int native_sinusoidal_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   double lat, lon;
+   ray_to_latlon(ray, &lat, &lon);
+   *x = lon*cos(lat);
+   *y = lat;
+   return 1;
+}
+
+static int native_kavrayskiy7_forward(const double *p, vec3_t ray, double *x, double *y)
+{
+   double lat, lon;
+   ray_to_latlon(ray, &lat, &lon);
+   *x = 3*lon/(2*M_PI)*sqrt(M_PI*M_PI/3 - lat*lat);
+   *y = lat;
+   return 1;
+}
+
+static struct _native_lens native_lenses[] = {
+   { "rectilinear",   { NULL },         native_rectilinear_inverse,   native_rectilinear_forward },
+   { "stereographic", { "angleScale" }, native_stereographic_inverse, native_stereographic_forward },
+   { "fisheye1",      { NULL },         native_fisheye1_inverse,      native_fisheye1_forward },
+   { "fisheye2",      { "maxr" },       native_fisheye2_inverse,      native_fisheye2_forward },
+   { "panini",        { "d" },          native_panini_inverse,        native_panini_forward },
+   { "equirect",      { NULL },         native_equirect_inverse,      native_equirect_forward },
+   { "mercator",      { NULL },         native_mercator_inverse,      native_mercator_forward },
+   { "cylinder",      { NULL },         native_cylinder_inverse,      native_cylinder_forward },
+   { "miller",        { "maxy" },       native_miller_inverse,        native_miller_forward },
+   { "hammer",        { NULL },         native_hammer_inverse,        native_hammer_forward },
+   { "mollweide",     { NULL },         native_mollweide_inverse,     native_mollweide_forward },
+   { "sinusoidal",    { NULL },         NULL,                         native_sinusoidal_forward },
+   { "kavrayskiy7",   { NULL },         NULL,                         native_kavrayskiy7_forward },
+   { NULL }
+};
+
+// select the native lens named by the "native" string on top of the lua stack
+// (and read its parameters from the lua globals)
+static qboolean load_native_lens(void)
+{
+   const char *name = lua_tostring(lua, -1);
+   struct _native_lens *native;
+   for (native = native_lenses; native->name; ++native) {
+      if (!strcmp(native->name, name)) {
+         break;
+      }
+   }
+   if (!native->name) {
+      Con_Printf("Unknown native lens: %s\n", name);
+      return false;
+   }
+
+   int i;
+   for (i=0; i<MAX_NATIVE_PARAMS && native->params[i]; ++i) {
+      lua_getglobal(lua, native->params[i]);
+      if (!lua_isnumber(lua, -1)) {
+         Con_Printf("native lens %s: %s is not a number\n", name, native->params[i]);
+         lua_pop(lua, 1); // pop param
+         return false;
+      }
+      lens.native_params[i] = lua_tonumber(lua, -1);
+      lua_pop(lua, 1); // pop param
+   }
+
+   lens.native = native;
+   return true;
+}
+
+static int lens_inverse(struct _lua_ctx *ctx, double x, double y, vec3_t ray)
+{
+   ctx->rays++;
+   if (lens.native && lens.native->inverse) {
+      return lens.native->inverse(lens.native_params, x, y, ray);
+   }
+   return LUAtoC_lens_inverse(ctx, x, y, ray);
+}
+
+static int lens_forward(struct _lua_ctx *ctx, vec3_t ray, double *x, double *y)
+{
+   ctx->rays++;
+   if (lens.native && lens.native->forward) {
+      return lens.native->forward(lens.native_params, ray, x, y);
+   }
+   return LUAtoC_lens_forward(ctx, ray, x, y);
+}
+
+// -------------------------------------------------------------------------------- 
+// |                                                                              |
+// |                    Lua state management functions                            |
+// |                                                                              |
+// --------------------------------------------------------------------------------
+
+static qboolean LUA_load_lens(void)
 {
    // clear Lua variables
-   LUA_clear_globe();
+   LUA_clear_lens();
 
    // set full filename
    char filename[100];
-   sprintf(filename, "%s/lua-scripts/globes/%s.lua",com_basedir,globe.name);
+   sprintf(filename,"%s/lua-scripts/lenses/%s.lua", com_basedir, lens.name);
+
+   // remember the script contents for the lens cache key
+   lens.script_hash = hash_file(FNV_OFFSET_BASIS, filename);
+
+   // check if loaded correctly
+   int errcode = 0;
+   if ((errcode=luaL_loadfile(lua, filename))) {
+      Con_Printf("could not loadfile (%d) \nERROR: %s", errcode, lua_tostring(lua,-1));
+      lua_pop(lua,1); // pop error message
+      return false;
+   }
+   else {
+      if ((errcode=lua_pcall(lua, 0, 0, 0))) {
+         Con_Printf("could not pcall (%d) \nERROR: %s", errcode, lua_tostring(lua,-1));
+         lua_pop(lua,1); // pop error message
+         return false;
+      }
+   }
+
+   // clear current maps
+   lens.map_type = MAP_NONE;
+   lua_unref(lua, &lua_refs.lens_forward);
+   lua_unref(lua, &lua_refs.lens_inverse);
+   lua_ref_batch_funcs(lua, &lua_refs);
+
+   // check if the inverse map function is provided
+   lua_getglobal(lua, "lens_inverse");
+   if (!lua_isfunction(lua,-1)) {
+      // Con_Printf("lens_inverse is not found\n");
+      lua_pop(lua,1); // pop lens_inverse
+   }
+   else {
+      lua_refs.lens_inverse = luaL_ref(lua, LUA_REGISTRYINDEX);
+      lens.map_type = MAP_INVERSE;
+   }
+
+   // check if the forward map function is provided
+   lua_getglobal(lua, "lens_forward");
+   if (!lua_isfunction(lua,-1)) {
+      // Con_Printf("lens_forward is not found\n");
+      lua_pop(lua,1); // pop lens_forward
+   }
+   else {
+      lua_refs.lens_forward = luaL_ref(lua, LUA_REGISTRYINDEX);
+      if (lens.map_type == MAP_NONE) {
+         lens.map_type = MAP_FORWARD;
+      }
+   }
+
+   // get map function preference if provided
+   lua_getglobal(lua, "map");
+   if (lua_isstring(lua, -1))
+   {
+      // get desired map function name
+      const char* funcname = lua_tostring(lua, -1);
+
+      // check for valid map function name
+      if (!strcmp(funcname, "lens_inverse")) {
+         lens.map_type = MAP_INVERSE;
+      }
+      else if (!strcmp(funcname, "lens_forward")) {
+         lens.map_type = MAP_FORWARD;
+      }
+      else {
+         Con_Printf("Unsupported map function: %s\n", funcname);
+         lua_pop(lua, 1); // pop map
+         return false;
+      }
+   }
+   lua_pop(lua,1); // pop map
+
+   lua_getglobal(lua, "max_fov");
+   zoom.max_fov = (int)lua_isnumber(lua,-1) ? lua_tonumber(lua,-1) : 0;
+   lua_pop(lua,1); // pop max_fov
+
+   lua_getglobal(lua, "max_vfov");
+   zoom.max_vfov = (int)lua_isnumber(lua,-1) ? lua_tonumber(lua,-1) : 0;
+   lua_pop(lua,1); // pop max_vfov
+
+   lua_getglobal(lua, "lens_width");
+   lens.width = lua_isnumber(lua,-1) ? lua_tonumber(lua,-1) : 0;
+   lua_pop(lua,1); // pop lens_width
+
+   lua_getglobal(lua, "lens_height");
+   lens.height = lua_isnumber(lua,-1) ? lua_tonumber(lua,-1) : 0;
+   lua_pop(lua,1); // pop lens_height
+
+   // use the native mapping functions if requested
+   lens.native = NULL;
+   lua_getglobal(lua, "native");
+   if (lua_isstring(lua, -1) && !load_native_lens()) {
+      Con_Printf("using the lua mapping functions instead\n");
+   }
+   lua_pop(lua,1); // pop native
+
+   return true;
+}
+
+static qboolean LUA_load_globe(void)
+{
+   // clear Lua variables
+   LUA_clear_globe();
+
+   // set full filename
+   char filename[100];
+   sprintf(filename, "%s/lua-scripts/globes/%s.lua",com_basedir,globe.name);
+
+   // remember the script contents for the lens cache key
+   globe.script_hash = hash_file(FNV_OFFSET_BASIS, filename);
+
+   // check if loaded correctly
+   int errcode = 0;
+   if ((errcode=luaL_loadfile(lua, filename))) {
+      Con_Printf("could not loadfile (%d) \nERROR: %s", errcode, lua_tostring(lua,-1));
+      lua_pop(lua,1); // pop error message
+      return false;
+   }
+   else {
+      if ((errcode=lua_pcall(lua, 0, 0, 0))) {
+         Con_Printf("could not pcall (%d) \nERROR: %s", errcode, lua_tostring(lua,-1));
+         lua_pop(lua,1); // pop error message
+         return false;
+      }
+   }
+
+   // check for the globe_plate function
+   lua_unref(lua, &lua_refs.globe_plate);
+   if (lua_func_exists("globe_plate"))
+   {
+      lua_getglobal(lua, "globe_plate");
+      lua_refs.globe_plate = luaL_ref(lua, LUA_REGISTRYINDEX);
+   }
+
+   // load plates array
+   lua_getglobal(lua, "plates");
+   if (!lua_istable(lua,-1) || lua_rawlen(lua,-1) < 1)
+   {
+      Con_Printf("plates must be an array of one or more elements\n");
+      lua_pop(lua, 1); // pop plates
+      return false;
+   }
+
+   // iterate plates
+   int i = 0;
+   int j;
+   for (lua_pushnil(lua); lua_next(lua,-2); lua_pop(lua,1), ++i)
+   {
+      // get forward vector
+      lua_rawgeti(lua, -1, 1);
+
+      // verify table of length 3
+      if (!lua_istable(lua,-1) || lua_rawlen(lua,-1) != 3 )
+      {
+         Con_Printf("plate %d: forward vector is not a 3d vector\n", i+1);
+         lua_pop(lua, 3); // pop forward vector, plate, and plates
+         return false;
+      }
+
+      // get forward vector elements
+      for (j=0; j<3; ++j) {
+         lua_rawgeti(lua, -1, j+1);
+         if (!lua_isnumber(lua,-1))
+         {
+            Con_Printf("plate %d: forward vector: element %d not a number\n", i+1, j+1);
+            lua_pop(lua, 4); // pop element, vector, plate, and plates
+            return false;
+         }
+         globe.plates[i].forward[j] = lua_tonumber(lua,-1);
+         lua_pop(lua, 1); // pop element
+      }
+      lua_pop(lua,1); // pop forward vector
+
+      // get up vector
+      lua_rawgeti(lua, -1, 2);
+
+      // verify table of length 3
+      if (!lua_istable(lua,-1) || lua_rawlen(lua,-1) != 3 )
+      {
+         Con_Printf("plate %d: up vector is not a 3d vector\n", i+1);
+         lua_pop(lua, 3); // pop forward vector, plate, and plates
+         return false;
+      }
+
+      // get up vector elements
+      for (j=0; j<3; ++j) {
+         lua_rawgeti(lua, -1, j+1);
+         if (!lua_isnumber(lua,-1))
+         {
+            Con_Printf("plate %d: up vector: element %d not a number\n", i+1, j+1);
+            lua_pop(lua, 4); // pop element, vector, plate, and plates
+            return false;
+         }
+         globe.plates[i].up[j] = lua_tonumber(lua,-1);
+         lua_pop(lua,1); // pop element
+      }
+      lua_pop(lua, 1); // pop up vector
+
+      // calculate right vector (and correct up vector)
+      CrossProduct(globe.plates[i].up, globe.plates[i].forward, globe.plates[i].right);
+      CrossProduct(globe.plates[i].forward, globe.plates[i].right, globe.plates[i].up);
+
+      // get fov
+      lua_rawgeti(lua,-1,3);
+      if (!lua_isnumber(lua,-1))
+      {
+         Con_Printf("plate %d: fov not a number\n", i+1);
+      }
+      globe.plates[i].fov = lua_tonumber(lua,-1) * M_PI / 180;
+      lua_pop(lua, 1); // pop fov
+
+      if (globe.plates[i].fov <= 0)
+      {
+         Con_Printf("plate %d: fov must > 0\n", i+1);
+         return false;
+      }
+
+      // calculate distance to camera
+      globe.plates[i].dist = 0.5/tan(globe.plates[i].fov/2);
+
+      // get optional refresh rate
+      lua_getfield(lua, -1, "refresh");
+      globe.plates[i].refresh = lua_isnumber(lua,-1) ? qmax((int)lua_tointeger(lua,-1), 1) : 0;
+      lua_pop(lua, 1); // pop refresh
+   }
+   lua_pop(lua, 1); // pop plates
+
+   globe.numplates = i;
+
+   bake_plate_lookup();
+
+   // find the plate at the center of the view
+   vec3_t center = { 0, 0, 1 };
+   globe.refresh.front = ray_to_plate_index(&lua_main, center);
+
+   return true;
+}
+
+// load the current globe and lens into a worker's own Lua state
+static qboolean LUA_load_worker(struct _lens_worker *worker)
+{
+   lua_State *L = new_lua_state();
+
+   // (the refs of the worker's last state went with it)
+   lua_clear_refs(&worker->refs);
+   worker->ctx.L = L;
+   worker->ctx.refs = &worker->refs;
+   worker->ctx.error = worker->error;
+   worker->ctx.errorsize = sizeof(worker->error);
+   worker->ctx.batch_size = 0;
+   worker->ctx.rays = worker->ctx.lua_calls = 0;
+   worker->error[0] = '\0';
+   worker->failed = false;
+
+   // set "numplates" var
+   lua_pushinteger(L, globe.numplates);
+   lua_setglobal(L, "numplates");
+
+   char filename[MAX_OSPATH];
+
+   // the globe is only needed for its plate selection function
+   if (lua_refs.globe_plate != -1) {
+      if (snprintf(filename, sizeof(filename), "%s/lua-scripts/globes/%s.lua",
+               com_basedir, globe.name) >= sizeof(filename)) {
+         snprintf(worker->error, sizeof(worker->error), "globe path is too long\n");
+         lua_close(L);
+         return false;
+      }
+      if (luaL_dofile(L, filename)) {
+         snprintf(worker->error, sizeof(worker->error), "%s\n", lua_tostring(L,-1));
+         lua_close(L);
+         return false;
+      }
+      lua_getglobal(L, "globe_plate");
+      worker->refs.globe_plate = luaL_ref(L, LUA_REGISTRYINDEX);
+   }
+
+   if (snprintf(filename, sizeof(filename), "%s/lua-scripts/lenses/%s.lua",
+            com_basedir, lens.name) >= sizeof(filename)) {
+      snprintf(worker->error, sizeof(worker->error), "lens path is too long\n");
+      lua_close(L);
+      return false;
+   }
+   if (luaL_dofile(L, filename)) {
+      snprintf(worker->error, sizeof(worker->error), "%s\n", lua_tostring(L,-1));
+      lua_close(L);
+      return false;
+   }
+   lua_getglobal(L, "lens_inverse");
+   if (!lua_isfunction(L,-1)) {
+      snprintf(worker->error, sizeof(worker->error), "lens_inverse is not found\n");
+      lua_close(L);
+      return false;
+   }
+   worker->refs.lens_inverse = luaL_ref(L, LUA_REGISTRYINDEX);
+   lua_ref_batch_funcs(L, &worker->refs);
+
+   return true;
+}
+
+#define CLEARVAR(var) lua_pushnil(lua); lua_setglobal(lua, var);
+
+// used to clear the state when switching lenses
+static void LUA_clear_lens(void)
+{
+   CLEARVAR("map");
+   CLEARVAR("max_fov");
+   CLEARVAR("max_vfov");
+   CLEARVAR("lens_width");
+   CLEARVAR("lens_height");
+   CLEARVAR("lens_inverse");
+   CLEARVAR("lens_forward");
+   CLEARVAR("lens_inverse_row");
+   CLEARVAR("lens_forward_batch");
+   CLEARVAR("onload");
+   CLEARVAR("native");
+
+   // set "numplates" var
+   lua_pushinteger(lua, globe.numplates);
+   lua_setglobal(lua, "numplates");
+}
+
+// used to clear the state when switching globes
+static void LUA_clear_globe(void)
+{
+   CLEARVAR("plates");
+   CLEARVAR("globe_plate");
+
+   globe.numplates = 0;
+
+   free(globe.plate_lookup);
+   globe.plate_lookup = NULL;
+}
+
+#undef CLEARVAR
+
+static qboolean lua_func_exists(const char* name)
+{
+   lua_getglobal(lua, name);
+   int exists = lua_isfunction(lua,-1);
+   lua_pop(lua, 1); // pop name
+   return exists;
+}
+
+// mark all references as unset (for a new Lua state)
+static void lua_clear_refs(struct _lua_refs *refs)
+{
+   refs->lens_forward = refs->lens_inverse = refs->globe_plate = -1;
+   refs->lens_inverse_row = refs->lens_forward_batch = -1;
+   refs->ray_buffer = refs->xy_buffer = -1;
+   refs->ffi_inverse_row = refs->ffi_forward_batch = -1;
+}
+
+// release a reference so a reloaded script doesn't leak registry entries
+static void lua_unref(lua_State *L, int *ref)
+{
+   if (*ref != -1) {
+      luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+      *ref = -1;
+   }
+}
+
+// reference the optional batched lens functions, and create their buffer tables
+// (releasing the ones from the last lens loaded in this state)
+static void lua_ref_batch_funcs(lua_State *L, struct _lua_refs *refs)
+{
+   lua_unref(L, &refs->lens_inverse_row);
+   lua_unref(L, &refs->lens_forward_batch);
+   lua_unref(L, &refs->ffi_inverse_row);
+   lua_unref(L, &refs->ffi_forward_batch);
+   lua_unref(L, &refs->ray_buffer);
+   lua_unref(L, &refs->xy_buffer);
+
+   lua_getglobal(L, "lens_inverse_row");
+   if (lua_isfunction(L,-1)) {
+      refs->lens_inverse_row = luaL_ref(L, LUA_REGISTRYINDEX);
+   }
+   else {
+      lua_pop(L,1); // pop lens_inverse_row
+#ifdef USE_LUAJIT
+      // batch the per-pixel function with a Lua loop the JIT can compile
+      lua_getglobal(L, "lens_inverse");
+      qboolean inverse = lua_isfunction(L,-1);
+      lua_pop(L,1); // pop lens_inverse
+      if (inverse) {
+         lua_getglobal(L, "__lens_inverse_row");
+         refs->lens_inverse_row = luaL_ref(L, LUA_REGISTRYINDEX);
+      }
+#endif
+   }
+
+   lua_getglobal(L, "lens_forward_batch");
+   if (lua_isfunction(L,-1)) {
+      refs->lens_forward_batch = luaL_ref(L, LUA_REGISTRYINDEX);
+   }
+   else {
+      lua_pop(L,1); // pop lens_forward_batch
+#ifdef USE_LUAJIT
+      lua_getglobal(L, "lens_forward");
+      qboolean forward = lua_isfunction(L,-1);
+      lua_pop(L,1); // pop lens_forward
+      if (forward) {
+         lua_getglobal(L, "__lens_forward_batch");
+         refs->lens_forward_batch = luaL_ref(L, LUA_REGISTRYINDEX);
+      }
+#endif
+   }
+
+#ifdef USE_LUAJIT
+   lua_getglobal(L, "__ffi_inverse_row");
+   if (lua_isfunction(L,-1)) {
+      refs->ffi_inverse_row = luaL_ref(L, LUA_REGISTRYINDEX);
+   }
+   else {
+      lua_pop(L,1); // pop __ffi_inverse_row
+   }
+
+   lua_getglobal(L, "__ffi_forward_batch");
+   if (lua_isfunction(L,-1)) {
+      refs->ffi_forward_batch = luaL_ref(L, LUA_REGISTRYINDEX);
+   }
+   else {
+      lua_pop(L,1); // pop __ffi_forward_batch
+   }
+#endif
+
+   // (these are reused for every call, so the scripts don't create garbage)
+   lua_newtable(L);
+   refs->ray_buffer = luaL_ref(L, LUA_REGISTRYINDEX);
+   lua_newtable(L);
+   refs->xy_buffer = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+// -------------------------------------------------------------------------------- 
+// |                                                                              |
+// |                           LENS PIXEL SETTERS                                 |
+// |                                                                              |
+// --------------------------------------------------------------------------------
+
+static int set_lensmap_grid(int px, int py, int plate_index)
+{
+   // designate the palette for this pixel (returned as its tint index)
+   // This will set the palette index map such that a grid is shown
+
+   // (This is a block)
+   //    |----|----|----|
+   //    |    |    |    |
+   //    |    |    |    |
+   //    |----|----|----|
+   //    |    |XXXXXXXXX|
+   //    |    |XXXXXXXXX|
+   //    |----|XXXXXXXXX|
+   //    |    |XXXXXXXXX|
+   //    |    |XXXXXXXXX|
+   //    |----|----|----|
+   double block_size = (rubix.pad_size + rubix.cell_size);
+
+   // (Total number of units across)
+   //    ---------------------------------------------------
+   //    |    |    |    |    |    |    |    |    |    |    |
+   //    |    |    |    |    |    |    |    |    |    |    |
+   //    |----|----|----|----|----|----|----|----|----|----|
+   double num_units = rubix.numcells * block_size + rubix.pad_size;
+
+   // (the size of one unit)
+   double unit_size_px = (double)globe.platesize / num_units;
+
+   // convert pixel coordinates to units
+   double ux = (double)px/unit_size_px;
+   double uy = (double)py/unit_size_px;
+
+   int ongrid =
+      fmod(ux,block_size) < rubix.pad_size ||
+      fmod(uy,block_size) < rubix.pad_size;
+
+   return ongrid ? LENSMAP_NOTINT : plate_index;
+}
+
+// set a pixel on the lensmap from plate coordinates
+static void set_lensmap_from_plate(int lx, int ly, int px, int py, int plate_index)
+{
+   // check valid lens coordinates
+   if (lx < 0 || lx >= lens.width_px || ly < 0 || ly >= lens.height_px) {
+      return;
+   }
+
+   // check valid plate coordinates
+   if (px <0 || px >= globe.platesize || py < 0 || py >= globe.platesize) {
+      return;
+   }
+
+   // increase the number of times this side is used
+   globe.plates[plate_index].display = 1;
+
+   // map the lens pixel to this cubeface pixel (and its grid tint)
+   int offset = GLOBEPIXEL(plate_index,px,py) - globe.pixels;
+   *LENSPIXEL(lx,ly) = LENSMAP_PACK(offset, set_lensmap_grid(px,py,plate_index));
+}
+
+// set a pixel on the lensmap from plate uv coordinates
+static void set_lensmap_from_plate_uv(int lx, int ly, double u, double v, int plate_index)
+{
+   // convert to plate coordinates
+   int px = (int)(u*globe.platesize);
+   int py = (int)(v*globe.platesize);
+   
+   set_lensmap_from_plate(lx,ly,px,py,plate_index);
+}
+
+// set the (lx,ly) pixel on the lensmap to the (sx,sy,sz) view vector
+static void set_lensmap_from_ray(struct _lua_ctx *ctx, int lx, int ly, double sx, double sy, double sz)
+{
+   vec3_t ray = {sx,sy,sz};
+
+   // get plate index
+   int plate_index = ray_to_plate_index(ctx, ray);
+   if (plate_index < 0) {
+      return;
+   }
+
+   // get texture coordinates
+   double u,v;
+   if (!ray_to_plate_uv(plate_index, ray, &u, &v)) {
+      return;
+   }
+
+   // map lens pixel to plate pixel
+   set_lensmap_from_plate_uv(lx,ly,u,v,plate_index);
+}
+
+
+// -------------------------------------------------------------------------------- 
+// |                                                                              |
+// |                           GLOBE PIXEL GETTERS                                |
+// |                                                                              |
+// --------------------------------------------------------------------------------
+
+// find the cube face a ray points through, and the coordinates (-1 to 1) on that face
+static void ray_to_cube_face(vec3_t ray, int *face, double *s, double *t)
+{
+   double ax = fabs(ray[0]), ay = fabs(ray[1]), az = fabs(ray[2]);
+   if (ax >= ay && ax >= az) {
+      *face = ray[0] > 0 ? 0 : 1;
+      *s = ray[1] / ax;
+      *t = ray[2] / ax;
+   }
+   else if (ay >= az) {
+      *face = ray[1] > 0 ? 2 : 3;
+      *s = ray[0] / ay;
+      *t = ray[2] / ay;
+   }
+   else {
+      *face = ray[2] > 0 ? 4 : 5;
+      *s = ray[0] / az;
+      *t = ray[1] / az;
+   }
+}
+
+// the ray through the given coordinates (-1 to 1) of a cube face
+static void cube_face_to_ray(int face, double s, double t, vec3_t ray)
+{
+   double sign = (face & 1) ? -1 : 1;
+   switch (face / 2) {
+      case 0: ray[0] = sign; ray[1] = s; ray[2] = t; break;
+      case 1: ray[0] = s; ray[1] = sign; ray[2] = t; break;
+      default: ray[0] = s; ray[1] = t; ray[2] = sign; break;
+   }
+   VectorNormalize(ray);
+}
+
+// bake the globe's globe_plate function into globe.plate_lookup
+static void bake_plate_lookup(void)
+{
+   free(globe.plate_lookup);
+   globe.plate_lookup = NULL;
+
+   if (lua_refs.globe_plate == -1) {
+      return;
+   }
+
+   int n = PLATE_LOOKUP_SIZE;
+   byte *lookup = malloc(6*n*n);
+   byte *corners = malloc((n+1)*(n+1));
+   if (!lookup || !corners) {
+      free(lookup);
+      free(corners);
+      return;
+   }
+
+   int face, x, y;
+   for (face=0; face<6; face++) {
+
+      // plate at each cell corner
+      for (y=0; y<=n; y++) {
+         for (x=0; x<=n; x++) {
+            vec3_t ray;
+            cube_face_to_ray(face, 2.0*x/n - 1, 2.0*y/n - 1, ray);
+            int plate;
+            byte *corner = &corners[y*(n+1) + x];
+            *corner = PLATE_LOOKUP_NONE;
+            if (LUAtoC_globe_plate(&lua_main, ray, &plate) && plate >= 0 && plate < globe.numplates) {
+               *corner = plate;
+            }
+         }
+      }
+
+      // a cell knows its plate if all of its corners agree
+      for (y=0; y<n; y++) {
+         for (x=0; x<n; x++) {
+            byte *c = &corners[y*(n+1) + x];
+            byte plate = c[0];
+            if (c[1] != plate || c[n+1] != plate || c[n+2] != plate) {
+               plate = PLATE_LOOKUP_EXACT;
+            }
+            lookup[(face*n + y)*n + x] = plate;
+         }
+      }
+   }
+
+   free(corners);
+   globe.plate_lookup = lookup;
+}
+
+// retrieves the plate closest to the given ray
+static int ray_to_plate_index(struct _lua_ctx *ctx, vec3_t ray)
+{
+   int plate_index = 0;
+
+   if (ctx->refs->globe_plate != -1) {
+      // use the baked plate selection function if it knows the answer
+      if (globe.plate_lookup) {
+         int face;
+         double s, t;
+         ray_to_cube_face(ray, &face, &s, &t);
+         int x = (int)((s+1)*0.5*PLATE_LOOKUP_SIZE);
+         int y = (int)((t+1)*0.5*PLATE_LOOKUP_SIZE);
+         if (x >= PLATE_LOOKUP_SIZE) x = PLATE_LOOKUP_SIZE-1;
+         if (y >= PLATE_LOOKUP_SIZE) y = PLATE_LOOKUP_SIZE-1;
+         byte plate = globe.plate_lookup[(face*PLATE_LOOKUP_SIZE + y)*PLATE_LOOKUP_SIZE + x];
+         if (plate == PLATE_LOOKUP_NONE) {
+            return -1;
+         }
+         if (plate != PLATE_LOOKUP_EXACT) {
+            return plate;
+         }
+      }
+
+      // use user-defined plate selection function
+      if (LUAtoC_globe_plate(ctx, ray, &plate_index)) {
+         return plate_index;
+      }
+      return -1;
+   }
+
+   // maximum dotproduct 
+   //  = minimum acos(dotproduct) 
+   //  = minimum angle between vectors
+   double max_dp = -2;
+
+   int i;
+   for (i=0; i<globe.numplates; ++i) {
+      double dp = DotProduct(ray, globe.plates[i].forward);
+      if (dp > max_dp) {
+         max_dp = dp;
+         plate_index = i;
+      }
+   }
+
+   return plate_index;
+}
+
+static qboolean ray_to_plate_uv(int plate_index, vec3_t ray, double *u, double *v)
+{
+   // get ray in the plate's relative view frame
+   double x = DotProduct(globe.plates[plate_index].right, ray);
+   double y = DotProduct(globe.plates[plate_index].up, ray);
+   double z = DotProduct(globe.plates[plate_index].forward, ray);
+
+   // project ray to the texture
+   double dist = 0.5 / tan(globe.plates[plate_index].fov/2);
+   *u = x/z*dist + 0.5;
+   *v = -y/z*dist + 0.5;
+
+   // return true if valid texture coordinates
+   return *u>=0 && *u<=1 && *v>=0 && *v<=1;
+}
+
+// -------------------------------------------------------------------------------- 
+// |                                                                              |
+// |                           LENS BUILDER RESUMERS                              |
+// |                                                                              |
+// --------------------------------------------------------------------------------
+
+static void resume_lensmap(void)
+{
+   if (lens_builder.field_state.active) {
+      lens_builder.working = resume_lensmap_field();
+   }
+   else if (lens.map_type == MAP_FORWARD) {
+      lens_builder.working = resume_lensmap_forward();
+   }
+   else if (lens.map_type == MAP_INVERSE) {
+      lens_builder.working = resume_lensmap_inverse();
+   }
+
+   // save the finished lensmap so we don't have to build it again
+   // (before finishing, which changes it to the resized plates)
+   // (interpolated ray fields are not saved, so the cache always holds the exact lens)
+   if (!lens_builder.working && !lens_builder.failed && !lens_builder.field_state.active) {
+      save_lens_cache();
+   }
+
+   if (!lens_builder.working) {
+      finish_lensmap();
+   }
+}
+
+static qboolean resume_lensmap_inverse(void)
+{
+   // the worker threads are building the lens
+   if (lens_workers.count > 0) {
+      return poll_lens_workers();
+   }
+
+   struct _inverse_state *state = &lens_builder.inverse_state;
+
+   start_lens_builder_clock();
+
+   // draw the coarse preview first
+   if (state->preview_row < state->preview_rows) {
+      for (; state->preview_row < state->preview_rows; ++state->preview_row) {
+         if (is_lens_builder_time_up()) {
+            return true;
+         }
+         int row = center_out_index(state->preview_row, state->preview_rows);
+         if (!build_lensmap_preview_row(&lua_main, row)) {
+            lens_builder.failed = true;
+            return false;
+         }
+      }
+
+      // hand the full build to the worker threads if we can
+      if (start_lens_workers()) {
+         return true;
+      }
+   }
+
+   // lens coordinates
+   int *ly;
+   int units = inverse_lensmap_units();
+
+   for(ly = &(state->ly); *ly >= 0; --(*ly))
+   {
+      // pause building if we have exceeded time allowed per frame
+      if (is_lens_builder_time_up()) {
+         return true; 
+      }
+
+      if (!build_lensmap_inverse_unit(&lua_main, center_out_index(units-1 - *ly, units))) {
+         lens_builder.failed = true;
+         return false;
+      }
+   }
+
+   // done building lens
+   return false;
+}
+
+// calculate all the pixels in a row of the inverse lensmap
+// (returns false if the lens function failed)
+static qboolean build_lensmap_inverse_row(struct _lua_ctx *ctx, int ly)
+{
+   // image coordinates
+   double x,y;
+
+   // lens coordinates
+   int lx;
 
-   // check if loaded correctly
-   int errcode = 0;
-   if ((errcode=luaL_loadfile(lua, filename))) {
-      Con_Printf("could not loadfile (%d) \nERROR: %s", errcode, lua_tostring(lua,-1));
-      lua_pop(lua,1); // pop error message
-      return false;
-   }
-   else {
-      if ((errcode=lua_pcall(lua, 0, 0, 0))) {
-         Con_Printf("could not pcall (%d) \nERROR: %s", errcode, lua_tostring(lua,-1));
-         lua_pop(lua,1); // pop error message
+   y = -(ly-lens.height_px/2) * lens.scale;
+
+   // follow all the light rays in this row with a single lua call
+   qboolean native = lens.native && lens.native->inverse;
+   if (!native && ctx->refs->lens_inverse_row != -1) {
+      x = (0-lens.width_px/2) * lens.scale;
+      if (LUAtoC_lens_inverse_row(ctx, y, x, lens.scale, lens.width_px) == -1) {
          return false;
       }
+      for (lx = 0; lx<lens.width_px; ++lx) {
+         if (ctx->batch_valid[lx]) {
+            float *ray = ctx->batch_rays[lx];
+            set_lensmap_from_ray(ctx,lx,ly,ray[0],ray[1],ray[2]);
+         }
+      }
+      return true;
    }
 
-   // check for the globe_plate function
-   lua_refs.globe_plate = -1;
-   if (lua_func_exists("globe_plate"))
+   for(lx = 0;lx<lens.width_px;++lx)
    {
-      lua_getglobal(lua, "globe_plate");
-      lua_refs.globe_plate = luaL_ref(lua, LUA_REGISTRYINDEX);
+      x = (lx-lens.width_px/2) * lens.scale;
+
+      // determine which light ray to follow
+      vec3_t ray;
+      int status = lens_inverse(ctx,x,y,ray);
+      if (status == 0) {
+         continue;
+      }
+      else if (status == -1) {
+         return false;
+      }
+
+      // get the pixel belonging to the light ray
+      set_lensmap_from_ray(ctx,lx,ly,ray[0],ray[1],ray[2]);
    }
 
-   // load plates array
-   lua_getglobal(lua, "plates");
-   if (!lua_istable(lua,-1) || lua_rawlen(lua,-1) < 1)
-   {
-      Con_Printf("plates must be an array of one or more elements\n");
-      lua_pop(lua, 1); // pop plates
-      return false;
+   return true;
+}
+
+// number of units of work in the inverse lensmap (rows, or rows of grid cells)
+static int inverse_lensmap_units(void)
+{
+   int cellsize = lens_builder.inverse_state.cellsize;
+   if (cellsize > 1) {
+      return (lens.height_px + cellsize - 1) / cellsize;
    }
+   return lens.height_px;
+}
 
-   // iterate plates
-   int i = 0;
-   int j;
-   for (lua_pushnil(lua); lua_next(lua,-2); lua_pop(lua,1), ++i)
-   {
-      // get forward vector
-      lua_rawgeti(lua, -1, 1);
+static qboolean build_lensmap_inverse_unit(struct _lua_ctx *ctx, int unit)
+{
+   // clear the older map from the rows of this unit
+   if (lens_builder.inverse_state.replace) {
+      int cellsize = lens_builder.inverse_state.cellsize;
+      int y0 = unit * cellsize;
+      int y1 = MIN(y0 + cellsize, lens.height_px);
+      memset(LENSPIXEL(0,y0), 0xFF, (y1-y0)*lens.width_px*sizeof(unsigned int));
+   }
 
-      // verify table of length 3
-      if (!lua_istable(lua,-1) || lua_rawlen(lua,-1) != 3 )
-      {
-         Con_Printf("plate %d: forward vector is not a 3d vector\n", i+1);
-         lua_pop(lua, 3); // pop forward vector, plate, and plates
+   if (lens_builder.inverse_state.cellsize > 1) {
+      return build_lensmap_inverse_cells(ctx, unit);
+   }
+   return build_lensmap_inverse_row(ctx, unit);
+}
+
+// returns the k-th of n rows, going from the middle row outward
+// (middle, one above, one below, two above, ...)
+static int center_out_index(int k, int n)
+{
+   int mid = n/2;
+   return (k & 1) ? mid - (k+1)/2 : mid + k/2;
+}
+
+// follows the ray of the middle pixel of each block in a row of preview
+// blocks, and fills the blocks with them
+static qboolean build_lensmap_preview_row(struct _lua_ctx *ctx, int row)
+{
+   int step = LENS_PREVIEW_STEP;
+   int y0 = row * step;
+   int y1 = MIN(y0 + step, lens.height_px);
+   int ly = MIN(y0 + step/2, lens.height_px-1);
+   int cols = (lens.width_px + step - 1) / step;
+   int col;
+
+   double y = -(ly-lens.height_px/2) * lens.scale;
+
+   // follow all the light rays in this row with a single lua call
+   qboolean native = lens.native && lens.native->inverse;
+   qboolean batch = !native && ctx->refs->lens_inverse_row != -1;
+   if (batch) {
+      double x = (step/2 - lens.width_px/2) * lens.scale;
+      if (LUAtoC_lens_inverse_row(ctx, y, x, step*lens.scale, cols) == -1) {
          return false;
       }
+   }
 
-      // get forward vector elements
-      for (j=0; j<3; ++j) {
-         lua_rawgeti(lua, -1, j+1);
-         if (!lua_isnumber(lua,-1))
-         {
-            Con_Printf("plate %d: forward vector: element %d not a number\n", i+1, j+1);
-            lua_pop(lua, 4); // pop element, vector, plate, and plates
+   for (col = 0; col < cols; ++col) {
+      int x0 = col * step;
+      int x1 = MIN(x0 + step, lens.width_px);
+      int lx = MIN(x0 + step/2, lens.width_px-1);
+
+      vec3_t ray;
+      if (batch) {
+         if (!ctx->batch_valid[col]) {
+            continue;
+         }
+         VectorCopy(ctx->batch_rays[col], ray);
+      }
+      else {
+         double x = (x0 + step/2 - lens.width_px/2) * lens.scale;
+         int status = lens_inverse(ctx,x,y,ray);
+         if (status == 0) {
+            continue;
+         }
+         else if (status == -1) {
             return false;
          }
-         globe.plates[i].forward[j] = lua_tonumber(lua,-1);
-         lua_pop(lua, 1); // pop element
       }
-      lua_pop(lua,1); // pop forward vector
-
-      // get up vector
-      lua_rawgeti(lua, -1, 2);
 
-      // verify table of length 3
-      if (!lua_istable(lua,-1) || lua_rawlen(lua,-1) != 3 )
-      {
-         Con_Printf("plate %d: up vector is not a 3d vector\n", i+1);
-         lua_pop(lua, 3); // pop forward vector, plate, and plates
-         return false;
+      // set the middle pixel, and copy it to the rest of the block
+      set_lensmap_from_ray(ctx,lx,ly,ray[0],ray[1],ray[2]);
+      unsigned int value = *LENSPIXEL(lx,ly);
+      int bx, by;
+      for (by = y0; by < y1; ++by) {
+         for (bx = x0; bx < x1; ++bx) {
+            *LENSPIXEL(bx,by) = value;
+         }
       }
+   }
 
-      // get up vector elements
-      for (j=0; j<3; ++j) {
-         lua_rawgeti(lua, -1, j+1);
-         if (!lua_isnumber(lua,-1))
-         {
-            Con_Printf("plate %d: up vector: element %d not a number\n", i+1, j+1);
-            lua_pop(lua, 4); // pop element, vector, plate, and plates
-            return false;
+   return true;
+}
+
+// the ray of a lens pixel (at a corner of a grid cell)
+struct _grid_point {
+   int status; // same as lens_inverse
+   vec3_t ray; // normalized
+};
+
+static void grid_point(struct _lua_ctx *ctx, int lx, int ly, struct _grid_point *p)
+{
+   double x = (lx-lens.width_px/2) * lens.scale;
+   double y = -(ly-lens.height_px/2) * lens.scale;
+   p->status = lens_inverse(ctx, x, y, p->ray);
+   if (p->status == 1) {
+      VectorNormalize(p->ray);
+   }
+}
+
+// fill a grid cell with the rays interpolated from its corners
+static void fill_grid_cell(struct _lua_ctx *ctx, int x0, int y0, int size,
+      struct _grid_point *tl, struct _grid_point *tr,
+      struct _grid_point *bl, struct _grid_point *br)
+{
+   int x1 = MIN(x0+size, lens.width_px);
+   int y1 = MIN(y0+size, lens.height_px);
+   int lx, ly, i;
+   for (ly=y0; ly<y1; ly++) {
+      double fy = (double)(ly-y0) / size;
+      for (lx=x0; lx<x1; lx++) {
+         double fx = (double)(lx-x0) / size;
+         vec3_t ray;
+         for (i=0; i<3; i++) {
+            double top = tl->ray[i] + (tr->ray[i] - tl->ray[i]) * fx;
+            double bot = bl->ray[i] + (br->ray[i] - bl->ray[i]) * fx;
+            ray[i] = top + (bot - top) * fy;
          }
-         globe.plates[i].up[j] = lua_tonumber(lua,-1);
-         lua_pop(lua,1); // pop element
+         set_lensmap_from_ray(ctx, lx, ly, ray[0], ray[1], ray[2]);
       }
-      lua_pop(lua, 1); // pop up vector
+   }
+}
 
-      // calculate right vector (and correct up vector)
-      CrossProduct(globe.plates[i].up, globe.plates[i].forward, globe.plates[i].right);
-      CrossProduct(globe.plates[i].forward, globe.plates[i].right, globe.plates[i].up);
+// Build the lensmap for a grid cell from the rays at its corners, splitting
+// it into four when interpolation isn't accurate enough.
+// (returns false if the lens function failed)
+static qboolean build_grid_cell(struct _lua_ctx *ctx, int x0, int y0, int size,
+      struct _grid_point *tl, struct _grid_point *tr,
+      struct _grid_point *bl, struct _grid_point *br)
+{
+   if (x0 >= lens.width_px || y0 >= lens.height_px) {
+      return true;
+   }
 
-      // get fov
-      lua_rawgeti(lua,-1,3);
-      if (!lua_isnumber(lua,-1))
-      {
-         Con_Printf("plate %d: fov not a number\n", i+1);
+   // a single pixel is just its top left corner
+   if (size == 1) {
+      if (tl->status == 1) {
+         set_lensmap_from_ray(ctx, x0, y0, tl->ray[0], tl->ray[1], tl->ray[2]);
       }
-      globe.plates[i].fov = lua_tonumber(lua,-1) * M_PI / 180;
-      lua_pop(lua, 1); // pop fov
+      return true;
+   }
 
-      if (globe.plates[i].fov <= 0)
-      {
-         Con_Printf("plate %d: fov must > 0\n", i+1);
-         return false;
+   int half = size/2;
+   struct _grid_point mid;
+   grid_point(ctx, x0+half, y0+half, &mid);
+   if (mid.status == -1) {
+      return false;
+   }
+
+   // interpolate the whole cell if the center ray is close enough
+   qboolean corners_valid = tl->status == 1 && tr->status == 1 && bl->status == 1 && br->status == 1;
+   if (corners_valid && mid.status == 1) {
+      vec3_t guess;
+      int i;
+      for (i=0; i<3; i++) {
+         guess[i] = (tl->ray[i] + tr->ray[i] + bl->ray[i] + br->ray[i]) * 0.25;
+      }
+      VectorNormalize(guess);
+      if (DotProduct(guess, mid.ray) >= lens_builder.inverse_state.cos_maxerror) {
+         fill_grid_cell(ctx, x0, y0, size, tl, tr, bl, br);
+         return true;
       }
+   }
 
-      // calculate distance to camera
-      globe.plates[i].dist = 0.5/tan(globe.plates[i].fov/2);
+   // split the cell
+   struct _grid_point top, bot, left, right;
+   grid_point(ctx, x0+half, y0, &top);
+   grid_point(ctx, x0+half, y0+size, &bot);
+   grid_point(ctx, x0, y0+half, &left);
+   grid_point(ctx, x0+size, y0+half, &right);
+   if (top.status == -1 || bot.status == -1 || left.status == -1 || right.status == -1) {
+      return false;
    }
-   lua_pop(lua, 1); // pop plates
 
-   globe.numplates = i;
+   // skip cells that are entirely outside the lens
+   if (!tl->status && !tr->status && !bl->status && !br->status && !mid.status &&
+       !top.status && !bot.status && !left.status && !right.status) {
+      return true;
+   }
 
-   return true;
+   return
+      build_grid_cell(ctx, x0,      y0,      half, tl,    &top,   &left, &mid) &&
+      build_grid_cell(ctx, x0+half, y0,      half, &top,  tr,     &mid,  &right) &&
+      build_grid_cell(ctx, x0,      y0+half, half, &left, &mid,   bl,    &bot) &&
+      build_grid_cell(ctx, x0+half, y0+half, half, &mid,  &right, &bot,  br);
 }
 
-#define CLEARVAR(var) lua_pushnil(lua); lua_setglobal(lua, var);
-
-// used to clear the state when switching lenses
-static void LUA_clear_lens(void)
+// calculate all the pixels in a row of grid cells of the inverse lensmap
+// (returns false if the lens function failed)
+static qboolean build_lensmap_inverse_cells(struct _lua_ctx *ctx, int cy)
 {
-   CLEARVAR("map");
-   CLEARVAR("max_fov");
-   CLEARVAR("max_vfov");
-   CLEARVAR("lens_width");
-   CLEARVAR("lens_height");
-   CLEARVAR("lens_inverse");
-   CLEARVAR("lens_forward");
-   CLEARVAR("onload");
+   int cellsize = lens_builder.inverse_state.cellsize;
+   int y0 = cy * cellsize;
+   int x0;
+
+   // corners along the top and bottom of the row
+   struct _grid_point tl, tr, bl, br;
+   grid_point(ctx, 0, y0, &tl);
+   grid_point(ctx, 0, y0+cellsize, &bl);
+   if (tl.status == -1 || bl.status == -1) {
+      return false;
+   }
 
-   // set "numplates" var
-   lua_pushinteger(lua, globe.numplates);
-   lua_setglobal(lua, "numplates");
+   for (x0 = 0; x0 < lens.width_px; x0 += cellsize) {
+      grid_point(ctx, x0+cellsize, y0, &tr);
+      grid_point(ctx, x0+cellsize, y0+cellsize, &br);
+      if (tr.status == -1 || br.status == -1) {
+         return false;
+      }
+
+      if (!build_grid_cell(ctx, x0, y0, cellsize, &tl, &tr, &bl, &br)) {
+         return false;
+      }
+
+      tl = tr;
+      bl = br;
+   }
+
+   return true;
 }
 
-// used to clear the state when switching globes
-static void LUA_clear_globe(void)
+static qboolean resume_lensmap_forward(void)
 {
-   CLEARVAR("plates");
-   CLEARVAR("globe_plate");
+   struct _forward_state *state = &lens_builder.forward_state;
+   int platesize = globe.platesize;
+   int n = platesize+1;
 
-   globe.numplates = 0;
-}
+   start_lens_builder_clock();
+   for (; state->plate_index < globe.numplates; ++state->plate_index)
+   {
+      int plate_index = state->plate_index;
+      int px;
+      for (; state->py >=0; --state->py) {
+         int py = state->py;
 
-#undef CLEARVAR
+         // pause building if we have exceeded time allowed per frame
+         if (is_lens_builder_time_up()) {
+            return true; 
+         }
 
-static qboolean lua_func_exists(const char* name)
-{
-   lua_getglobal(lua, name);
-   int exists = lua_isfunction(lua,-1);
-   lua_pop(lua, 1); // pop name
-   return exists;
+         // FIND ALL DESTINATION SCREEN COORDINATES FOR THIS TEXTURE ROW ********************
+
+         // (the rows are walked upward, so the previous row's top corners
+         //  become this row's bottom corners and only one new row of corners
+         //  has to be mapped)
+         struct _lens_vertex *bot;
+         if (py == platesize-1) {
+            bot = FORWARD_ROW(state->top ^ 1);
+            if (uv_row_to_screen(plate_index, (py + 0.5) / platesize, -0.5, n, bot) == -1) {
+               lens_builder.failed = true;
+               return false;
+            }
+         }
+         else {
+            bot = FORWARD_ROW(state->top);
+            state->top ^= 1;
+         }
+
+         // compute upper points
+         struct _lens_vertex *top = FORWARD_ROW(state->top);
+         if (uv_row_to_screen(plate_index, (py - 0.5) / platesize, -0.5, n, top) == -1) {
+            lens_builder.failed = true;
+            return false;
+         }
+
+         // DRAW QUAD FOR EACH PIXEL IN THIS TEXTURE ROW ***********************************
+
+         double v = ((double)py)/platesize;
+         for (px = 0; px < platesize; ++px) {
+
+            // quads that wrap around a seam of the lens image are dropped
+            if (is_quad_split(top, bot, px, platesize)) {
+               continue;
+            }
+
+            // texels in the overlapping region of another plate only fill
+            // the pixels that no plate has claimed yet
+            double u = ((double)px)/platesize;
+            vec3_t ray;
+            plate_uv_to_ray(plate_index, u, v, ray);
+            qboolean owned = (plate_index == ray_to_plate_index(&lua_main, ray));
+
+            draw_quad(&top[px], &top[px+1], &bot[px], &bot[px+1],
+                  plate_index, px, py, owned);
+         }
+
+      }
+
+      // reset row position
+      // (we have to do it here because it cannot be reset until it is done iterating)
+      // (we cannot do it at the beginning because the function could be resumed at some middle row)
+      state->py = platesize-1;
+   }
+
+   // done building lens
+   return false;
 }
 
+static qboolean resume_lensmap_field(void)
+{
+   start_lens_builder_clock();
+
+   // finish sampling the lens
+   for (; ray_field.rows_done < ray_field.height; ++ray_field.rows_done) {
+      if (is_lens_builder_time_up()) {
+         return true;
+      }
+      if (!build_ray_field_row(&lua_main, ray_field.rows_done)) {
+         lens_builder.failed = true;
+         return false;
+      }
+   }
+
+   // fill the lensmap from the samples
+   int *ly;
+   for (ly = &(lens_builder.field_state.ly); *ly >= 0; --(*ly)) {
+      if (is_lens_builder_time_up()) {
+         return true;
+      }
+      build_lensmap_field_row(&lua_main, *ly);
+   }
+
+   // done building lens
+   return false;
+}
 
 // -------------------------------------------------------------------------------- 
 // |                                                                              |
-// |                           LENS PIXEL SETTERS                                 |
+// |                  FORWARD MAP GETTER/SETTER HELPERS                           |
 // |                                                                              |
 // --------------------------------------------------------------------------------
 
-static void set_lensmap_grid(int lx, int ly, int px, int py, int plate_index)
+// convenience function for forward map calculation:
+//    maps uv coordinate on a texture to a continuous screen coordinate
+//    (pixel (lx,ly) covers [lx,lx+1) x [ly,ly+1))
+static int uv_to_screen(int plate_index, double u, double v, struct _lens_vertex *vert)
 {
-   // designate the palette for this pixel
-   // This will set the palette index map such that a grid is shown
+   // get ray from uv coordinates
+   vec3_t ray;
+   plate_uv_to_ray(plate_index, u, v, ray);
 
-   // (This is a block)
-   //    |----|----|----|
-   //    |    |    |    |
-   //    |    |    |    |
-   //    |----|----|----|
-   //    |    |XXXXXXXXX|
-   //    |    |XXXXXXXXX|
-   //    |----|XXXXXXXXX|
-   //    |    |XXXXXXXXX|
-   //    |    |XXXXXXXXX|
-   //    |----|----|----|
-   double block_size = (rubix.pad_size + rubix.cell_size);
+   // map ray to image coordinates
+   double x,y;
+   int status = lens_forward(&lua_main,ray,&x,&y);
+   vert->valid = (status == 1);
+   if (status == 0 || status == -1) { return status; }
 
-   // (Total number of units across)
-   //    ---------------------------------------------------
-   //    |    |    |    |    |    |    |    |    |    |    |
-   //    |    |    |    |    |    |    |    |    |    |    |
-   //    |----|----|----|----|----|----|----|----|----|----|
-   double num_units = rubix.numcells * block_size + rubix.pad_size;
+   // map image to screen coordinates
+   vert->x = x/lens.scale + lens.width_px/2;
+   vert->y = -y/lens.scale + lens.height_px/2;
 
-   // (the size of one unit)
-   double unit_size_px = (double)globe.platesize / num_units;
+   return status;
+}
 
-   // convert pixel coordinates to units
-   double ux = (double)px/unit_size_px;
-   double uy = (double)py/unit_size_px;
+// maps count points of a texture row to the screen, at u = (u0 + i) / platesize
+static int uv_row_to_screen(int plate_index, double v, double u0, int count,
+      struct _lens_vertex *verts)
+{
+   int platesize = globe.platesize;
+   int i;
 
-   int ongrid =
-      fmod(ux,block_size) < rubix.pad_size ||
-      fmod(uy,block_size) < rubix.pad_size;
+   // map the whole row with a single lua call if the lens supports it
+   qboolean native = lens.native && lens.native->forward;
+   if (!native && lua_refs.lens_forward_batch != -1) {
+      if (!lua_ctx_reserve(&lua_main, count)) {
+         Con_Printf("could not allocate lens batch buffers\n");
+         return -1;
+      }
+      for (i=0; i<count; ++i) {
+         plate_uv_to_ray(plate_index, (u0 + i) / platesize, v, lua_main.batch_rays[i]);
+      }
+      if (LUAtoC_lens_forward_batch(&lua_main, count) == -1) {
+         return -1;
+      }
+      for (i=0; i<count; ++i) {
+         verts[i].valid = lua_main.batch_valid[i];
+         if (verts[i].valid) {
+            double x = lua_main.batch_xy[2*i];
+            double y = lua_main.batch_xy[2*i+1];
+            verts[i].x = x/lens.scale + lens.width_px/2;
+            verts[i].y = -y/lens.scale + lens.height_px/2;
+         }
+      }
+      return 1;
+   }
 
-   if (!ongrid)
-      *LENSPIXELTINT(lx,ly) = plate_index;
+   for (i=0; i<count; ++i) {
+      double u = (u0 + i) / platesize;
+      if (uv_to_screen(plate_index, u, v, &verts[i]) == -1) {
+         return -1;
+      }
+   }
+   return 1;
 }
 
-// set a pixel on the lensmap from plate coordinates
-static void set_lensmap_from_plate(int lx, int ly, int px, int py, int plate_index)
+// the screen width and height of the quad of texel px in a row, from the
+// corners that the lens can see (returns false if there are too few to draw)
+static qboolean quad_extent(const struct _lens_vertex *top, const struct _lens_vertex *bot,
+      int px, float *width, float *height)
 {
-   // check valid lens coordinates
-   if (lx < 0 || lx >= lens.width_px || ly < 0 || ly >= lens.height_px) {
-      return;
+   const struct _lens_vertex *corners[] = { &top[px], &top[px+1], &bot[px+1], &bot[px] };
+   float minx = 0, maxx = 0, miny = 0, maxy = 0;
+   int count = 0;
+   int i;
+   for (i=0; i<4; ++i) {
+      const struct _lens_vertex *p = corners[i];
+      if (!p->valid) {
+         continue;
+      }
+      if (!count++) {
+         minx = maxx = p->x;
+         miny = maxy = p->y;
+      }
+      else {
+         minx = qmin(minx, p->x);
+         maxx = qmax(maxx, p->x);
+         miny = qmin(miny, p->y);
+         maxy = qmax(maxy, p->y);
+      }
    }
+   *width = maxx - minx;
+   *height = maxy - miny;
+   return count >= 3;
+}
 
-   // check valid plate coordinates
-   if (px <0 || px >= globe.platesize || py < 0 || py >= globe.platesize) {
-      return;
+// Returns true if the quad of texel px straddles a seam of the lens image
+// (e.g. the left and right edges of an equirectangular image), so that its
+// corners land on opposite sides of the image.  Such a quad spans half of
+// the image or more, while the quads next to it in the row stay small.
+// (a seam that runs along the row makes the whole row big, so that case is
+//  only caught when the lens gives the size of its image)
+static qboolean is_quad_split(const struct _lens_vertex *top, const struct _lens_vertex *bot,
+      int px, int platesize)
+{
+   float width, height;
+   if (!quad_extent(top, bot, px, &width, &height)) {
+      return false;
    }
 
-   // increase the number of times this side is used
-   globe.plates[plate_index].display = 1;
+   // spans half of the lens image
+   if ((lens.width > 0 && width*lens.scale > lens.width/2) ||
+       (lens.height > 0 && height*lens.scale > lens.height/2)) {
+      return true;
+   }
 
-   // map the lens pixel to this cubeface pixel
-   *LENSPIXEL(lx,ly) = GLOBEPIXEL(plate_index,px,py);
+   // much bigger than the smaller of its neighbours
+   float extent = qmax(width, height);
+   float neighbour = -1;
+   int i;
+   for (i=px-1; i<=px+1; i+=2) {
+      if (i >= 0 && i < platesize && quad_extent(top, bot, i, &width, &height)) {
+         float e = qmax(width, height);
+         neighbour = neighbour < 0 ? e : qmin(neighbour, e);
+      }
+   }
+   return neighbour >= 0 && extent > FORWARD_SEAM_RATIO*neighbour + 1;
+}
 
-   set_lensmap_grid(lx,ly,px,py,plate_index);
+// returns the x coordinate where the edge (a,b) crosses the line at y
+// (a is always the upper point, so an edge shared by two triangles gives the
+//  same result for both)
+static inline double edge_x(const struct _lens_vertex *a, const struct _lens_vertex *b, double y)
+{
+   return a->x + (y - a->y) * (b->x - a->x) / (b->y - a->y);
 }
 
-// set a pixel on the lensmap from plate uv coordinates
-static void set_lensmap_from_plate_uv(int lx, int ly, double u, double v, int plate_index)
+// fills every lens pixel whose center is inside the triangle.  A pixel on an
+// edge shared by two triangles is filled by exactly one of them, so the quads
+// of a texture row tile the screen without gaps or double writes.
+static void draw_triangle(const struct _lens_vertex *a, const struct _lens_vertex *b,
+      const struct _lens_vertex *c, int plate_index, int px, int py, qboolean owned)
 {
-   // convert to plate coordinates
-   int px = (int)(u*globe.platesize);
-   int py = (int)(v*globe.platesize);
-   
-   set_lensmap_from_plate(lx,ly,px,py,plate_index);
+   const struct _lens_vertex *t;
+
+   // sort the corners from top to bottom
+   if (b->y < a->y) { t = a; a = b; b = t; }
+   if (c->y < b->y) { t = b; b = c; c = t; }
+   if (b->y < a->y) { t = a; a = b; b = t; }
+
+   // the rows whose centers are inside the triangle
+   int y0 = (int)ceil(a->y - 0.5);
+   int y1 = (int)ceil(c->y - 0.5);
+   y0 = qmax(y0, 0);
+   y1 = qmin(y1, lens.height_px);
+
+   int offset = GLOBEPIXEL(plate_index,px,py) - globe.pixels;
+   int y;
+   for (y=y0; y<y1; ++y) {
+      double yc = y + 0.5;
+
+      // the long edge spans every row, the short one switches at b
+      double xa = edge_x(a, c, yc);
+      double xb = (yc < b->y) ? edge_x(a, b, yc) : edge_x(b, c, yc);
+      if (xb < xa) { double tx = xa; xa = xb; xb = tx; }
+
+      int x0 = (int)ceil(xa - 0.5);
+      int x1 = (int)ceil(xb - 0.5);
+      x0 = qmax(x0, 0);
+      x1 = qmin(x1, lens.width_px);
+      if (x0 >= x1) {
+         continue;
+      }
+
+      unsigned int value = LENSMAP_PACK(offset, set_lensmap_grid(px,py,plate_index));
+      unsigned int *pixel = LENSPIXEL(x0,y);
+      int x;
+      for (x=x0; x<x1; ++x, ++pixel) {
+         if (owned || *pixel == LENSMAP_NONE) {
+            *pixel = value;
+         }
+      }
+      globe.plates[plate_index].display = 1;
+   }
 }
 
-// set the (lx,ly) pixel on the lensmap to the (sx,sy,sz) view vector
-static void set_lensmap_from_ray(int lx, int ly, double sx, double sy, double sz)
+// draws the screen quad of the texel (px,py) of a plate, from the screen
+// positions of its corners
+static void draw_quad(const struct _lens_vertex *tl, const struct _lens_vertex *tr,
+      const struct _lens_vertex *bl, const struct _lens_vertex *br,
+      int plate_index, int px, int py, qboolean owned)
 {
-   vec3_t ray = {sx,sy,sz};
+   // corners in clockwise order
+   const struct _lens_vertex *corners[] = { tl, tr, br, bl };
 
-   // get plate index
-   int plate_index = ray_to_plate_index(ray);
-   if (plate_index < 0) {
-      return;
+   // count the corners that the lens can see
+   int count = 0, invalid = -1;
+   int i;
+   for (i=0; i<4; ++i) {
+      if (corners[i]->valid) {
+         count++;
+      }
+      else {
+         invalid = i;
+      }
    }
 
-   // get texture coordinates
-   double u,v;
-   if (!ray_to_plate_uv(plate_index, ray, &u, &v)) {
+   // a quad that crosses the lens boundary keeps the triangle that is
+   // inside it, if it has one
+   if (count < 3) {
       return;
    }
 
-   // map lens pixel to plate pixel
-   set_lensmap_from_plate_uv(lx,ly,u,v,plate_index);
+   if (count == 4) {
+      draw_triangle(tl, tr, br, plate_index, px, py, owned);
+      draw_triangle(tl, br, bl, plate_index, px, py, owned);
+   }
+   else {
+      draw_triangle(corners[(invalid+1)%4], corners[(invalid+2)%4], corners[(invalid+3)%4],
+            plate_index, px, py, owned);
+   }
 }
 
-
 // -------------------------------------------------------------------------------- 
 // |                                                                              |
-// |                           GLOBE PIXEL GETTERS                                |
+// |                           LENS WORKER THREADS                                |
 // |                                                                              |
 // --------------------------------------------------------------------------------
 
-// retrieves the plate closest to the given ray
-static int ray_to_plate_index(vec3_t ray)
+static void lens_worker_main(void *arg)
 {
-   int plate_index = 0;
+   struct _lens_worker *worker = arg;
 
-   if (lua_refs.globe_plate != -1) {
-      // use user-defined plate selection function
-      if (LUAtoC_globe_plate(ray, &plate_index)) {
-         return plate_index;
+   while (!lens_workers.abort)
+   {
+      // claim the next band of rows (or a row of grid cells)
+      int units = inverse_lensmap_units();
+      int claim = lens_builder.inverse_state.cellsize > 1 ? 1 : LENS_WORKER_ROWS;
+      int ly = Thread_AtomicAdd(&lens_workers.next_row, claim);
+      if (ly >= units) {
+         break;
       }
-      return -1;
+
+      int end = MIN(ly + claim, units);
+      for (; ly < end; ++ly) {
+         if (!build_lensmap_inverse_unit(&worker->ctx, center_out_index(ly, units))) {
+            // stop the other workers too
+            worker->failed = true;
+            Thread_AtomicAdd(&lens_workers.abort, 1);
+            break;
+         }
+      }
+      flush_lens_counters(&worker->ctx);
    }
 
-   // maximum dotproduct 
-   //  = minimum acos(dotproduct) 
-   //  = minimum angle between vectors
-   double max_dp = -2;
+   Thread_AtomicAdd(&lens_workers.num_finished, 1);
+}
+
+// start building the inverse lensmap on worker threads
+// (returns false if no workers could be started)
+static qboolean start_lens_workers(void)
+{
+   lens_workers.count = 0;
+   lens_workers.next_row = 0;
+   lens_workers.num_finished = 0;
+   lens_workers.abort = 0;
 
    int i;
-   for (i=0; i<globe.numplates; ++i) {
-      double dp = DotProduct(ray, globe.plates[i].forward);
-      if (dp > max_dp) {
-         max_dp = dp;
-         plate_index = i;
+   for (i=0; i<lens_workers.wanted && i<MAX_LENS_WORKERS; ++i)
+   {
+      struct _lens_worker *worker = &lens_workers.worker[i];
+      if (!LUA_load_worker(worker)) {
+         Con_Printf("could not load lens worker: %s", worker->error);
+         break;
+      }
+
+      worker->thread = Thread_Create(lens_worker_main, worker);
+      if (!worker->thread) {
+         lua_close(worker->ctx.L);
+         break;
       }
+
+      lens_workers.count++;
    }
 
-   return plate_index;
+   return lens_workers.count > 0;
 }
 
-static qboolean ray_to_plate_uv(int plate_index, vec3_t ray, double *u, double *v)
+// check if the workers are still building the lensmap
+static qboolean poll_lens_workers(void)
 {
-   // get ray in the plate's relative view frame
-   double x = DotProduct(globe.plates[plate_index].right, ray);
-   double y = DotProduct(globe.plates[plate_index].up, ray);
-   double z = DotProduct(globe.plates[plate_index].forward, ray);
+   if (lens_workers.num_finished < lens_workers.count) {
+      return true;
+   }
 
-   // project ray to the texture
-   double dist = 0.5 / tan(globe.plates[plate_index].fov/2);
-   *u = x/z*dist + 0.5;
-   *v = -y/z*dist + 0.5;
+   // done building lens
+   stop_lens_workers();
+   return false;
+}
 
-   // return true if valid texture coordinates
-   return *u>=0 && *u<=1 && *v>=0 && *v<=1;
+// stop and free all lens workers
+static void stop_lens_workers(void)
+{
+   Thread_AtomicAdd(&lens_workers.abort, 1);
+
+   int i;
+   for (i=0; i<lens_workers.count; ++i)
+   {
+      struct _lens_worker *worker = &lens_workers.worker[i];
+      Thread_Join(worker->thread);
+      lua_close(worker->ctx.L);
+      lua_ctx_free(&worker->ctx);
+
+      if (worker->failed) {
+         Con_Printf("%s", worker->error);
+         lens_builder.failed = true;
+      }
+   }
+
+   lens_workers.count = 0;
 }
 
 // -------------------------------------------------------------------------------- 
 // |                                                                              |
-// |                           LENS BUILDER RESUMERS                              |
+// |                           LENS CACHE FUNCTIONS                               |
 // |                                                                              |
 // --------------------------------------------------------------------------------
 
-static void resume_lensmap(void)
+// FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
+static unsigned int hash_bytes(unsigned int hash, const void *data, size_t len)
 {
-   if (lens.map_type == MAP_FORWARD) {
-      lens_builder.working = resume_lensmap_forward();
+   const byte *p = data;
+   while (len--) {
+      hash ^= *p++;
+      hash *= FNV_PRIME;
    }
-   else if (lens.map_type == MAP_INVERSE) {
-      lens_builder.working = resume_lensmap_inverse();
+   return hash;
+}
+
+// hash the contents of a file (leaves the hash unchanged if it can't be read)
+static unsigned int hash_file(unsigned int hash, const char *filename)
+{
+   byte buf[4096];
+   size_t len;
+   FILE *f = fopen(filename, "rb");
+   if (f == NULL) {
+      return hash;
    }
+   while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+      hash = hash_bytes(hash, buf, len);
+   }
+   fclose(f);
+   return hash;
 }
 
-static qboolean resume_lensmap_inverse(void)
+// compute the key and filename of the lensmap we are about to create
+static void set_lens_cache_key(void)
 {
-   // image coordinates
-   double x,y;
+   int zoom_type = zoom.type;
+   unsigned int key = FNV_OFFSET_BASIS;
+   key = hash_bytes(key, &lens.script_hash, sizeof(lens.script_hash));
+   key = hash_bytes(key, &globe.script_hash, sizeof(globe.script_hash));
+   key = hash_bytes(key, &zoom_type, sizeof(zoom_type));
+   key = hash_bytes(key, &zoom.fov, sizeof(zoom.fov));
+   key = hash_bytes(key, &lens.width_px, sizeof(lens.width_px));
+   key = hash_bytes(key, &lens.height_px, sizeof(lens.height_px));
+   key = hash_bytes(key, &globe.platesize, sizeof(globe.platesize));
+   if (lens.map_type == MAP_INVERSE) {
+      key = hash_bytes(key, &lens_builder.grid.cellsize, sizeof(lens_builder.grid.cellsize));
+      key = hash_bytes(key, &lens_builder.grid.maxerror, sizeof(lens_builder.grid.maxerror));
+   }
+   lens_cache.key = key;
 
-   // lens coordinates
-   int lx, *ly;
+   if (snprintf(lens_cache.filename, sizeof(lens_cache.filename),
+         "%s/" LENSCACHE_DIR "/%s-%s-%08x" LENSCACHE_EXT, com_gamedir, lens.name, globe.name, key)
+         >= sizeof(lens_cache.filename)) {
+      lens_cache.filename[0] = '\0';
+   }
+}
 
-   start_lens_builder_clock();
-   for(ly = &(lens_builder.inverse_state.ly); *ly >= 0; --(*ly))
-   {
-      // pause building if we have exceeded time allowed per frame
-      if (is_lens_builder_time_up()) {
-         return true; 
-      }
+// fill the lensmap from the cache file if it exists
+static qboolean load_lens_cache(void)
+{
+   if (!lens_cache.enabled || !lens_cache.filename[0]) {
+      return false;
+   }
 
-      y = -(*ly-lens.height_px/2) * lens.scale;
+   FILE *f = fopen(lens_cache.filename, "rb");
+   if (f == NULL) {
+      return false;
+   }
 
-      // calculate all the pixels in this row
-      for(lx = 0;lx<lens.width_px;++lx)
-      {
-         x = (lx-lens.width_px/2) * lens.scale;
+   // verify that the file matches the current lens, globe and screen
+   struct _lens_cache_header header;
+   if (fread(&header, sizeof(header), 1, f) != 1 ||
+         memcmp(header.magic, LENSCACHE_MAGIC, 4) ||
+         header.version != LENSCACHE_VERSION ||
+         header.key != lens_cache.key ||
+         header.width_px != lens.width_px ||
+         header.height_px != lens.height_px ||
+         header.platesize != globe.platesize ||
+         header.numplates != globe.numplates) {
+      fclose(f);
+      return false;
+   }
 
-         // determine which light ray to follow
-         vec3_t ray;
-         int status = LUAtoC_lens_inverse(x,y,ray);
-         if (status == 0) {
-            continue;
-         }
-         else if (status == -1) {
-            return false;
+   int area = lens.width_px * lens.height_px;
+   byte *plates = malloc(area*sizeof(byte));
+   int *offsets = malloc(area*sizeof(int));
+   qboolean loaded = plates && offsets &&
+      fread(plates, sizeof(byte), area, f) == area &&
+      fread(offsets, sizeof(int), area, f) == area;
+   fclose(f);
+
+   if (loaded) {
+      int lx, ly;
+      int platesize = globe.platesize;
+      byte *plate = plates;
+      int *offset = offsets;
+      for (ly=0; ly<lens.height_px; ++ly) {
+         for (lx=0; lx<lens.width_px; ++lx, ++plate, ++offset) {
+            if (*plate == LENSCACHE_NOPLATE || *plate >= globe.numplates) {
+               continue;
+            }
+            set_lensmap_from_plate(lx, ly, *offset % platesize, *offset / platesize, *plate);
          }
-
-         // get the pixel belonging to the light ray
-         set_lensmap_from_ray(lx,*ly,ray[0],ray[1],ray[2]);
       }
    }
 
-   // done building lens
-   return false;
+   free(plates);
+   free(offsets);
+
+   // mark the file as recently used, so it is the last to be removed
+   if (loaded) {
+      utime(lens_cache.filename, NULL);
+   }
+   return loaded;
 }
 
-static qboolean resume_lensmap_forward(void)
+static int compare_lens_cache_files(const void *a, const void *b)
 {
-   int *top = lens_builder.forward_state.top;
-   int *bot = lens_builder.forward_state.bot;
-   int *py = &(lens_builder.forward_state.py);
-   int *plate_index = &(lens_builder.forward_state.plate_index);
-   int platesize = globe.platesize;
+   const struct _lens_cache_file *fa = a, *fb = b;
+   return fa->used < fb->used ? -1 : fa->used > fb->used;
+}
 
-   start_lens_builder_clock();
-   for (; *plate_index < globe.numplates; ++(*plate_index))
-   {
-      int px;
-      for (; *py >=0; --(*py)) {
+// remove the least recently used files from the cache directory until it
+// holds at most max_bytes (never removing the file we just wrote)
+static void trim_lens_cache(const char *filename, long long max_bytes)
+{
+   char dirname[LENSCACHE_PATHSIZE];
+   snprintf(dirname, sizeof(dirname), "%s", filename);
+   char *slash = strrchr(dirname, '/');
+   if (slash == NULL) {
+      return;
+   }
+   *slash = '\0';
 
-         // pause building if we have exceeded time allowed per frame
-         if (is_lens_builder_time_up()) {
-            return true; 
-         }
+   DIR *dir = opendir(dirname);
+   if (dir == NULL) {
+      return;
+   }
 
-         // FIND ALL DESTINATION SCREEN COORDINATES FOR THIS TEXTURE ROW ********************
+   struct _lens_cache_file *files = NULL;
+   int numfiles = 0, maxfiles = 0;
+   long long total = 0;
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL) {
+      size_t len = strlen(entry->d_name);
+      size_t extlen = strlen(LENSCACHE_EXT);
+      if (len <= extlen || strcmp(entry->d_name + len - extlen, LENSCACHE_EXT)) {
+         continue;
+      }
 
-         // compute lower points
-         if (*py == platesize-1) {
-            double v = (*py + 0.5) / platesize;
-            for (px = 0; px < platesize; ++px) {
-               // compute left point
-               if (px == 0) {
-                  double u = (px - 0.5) / platesize;
-                  int status = uv_to_screen(*plate_index, u, v, &bot[0], &bot[1]);
-                  if (status == 0) continue; else if (status == -1) return false;
-               }
-               // compute right point
-               double u = (px + 0.5) / platesize;
-               int index = 2*(px+1);
-               int status = uv_to_screen(*plate_index, u, v, &bot[index], &bot[index+1]);
-               if (status == 0) continue; else if (status == -1) return false;
-            }
-         }
-         else {
-            // swap references so that the previous bottom becomes our current top
-            int *temp = top;
-            top = bot;
-            bot = temp;
+      struct _lens_cache_file file;
+      struct stat st;
+      if (snprintf(file.name, sizeof(file.name), "%s/%s", dirname, entry->d_name)
+            >= sizeof(file.name) || stat(file.name, &st) != 0) {
+         continue;
+      }
+      file.size = st.st_size;
+      file.used = st.st_mtime;
+      total += file.size;
+
+      if (numfiles == maxfiles) {
+         maxfiles = maxfiles ? maxfiles*2 : 16;
+         struct _lens_cache_file *grown = realloc(files, maxfiles*sizeof(*files));
+         if (grown == NULL) {
+            break;
          }
+         files = grown;
+      }
+      files[numfiles++] = file;
+   }
+   closedir(dir);
 
-         // compute upper points
-         double v = (*py - 0.5) / platesize;
-         for (px = 0; px < platesize; ++px) {
-            // compute left point
-            if (px == 0) {
-               double u = (px - 0.5) / platesize;
-               int status = uv_to_screen(*plate_index, u, v, &top[0], &top[1]);
-               if (status == 0) continue; else if (status == -1) return false;
-            }
-            // compute right point
-            double u = (px + 0.5) / platesize;
-            int index = 2*(px+1);
-            int status = uv_to_screen(*plate_index, u, v, &top[index], &top[index+1]);
-            if (status == 0) continue; else if (status == -1) return false;
-         }
+   qsort(files, numfiles, sizeof(*files), compare_lens_cache_files);
 
-         // DRAW QUAD FOR EACH PIXEL IN THIS TEXTURE ROW ***********************************
+   int i;
+   for (i=0; i<numfiles && total > max_bytes; ++i) {
+      if (strcmp(files[i].name, filename) && remove(files[i].name) == 0) {
+         total -= files[i].size;
+      }
+   }
+   free(files);
+}
 
-         v = ((double)*py)/platesize;
-         for (px = 0; px < platesize; ++px) {
-            
-            // skip overlapping region of texture
-            double u = ((double)px)/platesize;
-            vec3_t ray;
-            plate_uv_to_ray(*plate_index, u, v, ray);
-            if (*plate_index != ray_to_plate_index(ray)) {
-               continue;
-            }
+// write a lensmap to its cache file (runs on the cache writer thread)
+static void lens_cache_write_main(void *arg)
+{
+   struct _lens_cache_write *w = arg;
 
-            int index = 2*px;
-            draw_quad(&top[index], &top[index+2], &bot[index], &bot[index+2], *plate_index,px,*py);
-         }
+   // write to a temporary file first, so a lensmap is never loaded half written
+   char tmpname[LENSCACHE_PATHSIZE + 4];
+   snprintf(tmpname, sizeof(tmpname), "%s.tmp", w->filename);
 
-      }
+   COM_CreatePath(w->filename);
+   FILE *f = fopen(tmpname, "wb");
+   if (f == NULL) {
+      w->failed = true;
+      return;
+   }
 
-      // reset row position
-      // (we have to do it here because it cannot be reset until it is done iterating)
-      // (we cannot do it at the beginning because the function could be resumed at some middle row)
-      *py = platesize-1;
+   qboolean written =
+      fwrite(&w->header, sizeof(w->header), 1, f) == 1 &&
+      fwrite(w->plates, sizeof(byte), w->area, f) == w->area &&
+      fwrite(w->offsets, sizeof(int), w->area, f) == w->area;
+   written = fclose(f) == 0 && written;
+
+   // (windows can't rename over an existing file)
+   remove(w->filename);
+   if (!written || rename(tmpname, w->filename) != 0) {
+      remove(tmpname);
+      w->failed = true;
+      return;
+   }
+
+   trim_lens_cache(w->filename, w->max_bytes);
+}
+
+// wait for the last cache file to be written
+static void finish_lens_cache_write(void)
+{
+   struct _lens_cache_write *w = &lens_cache.write;
+   if (w->thread) {
+      Thread_Join(w->thread);
+      w->thread = NULL;
+   }
+   if (w->failed) {
+      Con_Printf("could not write \"%s\"\n", w->filename);
+      w->failed = false;
+   }
+   free(w->plates);
+   free(w->offsets);
+   w->plates = NULL;
+   w->offsets = NULL;
+}
+
+// write the finished lensmap to the cache file
+// (the file is written on a thread, so this only copies the lensmap)
+static void save_lens_cache(void)
+{
+   if (!lens_cache.enabled || !lens_cache.filename[0]) {
+      return;
+   }
+
+   finish_lens_cache_write();
+
+   struct _lens_cache_write *w = &lens_cache.write;
+   int area = lens.width_px * lens.height_px;
+   int platearea = globe.platesize * globe.platesize;
+   w->plates = malloc(area*sizeof(byte));
+   w->offsets = malloc(area*sizeof(int));
+   if (!w->plates || !w->offsets) {
+      finish_lens_cache_write();
+      return;
+   }
+
+   // convert the pixel pointers to plate coordinates
+   int i;
+   unsigned int *lmap = lens.pixels;
+   for (i=0; i<area; ++i, ++lmap) {
+      if (*lmap != LENSMAP_NONE) {
+         int offset = LENSMAP_OFFSET(*lmap);
+         w->plates[i] = offset / platearea;
+         w->offsets[i] = offset % platearea;
+      }
+      else {
+         w->plates[i] = LENSCACHE_NOPLATE;
+         w->offsets[i] = 0;
+      }
    }
 
-   free(top);
-   free(bot);
-
-   // done building lens
-   return false;
+   struct _lens_cache_header *header = &w->header;
+   memcpy(header->magic, LENSCACHE_MAGIC, 4);
+   header->version = LENSCACHE_VERSION;
+   header->key = lens_cache.key;
+   header->width_px = lens.width_px;
+   header->height_px = lens.height_px;
+   header->platesize = globe.platesize;
+   header->numplates = globe.numplates;
+
+   w->area = area;
+   w->max_bytes = (long long)lens_cache.max_mb * 1024 * 1024;
+   snprintf(w->filename, sizeof(w->filename), "%s", lens_cache.filename);
+
+   w->thread = Thread_Create(lens_cache_write_main, w);
+   if (w->thread == NULL) {
+      lens_cache_write_main(w);
+      finish_lens_cache_write();
+   }
 }
 
 // -------------------------------------------------------------------------------- 
 // |                                                                              |
-// |                  FORWARD MAP GETTER/SETTER HELPERS                           |
+// |                           RAY FIELD FUNCTIONS                                |
 // |                                                                              |
 // --------------------------------------------------------------------------------
 
-// convenience function for forward map calculation:
-//    maps uv coordinate on a texture to a screen coordinate
-static int uv_to_screen(int plate_index, double u, double v, int *lx, int *ly)
+// identifies everything the rays of the current lens depend on
+static unsigned int ray_field_key(void)
 {
-   // get ray from uv coordinates
-   vec3_t ray;
-   plate_uv_to_ray(plate_index, u, v, ray);
-
-   // map ray to image coordinates
-   double x,y;
-   int status = LUAtoC_lens_forward(ray,&x,&y);
-   if (status == 0 || status == -1) { return status; }
-
-   // map image to screen coordinates
-   *lx = (int)(x/lens.scale + lens.width_px/2);
-   *ly = (int)(-y/lens.scale + lens.height_px/2);
+   unsigned int key = FNV_OFFSET_BASIS;
+   key = hash_bytes(key, &lens.script_hash, sizeof(lens.script_hash));
+   key = hash_bytes(key, &lens.width, sizeof(lens.width));
+   key = hash_bytes(key, &lens.height, sizeof(lens.height));
+   return key;
+}
 
-   return status;
+// half of the visible width and height in lens units (at the current zoom)
+static void ray_field_view(double *halfw, double *halfh)
+{
+   *halfw = (lens.width_px/2 + 1) * lens.scale;
+   *halfh = (lens.height_px/2 + 1) * lens.scale;
 }
 
-// fills a quad on the lensmap using the given plate coordinate
-static void draw_quad(int *tl, int *tr, int *bl, int *br,
-      int plate_index, int px, int py)
+// returns true if the sampled rays can be used for the current zoom
+static qboolean ray_field_covers_view(void)
 {
-   // array for quad corners in clockwise order
-   int *p[] = { tl, tr, br, bl };
+   if (!ray_field.height || ray_field.key != ray_field_key()) {
+      return false;
+   }
 
-   // get bounds
-   int x = tl[0], y = tl[1];
-   int miny=y, maxy=y;
-   int minx=x, maxx=x;
-   int i;
-   for (i=1; i<4; i++) {
-      int tx = p[i][0];
-      if (tx < minx) { minx = tx; }
-      else if (tx > maxx) { maxx = tx; }
-
-      int ty = p[i][1];
-      if (ty < miny) { miny = ty; }
-      else if (ty > maxy) { maxy = ty; }
-   }
-
-   // temp solution for keeping quads from wrapping around
-   //    the boundaries of the image. I guess that quads
-   //    will not get very big unless they're doing wrapping.
-   // actual clipping will require knowledge of the boundary.
-   const int maxdiff = 20;
-   if (abs(minx-maxx) > maxdiff || abs(miny-maxy) > maxdiff) {
-      return;
+   // too far between samples?
+   if (ray_field.step > lens.scale * RAYFIELD_MAX_SPACING) {
+      return false;
    }
 
-   // pixel
-   if (miny == maxy && minx == maxx) {
-      set_lensmap_from_plate(x,y,px,py,plate_index);
-      return;
+   // outside of the samples?
+   double halfw, halfh;
+   ray_field_view(&halfw, &halfh);
+   double x1 = ray_field.x0 + (ray_field.width-1) * ray_field.step;
+   double y1 = ray_field.y0 - (ray_field.height-1) * ray_field.step;
+   return (-halfw >= ray_field.x0 && halfw <= x1 && halfh <= ray_field.y0 && -halfh >= y1);
+}
+
+// starts sampling the lens around the current view
+static qboolean create_ray_field(void)
+{
+   double halfw, halfh;
+   ray_field_view(&halfw, &halfh);
+
+   // sample around the view, but not past the edges of the lens image
+   double fieldw = halfw * RAYFIELD_MARGIN;
+   double fieldh = halfh * RAYFIELD_MARGIN;
+   if (lens.width > 0) {
+      fieldw = qmax(halfw, qmin(fieldw, lens.width/2));
+   }
+   if (lens.height > 0) {
+      fieldh = qmax(halfh, qmin(fieldh, lens.height/2));
    }
 
-   // horizontal line
-   if (miny == maxy) {
-      int tx;
-      for (tx=minx; tx<=maxx; ++tx) {
-         set_lensmap_from_plate(tx,miny,px,py,plate_index);
+   // space the samples further apart if there would be too many of them
+   double step = lens.scale * RAYFIELD_SPACING;
+   int width, height;
+   for (;;) {
+      width = (int)ceil(2*fieldw / step) + 1;
+      height = (int)ceil(2*fieldh / step) + 1;
+      if ((double)width*height <= RAYFIELD_MAX_SAMPLES) {
+         break;
       }
-      return;
+      step *= 1.25;
    }
 
-   // vertical line
-   if (minx == maxx) {
-      int ty;
-      for (ty=miny; ty<=maxy; ++ty) {
-         set_lensmap_from_plate(x,ty,px,py,plate_index);
+   if (width*height > ray_field.capacity) {
+      free(ray_field.rays);
+      ray_field.rays = malloc(width*height*sizeof(vec3_t));
+      ray_field.capacity = ray_field.rays ? width*height : 0;
+      if (!ray_field.rays) {
+         ray_field.height = 0;
+         Con_Printf("could not allocate the lens ray field\n");
+         return false;
       }
-      return;
    }
 
-   // quad
-   for (y=miny; y<=maxy; ++y) {
-
-      // get x points
-      int tx[2] = {minx,maxx};
-      int txi=0; // tx index
-      int j=3;
-      for (i=0; i<4; ++i) {
-         int ix = p[i][0], iy = p[i][1];
-         int jx = p[j][0], jy = p[j][1];
-         if ((iy < y && y <= jy) || (jy < y && y <= iy)) {
-            double dy = jy-iy;
-            double dx = jx-ix;
-            tx[txi] = (int)(ix + (y-iy)/dy*dx);
-            if (++txi == 2) break;
+   ray_field.key = ray_field_key();
+   ray_field.step = step;
+   ray_field.x0 = -fieldw;
+   ray_field.y0 = fieldh;
+   ray_field.width = width;
+   ray_field.height = height;
+   ray_field.rows_done = 0;
+   return true;
+}
+
+// samples the rays in one row of the ray field
+static qboolean build_ray_field_row(struct _lua_ctx *ctx, int row)
+{
+   vec3_t *rays = ray_field.rays + row*ray_field.width;
+   double y = ray_field.y0 - row * ray_field.step;
+   int i;
+
+   // follow all the light rays in this row with a single lua call
+   qboolean native = lens.native && lens.native->inverse;
+   if (!native && ctx->refs->lens_inverse_row != -1) {
+      if (LUAtoC_lens_inverse_row(ctx, y, ray_field.x0, ray_field.step, ray_field.width) == -1) {
+         return false;
+      }
+      for (i=0; i<ray_field.width; i++) {
+         if (ctx->batch_valid[i]) {
+            VectorCopy(ctx->batch_rays[i], rays[i]);
+            VectorNormalize(rays[i]);
+         }
+         else {
+            rays[i][0] = rays[i][1] = rays[i][2] = 0;
          }
-         j=i;
       }
+      return true;
+   }
 
-      // order x points
-      if (tx[0] > tx[1]) {
-         int temp = tx[0];
-         tx[0] = tx[1];
-         tx[1] = temp;
+   for (i=0; i<ray_field.width; i++) {
+      double x = ray_field.x0 + i * ray_field.step;
+      int status = lens_inverse(ctx, x, y, rays[i]);
+      if (status == -1) {
+         return false;
       }
-
-      // sanity check on distance
-      if (tx[1] - tx[0] > maxdiff)
-      {
-         Con_Printf("%d > maxdiff\n", tx[1]-tx[0]);
-         return;
+      else if (status == 0) {
+         rays[i][0] = rays[i][1] = rays[i][2] = 0;
+      }
+      else {
+         VectorNormalize(rays[i]);
       }
+   }
+   return true;
+}
 
-      // draw horizontal line between x points
-      for (x=tx[0]; x<=tx[1]; ++x) {
-         set_lensmap_from_plate(x,y,px,py,plate_index);
+// fills a row of the lensmap by interpolating the sampled rays
+static void build_lensmap_field_row(struct _lua_ctx *ctx, int ly)
+{
+   double y = -(ly-lens.height_px/2) * lens.scale;
+   double fy = (ray_field.y0 - y) / ray_field.step;
+   int j = (int)floor(fy);
+   fy -= j;
+   if (j < 0 || j >= ray_field.height) {
+      return;
+   }
+   int j1 = MIN(j+1, ray_field.height-1);
+
+   int lx;
+   for (lx=0; lx<lens.width_px; lx++) {
+      double x = (lx-lens.width_px/2) * lens.scale;
+      double fx = (x - ray_field.x0) / ray_field.step;
+      int i = (int)floor(fx);
+      fx -= i;
+      if (i < 0 || i >= ray_field.width) {
+         continue;
+      }
+      int i1 = MIN(i+1, ray_field.width-1);
+
+      float *tl = ray_field.rays[j*ray_field.width + i];
+      float *tr = ray_field.rays[j*ray_field.width + i1];
+      float *bl = ray_field.rays[j1*ray_field.width + i];
+      float *br = ray_field.rays[j1*ray_field.width + i1];
+
+      // interpolate between the four samples around the pixel, unless one is
+      // missing or they are on different sides of a seam in the lens image
+      qboolean smooth =
+         DotProduct(tl,br) > RAYFIELD_MIN_DOT &&
+         DotProduct(tr,bl) > RAYFIELD_MIN_DOT;
+      if (smooth) {
+         vec3_t ray;
+         int k;
+         for (k=0; k<3; k++) {
+            double top = tl[k] + (tr[k] - tl[k]) * fx;
+            double bot = bl[k] + (br[k] - bl[k]) * fx;
+            ray[k] = top + (bot - top) * fy;
+         }
+         set_lensmap_from_ray(ctx, lx, ly, ray[0], ray[1], ray[2]);
+      }
+      else {
+         // use the closest sample
+         float *ray = (fy < 0.5) ? (fx < 0.5 ? tl : tr) : (fx < 0.5 ? bl : br);
+         if (ray[0] || ray[1] || ray[2]) {
+            set_lensmap_from_ray(ctx, lx, ly, ray[0], ray[1], ray[2]);
+         }
       }
    }
 }
@@ -2343,30 +5615,77 @@ static void draw_quad(int *tl, int *tr, int *bl, int *br,
 // |                                                                              |
 // --------------------------------------------------------------------------------
 
-static void create_lensmap_inverse(void)
+// (replace = build over a finished map that is still drawn, without a preview)
+static void create_lensmap_inverse(qboolean replace)
 {
    // initialize progress state
-   lens_builder.inverse_state.ly = lens.height_px-1;
+   lens_builder.inverse_state.cellsize = lens_builder.grid.cellsize;
+   lens_builder.inverse_state.cos_maxerror = cos(lens_builder.grid.maxerror * M_PI / 180);
+   lens_builder.inverse_state.ly = inverse_lensmap_units()-1;
+   lens_builder.inverse_state.preview_row = 0;
+   lens_builder.inverse_state.preview_rows = 0;
+   lens_builder.inverse_state.replace = replace || lens_builder.preview;
+
+   // draw a preview before the full build, which then starts the worker threads
+   // (otherwise hand the work to the worker threads now if we can)
+   if (lens_builder.preview && !replace) {
+      lens_builder.inverse_state.preview_rows = (lens.height_px + LENS_PREVIEW_STEP - 1) / LENS_PREVIEW_STEP;
+   }
+   else {
+      start_lens_workers();
+   }
+
+   resume_lensmap();
+}
+
+static void create_lensmap_field(void)
+{
+   // initialize progress state
+   lens_builder.field_state.active = true;
+   lens_builder.field_state.ly = lens.height_px-1;
 
    resume_lensmap();
 }
 
 static void create_lensmap_forward(void)
 {
+   struct _forward_state *state = &lens_builder.forward_state;
+
+   // grow the vertex grid if the plates got bigger
+   int gridsize = 2*(globe.platesize+1);
+   if (gridsize > state->gridsize) {
+      free(state->grid);
+      state->grid = malloc(gridsize*sizeof(*state->grid));
+      state->gridsize = state->grid ? gridsize : 0;
+      if (!state->grid) {
+         Con_Printf("could not allocate forward lens grid\n");
+         lens_builder.working = false;
+         lens_builder.failed = true;
+         return;
+      }
+   }
+
    // initialize progress state
-   int *rowa = malloc((globe.platesize+1)*sizeof(int[2]));
-   int *rowb = malloc((globe.platesize+1)*sizeof(int[2]));
-   lens_builder.forward_state.top = rowa;
-   lens_builder.forward_state.bot = rowb;
-   lens_builder.forward_state.py = globe.platesize-1;
-   lens_builder.forward_state.plate_index = 0;
+   state->top = 0;
+   state->py = globe.platesize-1;
+   state->plate_index = 0;
 
    resume_lensmap();
 }
 
 static void create_lensmap(void)
 {
+   int i;
+
    lens_builder.working = false;
+   lens_builder.failed = false;
+   lens_builder.field_state.active = false;
+   lens_spans.valid = false;
+   globe.bounds_valid = false;
+   for (i=0; i<MAX_PLATES; i++) {
+      globe.plates[i].size = globe.platesize;
+      globe.plates[i].rendered = false;
+   }
 
    // render nothing if current lens or globe is invalid
    if (!lens.valid || !globe.valid)
@@ -2379,54 +5698,499 @@ static void create_lensmap(void)
    }
 
    // clear the side counts
-   int i;
    for (i=0; i<globe.numplates; i++) {
       globe.plates[i].display = 0;
    }
 
+   // use the saved lensmap if we have built this one before
+   set_lens_cache_key();
+   if (load_lens_cache()) {
+      finish_lensmap();
+      return;
+   }
+
    // create lensmap
    if (lens.map_type == MAP_FORWARD) {
       create_lensmap_forward();
    }
    else if (lens.map_type == MAP_INVERSE) {
-      create_lensmap_inverse();
+
+      // the lens variables can depend on the globe, so its rays have to be sampled again
+      if (globe.changed) {
+         ray_field.height = 0;
+      }
+
+      // only the scale changes when zooming, so sample the rays once and
+      // interpolate them for every zoom after that, until the zoom stops
+      // (see refine_lensmap)
+      qboolean zoom_only = zoom.changed && !lens.changed && !globe.changed;
+      if (zoom_only && (ray_field_covers_view() || create_ray_field())) {
+         create_lensmap_field();
+      }
+      else {
+         create_lensmap_inverse(false);
+      }
    }
    else { // MAP_NONE
       Con_Printf("no inverse or forward map being used\n");
    }
 }
 
+// Replace a lensmap interpolated from the ray field with the exact one, once
+// the zoom has stopped.  The interpolated map is drawn until the exact build
+// reaches each of its rows.  (the exact map can't be in the lens cache,
+// since create_lensmap would have loaded it instead of interpolating)
+static void refine_lensmap(void)
+{
+   int i;
+
+   lens_builder.field_state.active = false;
+   lens_spans.valid = false;
+   globe.bounds_valid = false;
+   unresize_plates();
+   for (i=0; i<MAX_PLATES; i++) {
+      globe.plates[i].rendered = false;
+   }
+
+   create_lensmap_inverse(true);
+}
+
 // -------------------------------------------------------------------------------- 
 // |                                                                              |
 // |                           LENS RENDERERS                                     |
 // |                                                                              |
 // --------------------------------------------------------------------------------
 
-// draw the lensmap to the vidbuffer
-static void render_lensmap(void)
+// prepare a finished lensmap for drawing
+static void finish_lensmap(void)
+{
+   resize_plates();
+   build_lens_spans();
+   find_plate_bounds();
+}
+
+// Choose the size to render each plate at, from how densely the finished
+// lensmap samples it, and point the lensmap at the resized plates.
+//
+// The density of a plate is the number of lens pixels sampling it, divided by
+// the texel area they sample from (approximated by the number of
+// PLATE_DENSITY_BLOCK sized blocks touched).  If there are fewer lens pixels
+// than texels, the plate can be shrunk by the square root of that ratio
+// without the lens losing detail.
+static void resize_plates(void)
+{
+   int platesize = globe.platesize;
+   int platearea = platesize * platesize;
+   int blocks = (platesize + PLATE_DENSITY_BLOCK - 1) / PLATE_DENSITY_BLOCK;
+   int i;
+
+   if (globe.min_plate_scale >= 1) {
+      return;
+   }
+
+   byte *touched = calloc(MAX_PLATES * blocks * blocks, 1);
+   if (!touched) {
+      return;
+   }
+
+   int numpixels[MAX_PLATES] = {0};
+   int numblocks[MAX_PLATES] = {0};
+   unsigned int *lmap = lens.pixels;
+   int area = lens.width_px * lens.height_px;
+   for (i=0; i<area; i++, lmap++) {
+      if (*lmap == LENSMAP_NONE)
+         continue;
+      int offset = LENSMAP_OFFSET(*lmap);
+      int plate = offset / platearea;
+      int px = (offset % platearea) % platesize;
+      int py = (offset % platearea) / platesize;
+      byte *block = touched + (plate*blocks + py/PLATE_DENSITY_BLOCK)*blocks + px/PLATE_DENSITY_BLOCK;
+      numpixels[plate]++;
+      if (!*block) {
+         *block = 1;
+         numblocks[plate]++;
+      }
+   }
+   free(touched);
+
+   qboolean resized = false;
+   for (i=0; i<MAX_PLATES; i++) {
+      if (!numblocks[i])
+         continue;
+      double texels = (double)numblocks[i] * PLATE_DENSITY_BLOCK * PLATE_DENSITY_BLOCK;
+      double scale = sqrt(numpixels[i] / texels);
+      if (scale < globe.min_plate_scale) scale = globe.min_plate_scale;
+      if (scale > 1) scale = 1;
+      int size = (int)ceil(platesize * scale);
+      if (size < MIN_PLATESIZE) size = qmin(MIN_PLATESIZE, platesize);
+      globe.plates[i].size = size;
+      if (size != platesize)
+         resized = true;
+   }
+
+   if (!resized) {
+      return;
+   }
+
+   // move each lens pixel to the same spot on the resized plate
+   lmap = lens.pixels;
+   for (i=0; i<area; i++, lmap++) {
+      if (*lmap == LENSMAP_NONE)
+         continue;
+      int offset = LENSMAP_OFFSET(*lmap);
+      int plate = offset / platearea;
+      int size = globe.plates[plate].size;
+      int px = (offset % platearea) % platesize * size / platesize;
+      int py = (offset % platearea) / platesize * size / platesize;
+      *lmap = LENSMAP_PACK(plate*platearea + py*size + px, LENSMAP_TINT(*lmap));
+   }
+}
+
+// point the lensmap back at the full size plates (undoes resize_plates)
+static void unresize_plates(void)
+{
+   int platesize = globe.platesize;
+   int platearea = platesize * platesize;
+   int area = lens.width_px * lens.height_px;
+   unsigned int *lmap = lens.pixels;
+   int i;
+
+   for (i=0; i<area; i++, lmap++) {
+      if (*lmap == LENSMAP_NONE)
+         continue;
+      int offset = LENSMAP_OFFSET(*lmap);
+      int plate = offset / platearea;
+      int size = globe.plates[plate].size;
+      if (size == platesize)
+         continue;
+      int px = (offset % platearea) % size * platesize / size;
+      int py = (offset % platearea) / size * platesize / size;
+      *lmap = LENSMAP_PACK(plate*platearea + py*platesize + px, LENSMAP_TINT(*lmap));
+   }
+
+   for (i=0; i<MAX_PLATES; i++) {
+      globe.plates[i].size = platesize;
+   }
+}
+
+// find the runs of covered pixels in each row of the finished lensmap
+static void build_lens_spans(void)
 {
-   byte **lmap = lens.pixels;
-   byte *pmap = lens.pixel_tints;
+   lens_spans.count = 0;
+   lens_spans.valid = false;
+
+   unsigned int *lmap = lens.pixels;
    int x, y;
-   for(y=0; y<lens.height_px; y++)
-      for(x=0; x<lens.width_px; x++,lmap++,pmap++)
-         if (*lmap) {
-            int lx = x+scr_vrect.x;
-            int ly = y+scr_vrect.y;
-            if (rubix.enabled) {
-               int i = *pmap;
-               *VBUFFER(lx,ly) = i != 255 ? globe.plates[i].palette[**lmap] : **lmap;
-            }
-            else {
-               *VBUFFER(lx,ly) = **lmap;
+   for (y=0; y<lens.height_px; y++, lmap += lens.width_px) {
+      x = 0;
+      while (x < lens.width_px) {
+
+         // skip the uncovered pixels
+         while (x < lens.width_px && lmap[x] == LENSMAP_NONE) x++;
+         if (x == lens.width_px) break;
+
+         int start = x;
+         while (x < lens.width_px && lmap[x] != LENSMAP_NONE) x++;
+
+         if (lens_spans.count == lens_spans.size) {
+            int size = lens_spans.size ? lens_spans.size*2 : 1024;
+            struct _lens_span *span = realloc(lens_spans.span, size*sizeof(struct _lens_span));
+            if (!span) {
+               // just render every pixel
+               return;
             }
+            lens_spans.span = span;
+            lens_spans.size = size;
+         }
+
+         struct _lens_span *span = &lens_spans.span[lens_spans.count++];
+         span->x = start;
+         span->y = y;
+         span->len = x - start;
+      }
+   }
+
+   lens_spans.valid = true;
+}
+
+// find the part of each plate that the finished lensmap samples
+static void find_plate_bounds(void)
+{
+   int platearea = globe.platesize * globe.platesize;
+   int minx[MAX_PLATES], miny[MAX_PLATES], maxx[MAX_PLATES], maxy[MAX_PLATES];
+   int i;
+   for (i=0; i<MAX_PLATES; i++) {
+      minx[i] = miny[i] = globe.plates[i].size;
+      maxx[i] = maxy[i] = -1;
+   }
+
+   unsigned int *lmap = lens.pixels;
+   int area = lens.width_px * lens.height_px;
+   for (i=0; i<area; i++, lmap++) {
+      if (*lmap == LENSMAP_NONE)
+         continue;
+      int offset = LENSMAP_OFFSET(*lmap);
+      int plate = offset / platearea;
+      int size = globe.plates[plate].size;
+      int px = (offset % platearea) % size;
+      int py = (offset % platearea) / size;
+      if (px < minx[plate]) minx[plate] = px;
+      if (px > maxx[plate]) maxx[plate] = px;
+      if (py < miny[plate]) miny[plate] = py;
+      if (py > maxy[plate]) maxy[plate] = py;
+   }
+
+   for (i=0; i<MAX_PLATES; i++) {
+      vrect_t *b = &globe.plates[i].bounds;
+
+      // (the plate may have been resized, and only the new bounds get rendered)
+      globe.plates[i].rendered = false;
+
+      if (maxx[i] < 0) {
+         b->x = b->y = b->width = b->height = 0;
+         continue;
+      }
+      int x0 = qmax(minx[i] - PLATE_BOUNDS_MARGIN, 0);
+      int y0 = qmax(miny[i] - PLATE_BOUNDS_MARGIN, 0);
+      int x1 = qmin(maxx[i] + PLATE_BOUNDS_MARGIN, globe.plates[i].size-1);
+      int y1 = qmin(maxy[i] + PLATE_BOUNDS_MARGIN, globe.plates[i].size-1);
+      b->x = x0;
+      b->y = y0;
+      b->width = x1 - x0 + 1;
+      b->height = y1 - y0 + 1;
+   }
+
+   globe.bounds_valid = true;
+}
+
+#ifdef LENS_SIMD_AVX2
+
+static qboolean render_span_simd_supported(void)
+{
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("avx2") ? true : false;
+}
+
+// Gather 8 plate pixels at a time.  Each gather reads the 4 bytes starting at
+// the plate pixel (hence GLOBE_PIXELS_PAD), and the low byte of each is kept.
+__attribute__((target("avx2")))
+static int render_span_avx2(byte *dst, const unsigned int *src, int len)
+{
+   const __m256i mask = _mm256_set1_epi32(LENSMAP_OFFSET_MASK);
+   const __m256i lowbytes = _mm256_setr_epi8(
+      0,4,8,12, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1,
+      0,4,8,12, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1);
+   const int *base = (const int*)globe.pixels;
+
+   int i;
+   for (i=0; i+8 <= len; i+=8) {
+      __m256i offsets = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(src+i)), mask);
+      __m256i words = _mm256_i32gather_epi32(base, offsets, 1);
+      __m256i bytes = _mm256_shuffle_epi8(words, lowbytes);
+      unsigned int lo = _mm256_extract_epi32(bytes, 0);
+      unsigned int hi = _mm256_extract_epi32(bytes, 4);
+      memcpy(dst+i, &lo, 4);
+      memcpy(dst+i+4, &hi, 4);
+   }
+   return i;
+}
+
+#else
+
+static qboolean render_span_simd_supported(void)
+{
+   return false;
+}
+
+#endif
+
+// copy a run of covered lens pixels from the plates
+static void render_span(byte *dst, const unsigned int *src, int len)
+{
+   const byte *pixels = globe.pixels;
+   int i = 0;
+
+#ifdef LENS_SIMD_AVX2
+   if (lens_spans.simd_enabled) {
+      i = render_span_avx2(dst, src, len);
+   }
+#endif
+
+   for (; i+4 <= len; i+=4) {
+      dst[i]   = pixels[LENSMAP_OFFSET(src[i])];
+      dst[i+1] = pixels[LENSMAP_OFFSET(src[i+1])];
+      dst[i+2] = pixels[LENSMAP_OFFSET(src[i+2])];
+      dst[i+3] = pixels[LENSMAP_OFFSET(src[i+3])];
+   }
+   for (; i<len; i++) {
+      dst[i] = pixels[LENSMAP_OFFSET(src[i])];
+   }
+}
+
+// copy a run of covered lens pixels, applying the rubix tints
+static void render_span_tinted(byte *dst, const unsigned int *src, int len)
+{
+   int i;
+   for (i=0; i<len; i++) {
+      unsigned int v = src[i];
+      byte color = globe.pixels[LENSMAP_OFFSET(v)];
+      int tint = LENSMAP_TINT(v);
+      dst[i] = tint != LENSMAP_NOTINT ? globe.plates[tint].palette[color] : color;
+   }
+}
+
+// Each frame the lensmap is drawn in horizontal bands, which are shared out
+// to the job pool.  There are a few bands per thread so that threads with
+// less of the lens in their bands can pick up more.
+#define LENS_BANDS_PER_THREAD 4
+struct _lens_draw {
+   void (*draw)(byte *dst, const unsigned int *src, int len);
+   int numbands;
+};
+
+// draw one band of the lensmap to the vidbuffer
+static void render_lensmap_band(void *arg, int band)
+{
+   struct _lens_draw *job = arg;
+
+   // only visit the covered pixels of a finished lensmap
+   if (lens_spans.valid) {
+      int i;
+      int start = lens_spans.count * band / job->numbands;
+      int end = lens_spans.count * (band+1) / job->numbands;
+      for (i=start; i<end; i++) {
+         struct _lens_span *span = &lens_spans.span[i];
+         job->draw(VBUFFER(scr_vrect.x + span->x, scr_vrect.y + span->y),
+               LENSPIXEL(span->x, span->y), span->len);
+      }
+      return;
+   }
+
+   // otherwise the lensmap may have holes anywhere, so find the runs of
+   // covered pixels as we go
+   int x, y;
+   int start = lens.height_px * band / job->numbands;
+   int end = lens.height_px * (band+1) / job->numbands;
+   for(y=start; y<end; y++) {
+      byte *dst = VBUFFER(scr_vrect.x, y+scr_vrect.y);
+      unsigned int *lmap = LENSPIXEL(0,y);
+      x = 0;
+      while (x < lens.width_px) {
+         while (x < lens.width_px && lmap[x] == LENSMAP_NONE) x++;
+         int run = x;
+         while (x < lens.width_px && lmap[x] != LENSMAP_NONE) x++;
+         if (x > run) {
+            job->draw(dst+run, lmap+run, x-run);
          }
+      }
+   }
+}
+
+// draw the lensmap to the vidbuffer
+static void render_lensmap(void)
+{
+   struct _lens_draw job;
+   job.draw = rubix.enabled ? render_span_tinted : render_span;
+   if (globe.refresh.reproject) {
+      job.draw = render_span_reprojected;
+   }
+   job.numbands = (Thread_PoolSize() + 1) * LENS_BANDS_PER_THREAD;
+   Thread_RunJobs(render_lensmap_band, &job, job.numbands);
+}
+
+// number of frames between renders of a plate
+static int plate_refresh_frames(int plate_index)
+{
+   int frames = globe.plates[plate_index].refresh;
+   if (!frames) {
+      frames = (plate_index == globe.refresh.front) ? 1 : globe.refresh.frames;
+   }
+   return frames;
+}
+
+// decide if a plate has to be rendered this frame, or if its last render can be reused
+static qboolean plate_needs_render(int plate_index, vec3_t forward, vec3_t up)
+{
+   int frames = plate_refresh_frames(plate_index);
+
+   if (frames <= 1 || !globe.plates[plate_index].rendered || globe.save.should) {
+      return true;
+   }
+
+   // (staggered, so the plates sharing a rate are not all rendered on the same frame)
+   if ((globe.refresh.frame + plate_index) % frames == 0) {
+      return true;
+   }
+
+   if (globe.refresh.maxangle > 0) {
+      float mindot = cos(globe.refresh.maxangle * M_PI / 180);
+      if (DotProduct(forward, globe.plates[plate_index].rendered_forward) < mindot ||
+          DotProduct(up, globe.plates[plate_index].rendered_up) < mindot) {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+// Size the surface cache for all the plates that are drawn, as if each was a
+// separate screen of its size (surfaces seen by one plate are rarely seen by another)
+static int plates_surface_cache_size(void)
+{
+   int size = 0;
+   int i;
+   for (i=0; i<globe.numplates; ++i) {
+      if (!globe.plates[i].display) {
+         continue;
+      }
+      int width = globe.plates[i].size;
+      int height = globe.plates[i].size;
+      if (globe.bounds_valid) {
+         width = globe.plates[i].bounds.width;
+         height = globe.plates[i].bounds.height;
+      }
+      if (width && height) {
+         size += D_SurfaceCacheForRes(width, height);
+      }
+   }
+   return size;
 }
 
 // render a specific plate
 static void render_plate(int plate_index, vec3_t forward, vec3_t right, vec3_t up) 
 {
-   byte *pixels = GLOBEPIXEL(plate_index, 0, 0);
+   // render straight into the plate's pixels
+   rendertarget_t target;
+   target.buffer = GLOBEPIXEL(plate_index, 0, 0);
+   target.rowbytes = globe.plates[plate_index].size;
+   target.zbuffer = globe.zbuffer + plate_index*globe.platesize*globe.platesize;
+   target.width = target.height = globe.plates[plate_index].size;
+
+   // only render the part of the plate that the lens uses
+   // (unless we are saving the whole plate)
+   // (plates that are reused for a few frames get a margin to be reprojected into)
+   vrect_t *rect = &globe.plates[plate_index].rendered_rect;
+   if (globe.bounds_valid && !globe.save.should) {
+      *rect = globe.plates[plate_index].bounds;
+      if (plate_refresh_frames(plate_index) > 1 && globe.refresh.reproject_enabled) {
+         int size = target.width;
+         float degrees = globe.refresh.maxangle > 0 ? globe.refresh.maxangle : PLATE_REPROJECT_MARGIN;
+         int margin = ceil(size * (degrees * M_PI / 180) / globe.plates[plate_index].fov);
+         int x1 = qmin(rect->x + rect->width + margin, size);
+         int y1 = qmin(rect->y + rect->height + margin, size);
+         rect->x = qmax(rect->x - margin, 0);
+         rect->y = qmax(rect->y - margin, 0);
+         rect->width = x1 - rect->x;
+         rect->height = y1 - rect->y;
+      }
+      target.scissor = *rect;
+   }
+   else {
+      target.scissor.x = target.scissor.y = target.scissor.width = target.scissor.height = 0;
+      rect->x = rect->y = 0;
+      rect->width = rect->height = target.width;
+   }
+   R_SetRenderTarget(&target);
 
    // set camera orientation
    VectorCopy(forward, r_refdef.forward);
@@ -2434,18 +6198,103 @@ static void render_plate(int plate_index, vec3_t forward, vec3_t right, vec3_t u
    VectorCopy(up, r_refdef.up);
 
    // render view
-   R_PushDlights();
    R_RenderView();
 
-   // copy from vid buffer to cubeface, row by row
-   byte *vbuffer = VBUFFER(scr_vrect.x,scr_vrect.y);
-   int y;
-   for(y = 0;y<globe.platesize;y++) {
-      memcpy(pixels, vbuffer, globe.platesize);
+   R_SetRenderTarget(NULL);
+
+   globe.plates[plate_index].rendered = true;
+   VectorCopy(forward, globe.plates[plate_index].rendered_forward);
+   VectorCopy(right, globe.plates[plate_index].rendered_right);
+   VectorCopy(up, globe.plates[plate_index].rendered_up);
+}
+
+// render the plate queued in globe.renders[index] (run by R_RenderViews)
+static void render_plate_job(void *arg, int index)
+{
+   int i = globe.renders[index].plate;
+   double plate_start = Sys_DoubleTime();
+
+   // set plate FOV
+   // (the view is recalculated when render_plate sets the render target)
+   fisheye_plate_fov = globe.plates[i].fov;
+
+   render_plate(i, globe.renders[index].forward, globe.renders[index].right, globe.renders[index].up);
+   bench_record(BENCH_PLATE0 + i, plate_start);
+}
+
+// Find the rotation from a plate's current frame to the frame it was last
+// rendered in, and mark it for reprojection if the view has turned since.
+static void set_plate_warp(int plate_index, vec3_t forward, vec3_t right, vec3_t up)
+{
+   float (*warp)[3] = globe.plates[plate_index].warp;
+   vec_t *from[3] = { right, up, forward };
+   vec_t *to[3] = {
+      globe.plates[plate_index].rendered_right,
+      globe.plates[plate_index].rendered_up,
+      globe.plates[plate_index].rendered_forward
+   };
+
+   if (VectorCompare(forward, to[2]) && VectorCompare(up, to[1])) {
+      return;
+   }
+
+   int i, j;
+   for (i=0; i<3; i++) {
+      for (j=0; j<3; j++) {
+         warp[i][j] = DotProduct(to[i], from[j]);
+      }
+   }
+
+   globe.plates[plate_index].reproject = true;
+   globe.refresh.reproject = true;
+}
 
-      // advance to the next row
-      vbuffer += vid.rowbytes;
-      pixels += globe.platesize;
+// Move a texel offset (within a plate) to where its ray landed in the plate's
+// last render.  Rays that land outside the rendered part are clamped to its edge.
+static unsigned int reproject_texel(int plate_index, unsigned int offset)
+{
+   const float (*warp)[3] = (const float (*)[3])globe.plates[plate_index].warp;
+   const vrect_t *rect = &globe.plates[plate_index].rendered_rect;
+   int size = globe.plates[plate_index].size;
+   float scale = 1.0f / size;
+
+   // ray in the plate's current frame (see plate_uv_to_ray)
+   float x = ((int)(offset % size) + 0.5f) * scale - 0.5f;
+   float y = 0.5f - ((int)(offset / size) + 0.5f) * scale;
+   float z = globe.plates[plate_index].dist;
+
+   // rotate into the old frame and project back onto the plate
+   float rx = warp[0][0]*x + warp[0][1]*y + warp[0][2]*z;
+   float ry = warp[1][0]*x + warp[1][1]*y + warp[1][2]*z;
+   float rz = warp[2][0]*x + warp[2][1]*y + warp[2][2]*z;
+   if (rz <= 0) {
+      return offset;
+   }
+   float k = z / rz;
+   int px = (int)floorf((rx*k + 0.5f) * size);
+   int py = (int)floorf((0.5f - ry*k) * size);
+
+   px = qclamp(px, rect->x, rect->x + rect->width - 1);
+   py = qclamp(py, rect->y, rect->y + rect->height - 1);
+   return px + py*size;
+}
+
+// copy a run of covered lens pixels, reprojecting the texels of stale plates
+// (and applying the rubix tints if enabled)
+static void render_span_reprojected(byte *dst, const unsigned int *src, int len)
+{
+   unsigned int platearea = globe.platesize * globe.platesize;
+   int i;
+   for (i=0; i<len; i++) {
+      unsigned int v = src[i];
+      unsigned int offset = LENSMAP_OFFSET(v);
+      int plate = offset / platearea;
+      if (globe.plates[plate].reproject) {
+         offset = plate*platearea + reproject_texel(plate, offset - plate*platearea);
+      }
+      byte color = globe.pixels[offset];
+      int tint = LENSMAP_TINT(v);
+      dst[i] = (rubix.enabled && tint != LENSMAP_NOTINT) ? globe.plates[tint].palette[color] : color;
    }
 }
 
@@ -19,21 +19,24 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "d_local.h"
 #include "quakedef.h"
 #include "r_local.h"
+#include "sys.h"
 
 #ifdef NQ_HACK
 #include "client.h"
 #endif
 
-static int miplevel;
-static vec3_t transformed_modelorg;
+static VIEWSTATE int miplevel;
+static VIEWSTATE vec3_t transformed_modelorg;
 
-float scale_for_mip;
-int screenwidth;
-int ubasestep, errorterm, erroradjustup, erroradjustdown;
+VIEWSTATE float scale_for_mip;
+VIEWSTATE int screenwidth;
+VIEWSTATE int ubasestep, errorterm, erroradjustup, erroradjustdown;
 
 /*
 =============
@@ -70,14 +73,13 @@ D_DrawSolidSurface
 // FIXME: clean this up
 
 static void
-D_DrawSolidSurface(surf_t *surf, int color)
+D_DrawSolidSurface(espan_t *span, int color)
 {
-    espan_t *span;
     byte *pdest;
     int u, u2, pix;
 
     pix = (color << 24) | (color << 16) | (color << 8) | color;
-    for (span = surf->spans; span; span = span->pnext) {
+    for (; span; span = span->pnext) {
 	pdest = (byte *)d_viewbuffer + screenwidth * span->v;
 	u = span->u;
 	u2 = span->u + span->count - 1;
@@ -150,147 +152,381 @@ D_CalcGradients(msurface_t *pface)
 }
 
 
+/*
+ * Everything the span drawers need to draw one surface, so the spans can be
+ * drawn after all the surfaces have been set up.
+ */
+typedef enum { DRAW_SOLID, DRAW_SKY, DRAW_TURB, DRAW_TEXTURED } drawkind_t;
+
+typedef struct {
+    drawkind_t kind;
+    int color;
+    pixel_t *cacheblock;
+    int cachewidth;
+    float sdivzstepu, tdivzstepu, zistepu;
+    float sdivzstepv, tdivzstepv, zistepv;
+    float sdivzorigin, tdivzorigin, ziorigin;
+    fixed16_t sadjust, tadjust, bbextents, bbextentt;
+} surfdraw_t;
+
+static VIEWSTATE vec3_t world_transformed_modelorg;
+
+static void
+D_SaveSpanState(surfdraw_t *draw)
+{
+    draw->cacheblock = cacheblock;
+    draw->cachewidth = cachewidth;
+    draw->sdivzstepu = d_sdivzstepu;
+    draw->tdivzstepu = d_tdivzstepu;
+    draw->zistepu = d_zistepu;
+    draw->sdivzstepv = d_sdivzstepv;
+    draw->tdivzstepv = d_tdivzstepv;
+    draw->zistepv = d_zistepv;
+    draw->sdivzorigin = d_sdivzorigin;
+    draw->tdivzorigin = d_tdivzorigin;
+    draw->ziorigin = d_ziorigin;
+    draw->sadjust = sadjust;
+    draw->tadjust = tadjust;
+    draw->bbextents = bbextents;
+    draw->bbextentt = bbextentt;
+}
+
+static void
+D_LoadSpanState(const surfdraw_t *draw)
+{
+    cacheblock = draw->cacheblock;
+    cachewidth = draw->cachewidth;
+    d_sdivzstepu = draw->sdivzstepu;
+    d_tdivzstepu = draw->tdivzstepu;
+    d_zistepu = draw->zistepu;
+    d_sdivzstepv = draw->sdivzstepv;
+    d_tdivzstepv = draw->tdivzstepv;
+    d_zistepv = draw->zistepv;
+    d_sdivzorigin = draw->sdivzorigin;
+    d_tdivzorigin = draw->tdivzorigin;
+    d_ziorigin = draw->ziorigin;
+    sadjust = draw->sadjust;
+    tadjust = draw->tadjust;
+    bbextents = draw->bbextents;
+    bbextentt = draw->bbextentt;
+}
+
 /*
 ==============
-D_DrawSurfaces
+D_SetupSurface
+
+Set up the span drawing state for a surface, caching its texture if needed
 ==============
 */
-void
-D_DrawSurfaces(void)
+static void
+D_SetupSurface(const surf_t *s, surfdraw_t *draw)
 {
     const entity_t *e;
-    surf_t *s;
     msurface_t *pface;
     surfcache_t *pcurrentcache;
-    vec3_t world_transformed_modelorg;
     vec3_t local_modelorg;
 
-    e = &r_worldentity;
-    TransformVector(modelorg, transformed_modelorg);
-    VectorCopy(transformed_modelorg, world_transformed_modelorg);
+    d_zistepu = s->d_zistepu;
+    d_zistepv = s->d_zistepv;
+    d_ziorigin = s->d_ziorigin;
 
-// TODO: could preset a lot of this at mode set time
     if (r_drawflat.value) {
-	for (s = &surfaces[1]; s < surface_p; s++) {
-	    if (!s->spans)
-		continue;
+	draw->kind = DRAW_SOLID;
+	draw->color = (intptr_t)s->data & 0xFF;
+	return;
+    }
 
-	    d_zistepu = s->d_zistepu;
-	    d_zistepv = s->d_zistepv;
-	    d_ziorigin = s->d_ziorigin;
+    r_drawnpolycount++;
 
-	    D_DrawSolidSurface(s, (intptr_t)s->data & 0xFF);
-	    D_DrawZSpans(s->spans);
+    if (s->flags & SURF_DRAWSKY) {
+	if (!r_skymade) {
+	    R_MakeSky();
 	}
+	draw->kind = DRAW_SKY;
+	return;
+    }
+
+    if (s->flags & SURF_DRAWBACKGROUND) {
+	// set up a gradient for the background surface that places it
+	// effectively at infinity distance from the viewpoint
+	d_zistepu = 0;
+	d_zistepv = 0;
+	d_ziorigin = -0.9;
+
+	draw->kind = DRAW_SOLID;
+	draw->color = (int)r_clearcolor.value & 0xFF;
+	return;
+    }
+
+    e = &r_worldentity;
+    if (s->insubmodel) {
+	// FIXME: we don't want to do all this for every polygon!
+	// TODO: store once at start of frame
+	e = s->entity;	//FIXME: make this passed in to
+	// R_RotateBmodel ()
+	VectorSubtract(r_origin, e->origin, local_modelorg);
+	TransformVector(local_modelorg, transformed_modelorg);
+
+	R_RotateBmodel(e);	// FIXME: don't mess with the frustum,
+	// make entity passed in
+    }
+
+    pface = s->data;
+    if (s->flags & SURF_DRAWTURB) {
+	miplevel = 0;
+	cacheblock = (pixel_t *)
+	    ((byte *)pface->texinfo->texture +
+	     pface->texinfo->texture->offsets[0]);
+	cachewidth = 64;
+	draw->kind = DRAW_TURB;
     } else {
+	miplevel = D_MipLevelForScale(s->nearzi * scale_for_mip
+				      * pface->texinfo->mipadjust);
+
+	// FIXME: make this passed in to D_CacheSurface
+	pcurrentcache = D_CacheSurface(e, pface, miplevel);
+
+	cacheblock = (pixel_t *)pcurrentcache->data;
+	cachewidth = pcurrentcache->width;
+	draw->kind = DRAW_TEXTURED;
+    }
+
+    D_CalcGradients(pface);
+
+    if (s->insubmodel) {
+	//
+	// restore the old drawing state
+	// FIXME: we don't want to do this every time!
+	// TODO: speed up
+	//
+	VectorCopy(world_transformed_modelorg, transformed_modelorg);
+	VectorCopy(base_vpn, vpn);
+	VectorCopy(base_vup, vup);
+	VectorCopy(base_vright, vright);
+	VectorCopy(base_modelorg, modelorg);
+	R_TransformFrustum();
+    }
+}
+
+/*
+==============
+D_DrawSurfaceSpans
+==============
+*/
+static void
+D_DrawSurfaceSpans(const surfdraw_t *draw, espan_t *spans)
+{
+    switch (draw->kind) {
+    case DRAW_SOLID:
+	D_DrawSolidSurface(spans, draw->color);
+	break;
+    case DRAW_SKY:
+	D_DrawSkyScans8(spans);
+	break;
+    case DRAW_TURB:
+	Turbulent8(spans);
+	break;
+    case DRAW_TEXTURED:
+	D_DrawSpans(spans);
+	break;
+    }
+    D_DrawZSpans(spans);
+}
+
+/*
+ * The view state that the span drawers read, which is per thread in C
+ * builds.  The pool threads drawing a band take it from the view being drawn.
+ */
+typedef struct {
+    pixel_t *viewbuffer;
+    int screenwidth;
+    short *zbuffer;
+    unsigned int zwidth;
+    void (*drawspans)(espan_t *pspan);
+    rendertarget_t *target;	// for the sky
+    vrect_t vrect;
+    vec3_t vpn, vright, vup;
+} drawview_t;
+
+static void
+D_SaveDrawView(drawview_t *view)
+{
+    view->viewbuffer = d_viewbuffer;
+    view->screenwidth = screenwidth;
+    view->zbuffer = d_pzbuffer;
+    view->zwidth = d_zwidth;
+    view->drawspans = D_DrawSpans;
+    view->target = r_target;
+    view->vrect = r_refdef.vrect;
+    VectorCopy(vpn, view->vpn);
+    VectorCopy(vright, view->vright);
+    VectorCopy(vup, view->vup);
+}
+
+static void
+D_LoadDrawView(const drawview_t *view)
+{
+    d_viewbuffer = view->viewbuffer;
+    screenwidth = view->screenwidth;
+    d_pzbuffer = view->zbuffer;
+    d_zwidth = view->zwidth;
+    D_DrawSpans = view->drawspans;
+    r_target = view->target;
+    r_refdef.vrect = view->vrect;
+    VectorCopy(view->vpn, vpn);
+    VectorCopy(view->vright, vright);
+    VectorCopy(view->vup, vup);
+}
+
+/*
+ * The span fill can be split into bands of rows drawn by the job pool.  The
+ * surfaces are set up (and their textures cached) on the main thread first,
+ * then each band draws its part of every surface's spans.  A pixel is only
+ * covered by one span, so the bands never touch the same pixels and the
+ * result is the same as drawing the surfaces one after another.  This is
+ * done for every view once the pool has threads, not just the fisheye plates.
+ */
+static struct {
+    const surf_t **surfs;
+    surfdraw_t *draws;
+    int numdraws, maxdraws;
+    espan_t **spans;	// numbands lists per surface
+    int numbands, maxbands;
+    int top, height;
+    drawview_t view;
+} bands;
+
+static void
+D_DrawSurfacesBand(void *arg, int band)
+{
+    drawview_t oldview;
+    espan_t *spans;
+    int i;
+
+    D_SaveDrawView(&oldview);
+    D_LoadDrawView(&bands.view);
+
+    for (i = 0; i < bands.numdraws; i++) {
+	spans = bands.spans[i * bands.numbands + band];
+	if (!spans)
+	    continue;
+	D_LoadSpanState(&bands.draws[i]);
+	D_DrawSurfaceSpans(&bands.draws[i], spans);
+    }
+
+    D_LoadDrawView(&oldview);
+}
+
+/*
+==============
+D_SplitSpans
+
+Cut a surface's span list into one list per band.  The spans are added to
+the front of the list as the rows are scanned, so the rows only go up.
+==============
+*/
+static void
+D_SplitSpans(espan_t *span, espan_t **heads)
+{
+    espan_t *prev;
+    int band;
+
+    memset(heads, 0, bands.numbands * sizeof(*heads));
+    for (prev = NULL; span; prev = span, span = span->pnext) {
+	band = ((span->v - bands.top + 1) * bands.numbands - 1) / bands.height;
+	if (!heads[band]) {
+	    if (prev)
+		prev->pnext = NULL;
+	    heads[band] = span;
+	}
+    }
+}
+
+static void
+D_DrawSurfacesBanded(int top, int bottom)
+{
+    surf_t *s;
+    int i, count, drawnpolycount;
+
+    count = surface_p - surfaces;
+    if (count > bands.maxdraws) {
+	bands.maxdraws = count;
+	bands.surfs = realloc(bands.surfs, count * sizeof(*bands.surfs));
+	bands.draws = realloc(bands.draws, count * sizeof(*bands.draws));
+	bands.maxbands = 0;
+    }
+    bands.top = top;
+    bands.height = bottom - top;
+    bands.numbands = qmin(d_spanbands, bands.height);
+    if (bands.numbands > bands.maxbands) {
+	bands.maxbands = bands.numbands;
+	bands.spans = realloc(bands.spans, bands.maxdraws * bands.maxbands
+			      * sizeof(*bands.spans));
+    }
+    if (!bands.surfs || !bands.draws || !bands.spans)
+	Sys_Error("%s: out of memory", __func__);
+
+    D_BeginSurfaceBatch();
+    drawnpolycount = r_drawnpolycount;
+    bands.numdraws = 0;
+    for (s = &surfaces[1]; s < surface_p; s++) {
+	if (!s->spans)
+	    continue;
+	D_SetupSurface(s, &bands.draws[bands.numdraws]);
+	D_SaveSpanState(&bands.draws[bands.numdraws]);
+	bands.surfs[bands.numdraws++] = s;
+    }
+
+    /*
+     * If the surface cache is too small for all the surfaces at once, draw
+     * them one at a time like the serial renderer does.  Their cache blocks
+     * may have been reused, so they are set up again, without counting them
+     * in r_drawnpolycount twice.
+     */
+    if (!D_EndSurfaceBatch()) {
+	r_drawnpolycount = drawnpolycount;
 	for (s = &surfaces[1]; s < surface_p; s++) {
 	    if (!s->spans)
 		continue;
-
-	    r_drawnpolycount++;
-
-	    d_zistepu = s->d_zistepu;
-	    d_zistepv = s->d_zistepv;
-	    d_ziorigin = s->d_ziorigin;
-
-	    if (s->flags & SURF_DRAWSKY) {
-		if (!r_skymade) {
-		    R_MakeSky();
-		}
-
-		D_DrawSkyScans8(s->spans);
-		D_DrawZSpans(s->spans);
-	    } else if (s->flags & SURF_DRAWBACKGROUND) {
-		// set up a gradient for the background surface that places it
-		// effectively at infinity distance from the viewpoint
-		d_zistepu = 0;
-		d_zistepv = 0;
-		d_ziorigin = -0.9;
-
-		D_DrawSolidSurface(s, (int)r_clearcolor.value & 0xFF);
-		D_DrawZSpans(s->spans);
-	    } else if (s->flags & SURF_DRAWTURB) {
-		pface = s->data;
-		miplevel = 0;
-		cacheblock = (pixel_t *)
-		    ((byte *)pface->texinfo->texture +
-		     pface->texinfo->texture->offsets[0]);
-		cachewidth = 64;
-
-		if (s->insubmodel) {
-		    // FIXME: we don't want to do all this for every polygon!
-		    // TODO: store once at start of frame
-		    e = s->entity;	//FIXME: make this passed in to
-		    // R_RotateBmodel ()
-		    VectorSubtract(r_origin, e->origin, local_modelorg);
-		    TransformVector(local_modelorg, transformed_modelorg);
-
-		    R_RotateBmodel(e);	// FIXME: don't mess with the frustum,
-		    // make entity passed in
-		}
-
-		D_CalcGradients(pface);
-		Turbulent8(s->spans);
-		D_DrawZSpans(s->spans);
-
-		if (s->insubmodel) {
-		    //
-		    // restore the old drawing state
-		    // FIXME: we don't want to do this every time!
-		    // TODO: speed up
-		    //
-		    e = &r_worldentity;
-		    VectorCopy(world_transformed_modelorg,
-			       transformed_modelorg);
-		    VectorCopy(base_vpn, vpn);
-		    VectorCopy(base_vup, vup);
-		    VectorCopy(base_vright, vright);
-		    VectorCopy(base_modelorg, modelorg);
-		    R_TransformFrustum();
-		}
-	    } else {
-		if (s->insubmodel) {
-		    // FIXME: we don't want to do all this for every polygon!
-		    // TODO: store once at start of frame
-		    e = s->entity;	//FIXME: make this passed in to
-		    // R_RotateBmodel ()
-		    VectorSubtract(r_origin, e->origin, local_modelorg);
-		    TransformVector(local_modelorg, transformed_modelorg);
-
-		    R_RotateBmodel(e);	// FIXME: don't mess with the frustum,
-		    // make entity passed in
-		}
-
-		pface = s->data;
-		miplevel = D_MipLevelForScale(s->nearzi * scale_for_mip
-					      * pface->texinfo->mipadjust);
-
-		// FIXME: make this passed in to D_CacheSurface
-		pcurrentcache = D_CacheSurface(e, pface, miplevel);
-
-		cacheblock = (pixel_t *)pcurrentcache->data;
-		cachewidth = pcurrentcache->width;
-
-		D_CalcGradients(pface);
-		D_DrawSpans(s->spans);
-		D_DrawZSpans(s->spans);
-
-		if (s->insubmodel) {
-		    //
-		    // restore the old drawing state
-		    // FIXME: we don't want to do this every time!
-		    // TODO: speed up
-		    //
-		    e = &r_worldentity;
-		    VectorCopy(world_transformed_modelorg,
-			       transformed_modelorg);
-		    VectorCopy(base_vpn, vpn);
-		    VectorCopy(base_vup, vup);
-		    VectorCopy(base_vright, vright);
-		    VectorCopy(base_modelorg, modelorg);
-		    R_TransformFrustum();
-		}
-	    }
+	    D_SetupSurface(s, &bands.draws[0]);
+	    D_DrawSurfaceSpans(&bands.draws[0], s->spans);
 	}
+	return;
+    }
+
+    for (i = 0; i < bands.numdraws; i++)
+	D_SplitSpans(bands.surfs[i]->spans, &bands.spans[i * bands.numbands]);
+    D_SaveDrawView(&bands.view);
+
+    Thread_RunJobs(D_DrawSurfacesBand, NULL, bands.numbands);
+}
+
+
+/*
+==============
+D_DrawSurfaces
+
+Draw the spans of the surfaces in rows [top, bottom)
+==============
+*/
+void
+D_DrawSurfaces(int top, int bottom)
+{
+    surf_t *s;
+    surfdraw_t draw;
+
+    TransformVector(modelorg, transformed_modelorg);
+    VectorCopy(transformed_modelorg, world_transformed_modelorg);
+
+    if (d_spanbands > 1 && bottom - top > 1) {
+	D_DrawSurfacesBanded(top, bottom);
+	return;
+    }
+
+    for (s = &surfaces[1]; s < surface_p; s++) {
+	if (!s->spans)
+	    continue;
+	D_SetupSurface(s, &draw);
+	D_DrawSurfaceSpans(&draw, s->spans);
     }
 }
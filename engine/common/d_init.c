@@ -21,21 +21,27 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "quakedef.h"
 #include "d_local.h"
+#include "thread.h"
 
 #define NUM_MIPS	4
 
+/* bands per thread, so a band with a lot of detail doesn't hold up the rest */
+#define SPAN_BANDS_PER_THREAD	4
+
 static cvar_t d_subdiv16 = { "d_subdiv16", "1" };
 static cvar_t d_mipcap = { "d_mipcap", "0" };
 static cvar_t d_mipscale = { "d_mipscale", "1" };
+static cvar_t d_spanthreads = { "d_spanthreads", "1" };
 
 surfcache_t *d_initial_rover;
 qboolean d_roverwrapped;
-int d_minmip;
-float d_scalemip[NUM_MIPS - 1];
+VIEWSTATE int d_minmip;
+VIEWSTATE float d_scalemip[NUM_MIPS - 1];
+VIEWSTATE int d_spanbands;
 
 static float basemip[NUM_MIPS - 1] = { 1.0, 0.5 * 0.8, 0.25 * 0.8 };
 
-void (*D_DrawSpans)(espan_t *pspan);
+VIEWSTATE void (*D_DrawSpans)(espan_t *pspan);
 
 /*
 ===============
@@ -51,6 +57,7 @@ D_Init(void)
     Cvar_RegisterVariable(&d_subdiv16);
     Cvar_RegisterVariable(&d_mipcap);
     Cvar_RegisterVariable(&d_mipscale);
+    Cvar_RegisterVariable(&d_spanthreads);
 
     r_recursiveaffinetriangles = true;
     r_pixbytes = 1;
@@ -119,18 +126,25 @@ D_SetupFrame(void)
 {
     int i;
 
-    if (r_dowarp)
+    if (r_target)
+	d_viewbuffer = r_target->buffer;
+    else if (r_dowarp)
 	d_viewbuffer = r_warpbuffer;
     else
 	d_viewbuffer = (void *)(byte *)vid.buffer;
 
-    if (r_dowarp)
+    if (r_target)
+	screenwidth = r_target->rowbytes;
+    else if (r_dowarp)
 	screenwidth = WARP_WIDTH;
     else
 	screenwidth = vid.rowbytes;
 
-    d_roverwrapped = false;
-    d_initial_rover = sc_rover;
+    /* views drawn at the same time share the cache (see R_RenderViews) */
+    if (!r_concurrentview) {
+	d_roverwrapped = false;
+	d_initial_rover = sc_rover;
+    }
 
     d_minmip = d_mipcap.value;
     if (d_minmip > 3)
@@ -149,6 +163,19 @@ D_SetupFrame(void)
 #else
     D_DrawSpans = D_DrawSpans8;
 #endif
+
+    /*
+     * the assembly span drawers keep their state in plain globals, and the
+     * views drawn at the same time already have the job pool to themselves
+     */
+#ifdef USE_X86_ASM
+    d_spanbands = 0;
+#else
+    if (d_spanthreads.value && Thread_PoolSize() && !r_concurrentview)
+	d_spanbands = (Thread_PoolSize() + 1) * SPAN_BANDS_PER_THREAD;
+    else
+	d_spanbands = 0;
+#endif
 }
 
 
@@ -24,12 +24,12 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "render.h"
 #include "sys.h"
 
-int d_vrectx, d_vrecty, d_vrectright_particle, d_vrectbottom_particle;
+VIEWSTATE int d_vrectx, d_vrecty, d_vrectright_particle, d_vrectbottom_particle;
 
-int d_y_aspect_shift, d_pix_min, d_pix_max, d_pix_shift;
+VIEWSTATE int d_y_aspect_shift, d_pix_min, d_pix_max, d_pix_shift;
 
-int d_scantable[MAXHEIGHT];
-short *zspantable[MAXHEIGHT];
+VIEWSTATE int d_scantable[MAXHEIGHT];
+VIEWSTATE short *zspantable[MAXHEIGHT];
 
 /*
 ================
@@ -57,9 +57,11 @@ D_ViewChanged
 void
 D_ViewChanged(void)
 {
-    int rowbytes;
+    int rowbytes, height, viewwidth;
 
-    if (r_dowarp)
+    if (r_target)
+	rowbytes = r_target->rowbytes;
+    else if (r_dowarp)
 	rowbytes = WARP_WIDTH;
     else
 	rowbytes = vid.rowbytes;
@@ -68,15 +70,19 @@ D_ViewChanged(void)
     if (yscale > xscale)
 	scale_for_mip = yscale;
 
-    d_zrowbytes = vid.width * 2;
-    d_zwidth = vid.width;
+    d_zwidth = r_target ? r_target->width : vid.width;
+    d_zrowbytes = d_zwidth * 2;
+    height = r_target ? r_target->height : vid.height;
 
-    d_pix_min = r_refdef.vrect.width / 320;
+    /* particle size follows the whole view, not just the scissor rect */
+    viewwidth = r_target ? r_target->width : r_refdef.vrect.width;
+
+    d_pix_min = viewwidth / 320;
     if (d_pix_min < 1)
 	d_pix_min = 1;
 
-    d_pix_max = (int)((float)r_refdef.vrect.width / (320.0 / 4.0) + 0.5);
-    d_pix_shift = 8 - (int)((float)r_refdef.vrect.width / 320.0 + 0.5);
+    d_pix_max = (int)((float)viewwidth / (320.0 / 4.0) + 0.5);
+    d_pix_shift = 8 - (int)((float)viewwidth / 320.0 + 0.5);
     if (d_pix_max < 1)
 	d_pix_max = 1;
 
@@ -94,7 +100,7 @@ D_ViewChanged(void)
     {
 	int i;
 
-	for (i = 0; i < vid.height; i++) {
+	for (i = 0; i < height; i++) {
 	    d_scantable[i] = i * rowbytes;
 	    zspantable[i] = d_pzbuffer + i * d_zwidth;
 	}
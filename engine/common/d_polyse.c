@@ -38,57 +38,58 @@ typedef struct {
     int sfrac, tfrac, light, zi;
 } spanpackage_t;
 
+/* the edge verts are numbered 0-2 for r_p0-r_p2, which are per thread */
 typedef struct {
     int isflattop;
     int numleftedges;
-    int *pleftedgevert0;
-    int *pleftedgevert1;
-    int *pleftedgevert2;
+    int leftedgevert0;
+    int leftedgevert1;
+    int leftedgevert2;
     int numrightedges;
-    int *prightedgevert0;
-    int *prightedgevert1;
-    int *prightedgevert2;
+    int rightedgevert0;
+    int rightedgevert1;
+    int rightedgevert2;
 } edgetable;
 
-int r_p0[6], r_p1[6], r_p2[6];
+VIEWSTATE int r_p0[6], r_p1[6], r_p2[6];
 
-byte *d_pcolormap;
+VIEWSTATE byte *d_pcolormap;
 
-int d_xdenom;
+VIEWSTATE int d_xdenom;
 
-static edgetable *pedgetable;
+static VIEWSTATE edgetable *pedgetable;
 static edgetable edgetables[12] = {
-    {0, 1, r_p0, r_p2, NULL, 2, r_p0, r_p1, r_p2},
-    {0, 2, r_p1, r_p0, r_p2, 1, r_p1, r_p2, NULL},
-    {1, 1, r_p0, r_p2, NULL, 1, r_p1, r_p2, NULL},
-    {0, 1, r_p1, r_p0, NULL, 2, r_p1, r_p2, r_p0},
-    {0, 2, r_p0, r_p2, r_p1, 1, r_p0, r_p1, NULL},
-    {0, 1, r_p2, r_p1, NULL, 1, r_p2, r_p0, NULL},
-    {0, 1, r_p2, r_p1, NULL, 2, r_p2, r_p0, r_p1},
-    {0, 2, r_p2, r_p1, r_p0, 1, r_p2, r_p0, NULL},
-    {0, 1, r_p1, r_p0, NULL, 1, r_p1, r_p2, NULL},
-    {1, 1, r_p2, r_p1, NULL, 1, r_p0, r_p1, NULL},
-    {1, 1, r_p1, r_p0, NULL, 1, r_p2, r_p0, NULL},
-    {0, 1, r_p0, r_p2, NULL, 1, r_p0, r_p1, NULL},
+    {0, 1, 0, 2, 0, 2, 0, 1, 2},
+    {0, 2, 1, 0, 2, 1, 1, 2, 0},
+    {1, 1, 0, 2, 0, 1, 1, 2, 0},
+    {0, 1, 1, 0, 0, 2, 1, 2, 0},
+    {0, 2, 0, 2, 1, 1, 0, 1, 0},
+    {0, 1, 2, 1, 0, 1, 2, 0, 0},
+    {0, 1, 2, 1, 0, 2, 2, 0, 1},
+    {0, 2, 2, 1, 0, 1, 2, 0, 0},
+    {0, 1, 1, 0, 0, 1, 1, 2, 0},
+    {1, 1, 2, 1, 0, 1, 0, 1, 0},
+    {1, 1, 1, 0, 0, 1, 2, 0, 0},
+    {0, 1, 0, 2, 0, 1, 0, 1, 0},
 };
 
-int a_sstepxfrac, a_tstepxfrac, r_lstepx, a_ststepxwhole;
-int r_sstepx, r_tstepx, r_lstepy, r_sstepy, r_tstepy;
-int r_zistepx, r_zistepy;
-int d_aspancount, d_countextrastep;
-
-spanpackage_t *a_spans;
-spanpackage_t *d_pedgespanpackage;
-static int ystart;
-byte *d_pdest, *d_ptex;
-short *d_pz;
-int d_sfrac, d_tfrac, d_light, d_zi;
-int d_ptexextrastep, d_sfracextrastep;
-int d_tfracextrastep, d_lightextrastep, d_pdestextrastep;
-int d_lightbasestep, d_pdestbasestep, d_ptexbasestep;
-int d_sfracbasestep, d_tfracbasestep;
-int d_ziextrastep, d_zibasestep;
-int d_pzextrastep, d_pzbasestep;
+VIEWSTATE int a_sstepxfrac, a_tstepxfrac, r_lstepx, a_ststepxwhole;
+VIEWSTATE int r_sstepx, r_tstepx, r_lstepy, r_sstepy, r_tstepy;
+VIEWSTATE int r_zistepx, r_zistepy;
+VIEWSTATE int d_aspancount, d_countextrastep;
+
+VIEWSTATE spanpackage_t *a_spans;
+VIEWSTATE spanpackage_t *d_pedgespanpackage;
+static VIEWSTATE int ystart;
+VIEWSTATE byte *d_pdest, *d_ptex;
+VIEWSTATE short *d_pz;
+VIEWSTATE int d_sfrac, d_tfrac, d_light, d_zi;
+VIEWSTATE int d_ptexextrastep, d_sfracextrastep;
+VIEWSTATE int d_tfracextrastep, d_lightextrastep, d_pdestextrastep;
+VIEWSTATE int d_lightbasestep, d_pdestbasestep, d_ptexbasestep;
+VIEWSTATE int d_sfracbasestep, d_tfracbasestep;
+VIEWSTATE int d_ziextrastep, d_zibasestep;
+VIEWSTATE int d_pzextrastep, d_pzbasestep;
 
 typedef struct {
     int quotient;
@@ -99,9 +100,9 @@ static adivtab_t adivtab[32 * 32] = {
 #include "adivtab.h"
 };
 
-byte *skintable[MAX_LBM_HEIGHT];
-static int skinwidth;
-static byte *skinstart;
+VIEWSTATE byte *skintable[MAX_LBM_HEIGHT];
+static VIEWSTATE int skinwidth;
+static VIEWSTATE byte *skinstart;
 
 void D_PolysetDrawSpans8(spanpackage_t *pspanpackage);
 void D_PolysetCalcGradients(int skinwidth);
@@ -632,12 +633,13 @@ D_RasterizeAliasPolySmooth(void)
     int initialleftheight, initialrightheight;
     int *plefttop, *prighttop, *pleftbottom, *prightbottom;
     int working_lstepx, originalcount;
+    int *const pverts[3] = { r_p0, r_p1, r_p2 };
 
-    plefttop = pedgetable->pleftedgevert0;
-    prighttop = pedgetable->prightedgevert0;
+    plefttop = pverts[pedgetable->leftedgevert0];
+    prighttop = pverts[pedgetable->rightedgevert0];
 
-    pleftbottom = pedgetable->pleftedgevert1;
-    prightbottom = pedgetable->prightedgevert1;
+    pleftbottom = pverts[pedgetable->leftedgevert1];
+    prightbottom = pverts[pedgetable->rightedgevert1];
 
     initialleftheight = pleftbottom[1] - plefttop[1];
     initialrightheight = prightbottom[1] - prighttop[1];
@@ -731,7 +733,7 @@ D_RasterizeAliasPolySmooth(void)
 	int height;
 
 	plefttop = pleftbottom;
-	pleftbottom = pedgetable->pleftedgevert2;
+	pleftbottom = pverts[pedgetable->leftedgevert2];
 
 	D_PolysetSetUpForLineScan(plefttop[0], plefttop[1],
 				  pleftbottom[0], pleftbottom[1]);
@@ -820,7 +822,7 @@ D_RasterizeAliasPolySmooth(void)
 	d_aspancount = prightbottom[0] - prighttop[0];
 
 	prighttop = prightbottom;
-	prightbottom = pedgetable->prightedgevert2;
+	prightbottom = pverts[pedgetable->rightedgevert2];
 
 	height = prightbottom[1] - prighttop[1];
 
@@ -36,15 +36,25 @@ static void
 D_Sky_uv_To_st(int u, int v, fixed16_t *s, fixed16_t *t)
 {
     float wu, wv, temp;
+    int width, height;
     vec3_t end;
 
-    if (r_refdef.vrect.width >= r_refdef.vrect.height)
-	temp = (float)r_refdef.vrect.width;
-    else
-	temp = (float)r_refdef.vrect.height;
-
-    wu = 8192.0 * (float)(u - ((int)vid.width >> 1)) / temp;
-    wv = 8192.0 * (float)(((int)vid.height >> 1) - v) / temp;
+    /* offscreen targets are projected from their own center */
+    if (r_target) {
+	width = r_target->width;
+	height = r_target->height;
+	temp = (float)qmax(width, height);
+    } else {
+	width = vid.width;
+	height = vid.height;
+	if (r_refdef.vrect.width >= r_refdef.vrect.height)
+	    temp = (float)r_refdef.vrect.width;
+	else
+	    temp = (float)r_refdef.vrect.height;
+    }
+
+    wu = 8192.0 * (float)(u - (width >> 1)) / temp;
+    wv = 8192.0 * (float)((height >> 1) - v) / temp;
 
     end[0] = 4096 * vpn[0] + wu * vright[0] + wv * vup[0];
     end[1] = 4096 * vpn[1] + wu * vright[1] + wv * vup[1];
@@ -26,9 +26,9 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "quakedef.h"
 #include "render.h"
 
-static int sprite_height;
-static int minindex, maxindex;
-static sspan_t *sprite_spans;
+static VIEWSTATE int sprite_height;
+static VIEWSTATE int minindex, maxindex;
+static VIEWSTATE sspan_t *sprite_spans;
 
 #ifndef USE_X86_ASM
 
@@ -21,23 +21,59 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 /* rasterization driver surface heap manager */
 
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "console.h"
 #include "d_local.h"
 #include "quakedef.h"
 #include "r_local.h"
 #include "sys.h"
+#include "thread.h"
 
 #ifdef NQ_HACK
 #include "host.h"
 #endif
 
-float surfscale;
 qboolean r_cache_thrash;	// set if surface cache is thrashing
 
 int sc_size;
 surfcache_t *sc_rover, *sc_base;
 
+surfcache_stats_t d_surfcache_stats;
+
+/*
+ * The video driver hands us a cache sized for one view.  Several views per
+ * frame (the fisheye plates) can reserve a bigger cache, which is allocated
+ * here and replaces the driver's buffer until the driver's is set again.
+ */
+static void *sc_driverbuffer;
+static int sc_driversize;
+static void *sc_reserved;
+static int sc_reservedsize;
+
+/*
+ * Blocks handed out by D_CacheSurface during a batch are stamped with it, so
+ * reusing one of them before the end of the batch can be noticed.  The
+ * surfaces that need building during a batch are only queued, and built all
+ * at once by the job pool at the end of the batch.
+ */
+static int sc_batch, sc_lastbatch;
+static qboolean sc_batchbroken;
+
+static struct {
+    drawsurf_t *surfs;
+    int numsurfs, maxsurfs;
+} sc_builds;
+
+/*
+ * Views drawn at the same time (see R_RenderViews) share the cache, so they
+ * take sc_lock to look up and allocate blocks.  A block is built outside the
+ * lock, and marked as building until it is done; the other views wait for
+ * it before they use it or free it.  A block one view is still drawing from
+ * can be reused by another only if the cache is thrashing.
+ */
+static thread_mutex_t *sc_lock;
+
 #define GUARDSIZE       4
 
 
@@ -85,6 +121,21 @@ D_ClearCacheGuard(void)
 }
 
 
+static void
+D_SetCacheBuffer(void *buffer, int size)
+{
+    sc_size = size - GUARDSIZE;
+    sc_base = (surfcache_t *)buffer;
+    sc_rover = sc_base;
+
+    sc_base->next = NULL;
+    sc_base->owner = NULL;
+    sc_base->size = sc_size;
+    sc_base->building = 0;
+
+    D_ClearCacheGuard();
+}
+
 /*
 ================
 D_InitCaches
@@ -97,17 +148,69 @@ D_InitCaches(void *buffer, int size)
     if (!msg_suppress_1)
 	Con_Printf("%ik surface cache\n", size / 1024);
 
-    sc_size = size - GUARDSIZE;
-    sc_base = (surfcache_t *)buffer;
-    sc_rover = sc_base;
+    if (!sc_lock) {
+	sc_lock = Thread_CreateMutex();
+	if (!sc_lock)
+	    Sys_Error("%s: could not create the cache lock", __func__);
+    }
 
-    sc_base->next = NULL;
-    sc_base->owner = NULL;
-    sc_base->size = sc_size;
+    free(sc_reserved);
+    sc_reserved = NULL;
+    sc_reservedsize = 0;
 
-    D_ClearCacheGuard();
+    sc_driverbuffer = buffer;
+    sc_driversize = size;
+    D_SetCacheBuffer(buffer, size);
 }
 
+/*
+================
+D_ReserveSurfaceCache
+
+Make the cache at least size bytes, for rendering several views a frame.
+It grows as needed, and shrinks back when less than half of it is wanted.
+================
+*/
+void
+D_ReserveSurfaceCache(int size)
+{
+    void *buffer;
+
+    if (!sc_base || COM_CheckParm("-surfcachesize"))
+	return;
+
+    if (size <= sc_driversize) {
+	if (sc_reserved) {
+	    D_FlushCaches();
+	    free(sc_reserved);
+	    sc_reserved = NULL;
+	    sc_reservedsize = 0;
+	    D_SetCacheBuffer(sc_driverbuffer, sc_driversize);
+	}
+	return;
+    }
+
+    if (sc_reserved && size <= sc_reservedsize && size > sc_reservedsize / 2)
+	return;
+
+    buffer = malloc(size);
+    if (!buffer)
+	return;
+
+    Con_DPrintf("%ik surface cache\n", size / 1024);
+
+    D_FlushCaches();
+    free(sc_reserved);
+    sc_reserved = buffer;
+    sc_reservedsize = size;
+    D_SetCacheBuffer(buffer, size);
+}
+
+int
+D_SurfaceCacheSize(void)
+{
+    return sc_base ? sc_size + GUARDSIZE : 0;
+}
 
 /*
 ==================
@@ -131,6 +234,113 @@ D_FlushCaches(void)
     sc_base->next = NULL;
     sc_base->owner = NULL;
     sc_base->size = sc_size;
+    sc_base->building = 0;
+}
+
+/*
+=================
+D_CancelSurfaceBuild
+
+Drop the queued build for a block that is being reused (only when the cache
+is too small for the batch)
+=================
+*/
+static void
+D_CancelSurfaceBuild(const pixel_t *surfdat)
+{
+    int i;
+
+    for (i = 0; i < sc_builds.numsurfs; i++) {
+	if (sc_builds.surfs[i].surfdat == surfdat)
+	    sc_builds.surfs[i].surfdat = NULL;
+    }
+}
+
+/*
+=================
+D_BeginSurfaceBatch
+=================
+*/
+void
+D_BeginSurfaceBatch(void)
+{
+    if (++sc_lastbatch <= 0)
+	sc_lastbatch = 1;
+    sc_batch = sc_lastbatch;
+    sc_batchbroken = false;
+}
+
+static void
+D_BuildSurfaceJob(void *arg, int index)
+{
+    r_drawsurf = sc_builds.surfs[index];
+    if (r_drawsurf.surfdat)
+	R_DrawSurface();
+}
+
+/*
+=================
+D_EndSurfaceBatch
+
+Build the queued surfaces
+=================
+*/
+qboolean
+D_EndSurfaceBatch(void)
+{
+    Thread_RunJobs(D_BuildSurfaceJob, NULL, sc_builds.numsurfs);
+    sc_builds.numsurfs = 0;
+    sc_batch = 0;
+
+    return !sc_batchbroken;
+}
+
+/*
+=================
+D_QueueSurfaceBuild
+
+Queue r_drawsurf to be built at the end of the batch
+=================
+*/
+static void
+D_QueueSurfaceBuild(void)
+{
+    if (sc_builds.numsurfs == sc_builds.maxsurfs) {
+	sc_builds.maxsurfs = sc_builds.maxsurfs ? sc_builds.maxsurfs * 2 : 256;
+	sc_builds.surfs = realloc(sc_builds.surfs,
+				  sc_builds.maxsurfs * sizeof(drawsurf_t));
+	if (!sc_builds.surfs)
+	    Sys_Error("%s: out of memory", __func__);
+    }
+    sc_builds.surfs[sc_builds.numsurfs++] = r_drawsurf;
+}
+
+/*
+=================
+D_WaitForSurfaceBuild
+=================
+*/
+static void
+D_WaitForSurfaceBuild(surfcache_t *cache)
+{
+    while (Thread_AtomicAdd(&cache->building, 0))
+	Thread_Yield();
+}
+
+/*
+=================
+D_SCFree
+=================
+*/
+static void
+D_SCFree(surfcache_t *cache)
+{
+    D_WaitForSurfaceBuild(cache);
+    if (sc_batch && cache->batch == sc_batch) {
+	sc_batchbroken = true;
+	D_CancelSurfaceBuild(cache->data);
+    }
+    *cache->owner = NULL;
 }
 
 /*
@@ -167,7 +377,7 @@ D_SCAlloc(int width, int size)
 // colect and free surfcache_t blocks until the rover block is large enough
     new = sc_rover;
     if (sc_rover->owner)
-	*sc_rover->owner = NULL;
+	D_SCFree(sc_rover);
 
     while (new->size < size) {
 	// free another
@@ -175,7 +385,7 @@ D_SCAlloc(int width, int size)
 	if (!sc_rover)
 	    Sys_Error("%s: hit the end of memory", __func__);
 	if (sc_rover->owner)
-	    *sc_rover->owner = NULL;
+	    D_SCFree(sc_rover);
 
 	new->size += sc_rover->size;
 	new->next = sc_rover->next;
@@ -188,6 +398,7 @@ D_SCAlloc(int width, int size)
 	sc_rover->next = new->next;
 	sc_rover->width = 0;
 	sc_rover->owner = NULL;
+	sc_rover->building = 0;
 	new->next = sc_rover;
 	new->size = size;
     } else
@@ -199,6 +410,7 @@ D_SCAlloc(int width, int size)
 	new->height = (size - sizeof(*new) + sizeof(new->data)) / width;
 
     new->owner = NULL;		// should be set properly after return
+    new->building = 0;
 
     if (d_roverwrapped) {
 	if (wrapped_this_time || (sc_rover >= d_initial_rover))
@@ -270,6 +482,8 @@ surfcache_t *
 D_CacheSurface(const entity_t *e, msurface_t *surface, int miplevel)
 {
     surfcache_t *cache;
+    int dlight;
+    float surfscale;
 
 //
 // if the surface is animating or flashing, flush the cache
@@ -279,19 +493,46 @@ D_CacheSurface(const entity_t *e, msurface_t *surface, int miplevel)
     r_drawsurf.lightadj[1] = d_lightstylevalue[surface->styles[1]];
     r_drawsurf.lightadj[2] = d_lightstylevalue[surface->styles[2]];
     r_drawsurf.lightadj[3] = d_lightstylevalue[surface->styles[3]];
+    r_drawsurf.ambientlight = r_refdef.ambientlight;
 
 //
 // see if the cache holds apropriate data
 //
+    if (r_concurrentview)
+	Thread_LockMutex(sc_lock);
+
     cache = surface->cachespots[miplevel];
+    /*
+     * Surfaces lit by dynamic lights are rebuilt for every scene, but the
+     * views of one scene (with the same lights) can share them.
+     */
+    dlight = (surface->dlightframe == r_sceneframe) ? r_sceneframe : 0;
 
-    if (cache && !cache->dlight && surface->dlightframe != r_framecount
+    if (cache && cache->dlight == dlight
 	&& cache->texture == r_drawsurf.texture
 	&& cache->lightadj[0] == r_drawsurf.lightadj[0]
 	&& cache->lightadj[1] == r_drawsurf.lightadj[1]
 	&& cache->lightadj[2] == r_drawsurf.lightadj[2]
-	&& cache->lightadj[3] == r_drawsurf.lightadj[3])
+	&& cache->lightadj[3] == r_drawsurf.lightadj[3]) {
+	d_surfcache_stats.hits++;
+	cache->batch = sc_batch;
+	if (r_concurrentview) {
+	    Thread_UnlockMutex(sc_lock);
+	    D_WaitForSurfaceBuild(cache);
+	}
 	return cache;
+    }
+
+    if (cache) {
+	D_WaitForSurfaceBuild(cache);
+	d_surfcache_stats.rebuilds++;
+	if (sc_batch && cache->batch == sc_batch) {
+	    sc_batchbroken = true;	// still to be drawn as it was
+	    D_CancelSurfaceBuild(cache->data);
+	}
+    } else {
+	d_surfcache_stats.misses++;
+    }
 
 //
 // determine shape of surface
@@ -314,10 +555,8 @@ D_CacheSurface(const entity_t *e, msurface_t *surface, int miplevel)
 	cache->mipscale = surfscale;
     }
 
-    if (surface->dlightframe == r_framecount)
-	cache->dlight = 1;
-    else
-	cache->dlight = 0;
+    cache->dlight = dlight;
+    cache->batch = sc_batch;
 
     r_drawsurf.surfdat = (pixel_t *)cache->data;
 
@@ -333,7 +572,18 @@ D_CacheSurface(const entity_t *e, msurface_t *surface, int miplevel)
     r_drawsurf.surf = surface;
 
     c_surf++;
-    R_DrawSurface();
+    if (r_concurrentview) {
+	cache->building = 1;
+	Thread_UnlockMutex(sc_lock);
+	R_DrawSurface();
+	Thread_AtomicAdd(&cache->building, -1);
+	return cache;
+    }
+
+    if (sc_batch)
+	D_QueueSurfaceBuild();
+    else
+	R_DrawSurface();
 
     return surface->cachespots[miplevel];
 }
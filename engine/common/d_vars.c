@@ -23,6 +23,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "mathlib.h"
 #include "quakedef.h"
+#include "r_shared.h"
 #include "vid.h"
 
 // all global and static refresh variables are collected in a contiguous block
@@ -35,17 +36,17 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 // FIXME: make into one big structure, like cl or sv
 // FIXME: do separately for refresh engine and driver
 
-float d_sdivzstepu, d_tdivzstepu, d_zistepu;
-float d_sdivzstepv, d_tdivzstepv, d_zistepv;
-float d_sdivzorigin, d_tdivzorigin, d_ziorigin;
+SPANSTATE float d_sdivzstepu, d_tdivzstepu, d_zistepu;
+SPANSTATE float d_sdivzstepv, d_tdivzstepv, d_zistepv;
+SPANSTATE float d_sdivzorigin, d_tdivzorigin, d_ziorigin;
 
-fixed16_t sadjust, tadjust, bbextents, bbextentt;
+SPANSTATE fixed16_t sadjust, tadjust, bbextents, bbextentt;
 
-pixel_t *cacheblock;
-int cachewidth;
-pixel_t *d_viewbuffer;
-short *d_pzbuffer;
-unsigned int d_zrowbytes;
-unsigned int d_zwidth;
+SPANSTATE pixel_t *cacheblock;
+SPANSTATE int cachewidth;
+VIEWSTATE pixel_t *d_viewbuffer;
+VIEWSTATE short *d_pzbuffer;
+VIEWSTATE unsigned int d_zrowbytes;
+VIEWSTATE unsigned int d_zwidth;
 
 #endif /* USE_X86_ASM */
@@ -23,8 +23,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "r_local.h"
 #include "d_local.h"
 
-static finalvert_t fv[2][8];
-static auxvert_t av[8];
+static VIEWSTATE finalvert_t fv[2][8];
+static VIEWSTATE auxvert_t av[8];
 
 /*
 ================
@@ -34,25 +34,25 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
    clamping */
 #define LIGHT_MIN 5
 
-affinetridesc_t r_affinetridesc;
-trivertx_t *r_apverts;
+VIEWSTATE affinetridesc_t r_affinetridesc;
+VIEWSTATE trivertx_t *r_apverts;
 
-void *acolormap;		// FIXME: should go away
+VIEWSTATE void *acolormap;		// FIXME: should go away
 
 // TODO: these probably will go away with optimized rasterization
-vec3_t r_plightvec;
-int r_ambientlight;
-float r_shadelight;
-static float ziscale;
-static model_t *pmodel;
+VIEWSTATE vec3_t r_plightvec;
+VIEWSTATE int r_ambientlight;
+VIEWSTATE float r_shadelight;
+static VIEWSTATE float ziscale;
+static VIEWSTATE model_t *pmodel;
 
-static vec3_t alias_forward, alias_right, alias_up;
+static VIEWSTATE vec3_t alias_forward, alias_right, alias_up;
 
-int r_amodels_drawn;
-int a_skinwidth;
-int r_anumverts;
+VIEWSTATE int r_amodels_drawn;
+VIEWSTATE int a_skinwidth;
+VIEWSTATE int r_anumverts;
 
-float aliastransform[3][4];
+VIEWSTATE float aliastransform[3][4];
 
 typedef struct {
     int index0;
@@ -173,13 +173,30 @@ R_ModelLoader(void)
     return &SW_Model_Loader;
 }
 
+/*
+================
+R_AliasHeader
+
+Views drawn at the same time can't load or touch the model cache, so
+R_RenderViews loads their models beforehand and they only look them up
+================
+*/
+static aliashdr_t *
+R_AliasHeader(model_t *model)
+{
+    if (r_concurrentview)
+	return model->cache.data;
+
+    return Mod_Extradata(model);
+}
+
 /*
 ================
 R_AliasCheckBBox
 ================
 */
 qboolean
-R_AliasCheckBBox(entity_t *e)
+R_AliasCheckBBox(const entity_t *e, int *trivial_accept)
 {
     int i, flags, frame, numv;
     aliashdr_t *pahdr;
@@ -193,9 +210,11 @@ R_AliasCheckBBox(entity_t *e)
 
 // expand, rotate, and translate points into worldspace
 
-    e->trivial_accept = 0;
+    *trivial_accept = 0;
     pmodel = e->model;
-    pahdr = Mod_Extradata(pmodel);
+    pahdr = R_AliasHeader(pmodel);
+    if (!pahdr)
+	return false;
 
     R_AliasSetUpTransform(e, pahdr, 0);
 
@@ -203,7 +222,8 @@ R_AliasCheckBBox(entity_t *e)
     frame = e->frame;
 // TODO: don't repeat this check when drawing?
     if ((frame >= pahdr->numframes) || (frame < 0)) {
-	Con_DPrintf("No such frame %d %s\n", frame, pmodel->name);
+	if (!r_concurrentview)
+	    Con_DPrintf("No such frame %d %s\n", frame, pmodel->name);
 	frame = 0;
     }
 
@@ -320,10 +340,10 @@ R_AliasCheckBBox(entity_t *e)
 	return true;
 #endif
 
-    e->trivial_accept = !anyclip & !zclipped;
-    if (e->trivial_accept) {
+    *trivial_accept = !anyclip & !zclipped;
+    if (*trivial_accept) {
 	if (minz > (r_aliastransition + (pahdr->size * r_resfudge))) {
-	    e->trivial_accept |= 2;
+	    *trivial_accept |= 2;
 	}
     }
 
@@ -421,8 +441,8 @@ R_AliasSetUpTransform(const entity_t *e, aliashdr_t *pahdr, int trivial_accept)
 {
     int i;
     float rotationmatrix[3][4], t2matrix[3][4];
-    static float tmatrix[3][4];
-    static float viewmatrix[3][4];
+    static VIEWSTATE float tmatrix[3][4];
+    static VIEWSTATE float viewmatrix[3][4];
     vec3_t angles;
 
 // TODO: should really be stored with the entity instead of being reconstructed
@@ -670,8 +690,9 @@ R_AliasSetupSkin(const entity_t *entity, aliashdr_t *aliashdr)
 
     skinnum = entity->skinnum;
     if ((skinnum >= aliashdr->numskins) || (skinnum < 0)) {
-	Con_DPrintf("%s: %s has no such skin (%d)\n",
-		    __func__, entity->model->name, skinnum);
+	if (!r_concurrentview)
+	    Con_DPrintf("%s: %s has no such skin (%d)\n",
+			__func__, entity->model->name, skinnum);
 	skinnum = 0;
     }
 
@@ -749,9 +770,10 @@ R_AliasSetupLighting(alight_t *plighting)
 
 #ifdef NQ_HACK
 static trivertx_t *
-R_AliasBlendPoseVerts(const entity_t *e, aliashdr_t *hdr, float blend)
+R_AliasBlendPoseVerts(aliashdr_t *hdr, int previouspose, int currentpose,
+		      float blend)
 {
-    static trivertx_t blendverts[MAXALIASVERTS];
+    static VIEWSTATE trivertx_t blendverts[MAXALIASVERTS];
     trivertx_t *poseverts, *pv1, *pv2, *light;
     int i, blend0, blend1;
 
@@ -760,8 +782,8 @@ R_AliasBlendPoseVerts(const entity_t *e, aliashdr_t *hdr, float blend)
     blend0 = (1 << SHIFT) - blend1;
 
     poseverts = (trivertx_t *)((byte *)hdr + hdr->posedata);
-    pv1 = poseverts + e->previouspose * hdr->numverts;
-    pv2 = poseverts + e->currentpose * hdr->numverts;
+    pv1 = poseverts + previouspose * hdr->numverts;
+    pv2 = poseverts + currentpose * hdr->numverts;
     light = (blend < 0.5f) ? pv1 : pv2;
     poseverts = blendverts;
 
@@ -785,14 +807,15 @@ set r_apverts
 =================
 */
 static void
-R_AliasSetupFrame(entity_t *e, aliashdr_t *pahdr)
+R_AliasSetupFrame(const entity_t *e, aliashdr_t *pahdr)
 {
     int frame, pose, numposes;
     float *intervals;
 
     frame = e->frame;
     if ((frame >= pahdr->numframes) || (frame < 0)) {
-	Con_DPrintf("%s: no such frame %d\n", __func__, frame);
+	if (!r_concurrentview)
+	    Con_DPrintf("%s: no such frame %d\n", __func__, frame);
 	frame = 0;
     }
 
@@ -807,6 +830,7 @@ R_AliasSetupFrame(entity_t *e, aliashdr_t *pahdr)
 #ifdef NQ_HACK
     if (r_lerpmodels.value) {
 	float delta, time, blend;
+	int previouspose, currentpose;
 
 	/* A few quick sanity checks to abort lerping */
 	if (e->currentframetime < e->previousframetime)
@@ -828,25 +852,26 @@ R_AliasSetupFrame(entity_t *e, aliashdr_t *pahdr)
 		if (intervals[i] > targettime)
 		    break;
 
-	    e->currentpose = pahdr->frames[e->currentframe].firstpose + i;
+	    currentpose = pahdr->frames[e->currentframe].firstpose + i;
 	    if (i == 0) {
-		e->previouspose = pahdr->frames[e->currentframe].firstpose;
-		e->previouspose += numposes - 1;
+		previouspose = pahdr->frames[e->currentframe].firstpose;
+		previouspose += numposes - 1;
 		time = targettime;
 		delta = intervals[0];
 	    } else {
-		e->previouspose = e->currentpose - 1;
+		previouspose = currentpose - 1;
 		time = targettime - intervals[i - 1];
 		delta = intervals[i] - intervals[i - 1];
 	    }
 	} else {
-	    e->currentpose = pahdr->frames[e->currentframe].firstpose;
-	    e->previouspose = pahdr->frames[e->previousframe].firstpose;
+	    currentpose = pahdr->frames[e->currentframe].firstpose;
+	    previouspose = pahdr->frames[e->previousframe].firstpose;
 	    time = cl.time - e->currentframetime;
 	    delta = e->currentframetime - e->previousframetime;
 	}
 	blend = qclamp(time / delta, 0.0f, 1.0f);
-	r_apverts = R_AliasBlendPoseVerts(e, pahdr, blend);
+	r_apverts = R_AliasBlendPoseVerts(pahdr, previouspose, currentpose,
+					  blend);
 
 	return;
     }
@@ -863,7 +888,7 @@ R_AliasDrawModel
 ================
 */
 void
-R_AliasDrawModel(entity_t *e, alight_t *plighting)
+R_AliasDrawModel(const entity_t *e, alight_t *plighting, int trivial_accept)
 {
     aliashdr_t *pahdr;
     finalvert_t *pfinalverts;
@@ -871,23 +896,25 @@ R_AliasDrawModel(entity_t *e, alight_t *plighting)
     auxvert_t *pauxverts;
     auxvert_t auxverts[MAXALIASVERTS];
 
+    pahdr = R_AliasHeader(e->model);
+    if (!pahdr)
+	return;
+
     r_amodels_drawn++;
 
 // cache align
     pfinalverts = CACHE_ALIGN_PTR(finalverts);
     pauxverts = &auxverts[0];
 
-    pahdr = Mod_Extradata(e->model);
-
     R_AliasSetupSkin(e, pahdr);
-    R_AliasSetUpTransform(e, pahdr, e->trivial_accept);
+    R_AliasSetUpTransform(e, pahdr, trivial_accept);
     R_AliasSetupLighting(plighting);
     R_AliasSetupFrame(e, pahdr);
 
     if (!e->colormap)
 	Sys_Error("%s: !e->colormap", __func__);
 
-    r_affinetridesc.drawtype = (e->trivial_accept == 3) &&
+    r_affinetridesc.drawtype = (trivial_accept == 3) &&
 	r_recursiveaffinetriangles;
 
     if (r_affinetridesc.drawtype) {
@@ -905,7 +932,7 @@ R_AliasDrawModel(entity_t *e, alight_t *plighting)
     else
 	ziscale = ((float)0x8000) * ((float)0x10000) * 3.0;
 
-    if (e->trivial_accept)
+    if (trivial_accept)
 	R_AliasPrepareUnclippedPoints(pahdr, pfinalverts);
     else
 	R_AliasPreparePoints(pahdr, pfinalverts, pauxverts);
@@ -22,6 +22,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "quakedef.h"
 #include "r_local.h"
 #include "console.h"
+#include "sys.h"
 
 //
 // current entity info
@@ -29,26 +30,26 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 // modelorg is the viewpoint reletive to
 // the currently rendering entity
-vec3_t modelorg, base_modelorg;
+VIEWSTATE vec3_t modelorg, base_modelorg;
 
-vec3_t r_entorigin;	// the currently rendering entity in world coordinates
+VIEWSTATE vec3_t r_entorigin;	// the currently rendering entity in world coordinates
 
-static float entity_rotation[3][3];
+static VIEWSTATE float entity_rotation[3][3];
 
-int r_currentbkey;
+VIEWSTATE int r_currentbkey;
 
 typedef enum { touchessolid, drawnode, nodrawnode } solidstate_t;
 
 #define MAX_BMODEL_VERTS	500	// 6K
 #define MAX_BMODEL_EDGES	1000	// 12K
 
-static mvertex_t *pbverts;
-static bedge_t *pbedges;
-static int numbverts, numbedges;
+static VIEWSTATE mvertex_t *pbverts;
+static VIEWSTATE bedge_t *pbedges;
+static VIEWSTATE int numbverts, numbedges;
 
-static mvertex_t *pfrontenter, *pfrontexit;
+static VIEWSTATE mvertex_t *pfrontenter, *pfrontexit;
 
-static qboolean makeclippededge;
+static VIEWSTATE qboolean makeclippededge;
 
 //===========================================================================
 
@@ -155,7 +156,7 @@ R_RecursiveClipBPoly
 */
 static void
 R_RecursiveClipBPoly(const entity_t *e, bedge_t *pedges, mnode_t *pnode,
-		     msurface_t *psurf)
+		     msurface_t *psurf, int clipflags)
 {
     bedge_t *psideedges[2], *pnextedge, *ptedge;
     int i, side, lastside;
@@ -220,7 +221,8 @@ R_RecursiveClipBPoly(const entity_t *e, bedge_t *pedges, mnode_t *pnode,
 	    // and exiting points
 	    // FIXME: share the clip edge by having a winding direction flag?
 	    if (numbedges > MAX_BMODEL_EDGES - 2) {
-		Con_Printf("Out of edges for bmodel\n");
+		if (!r_concurrentview)
+		    Con_Printf("Out of edges for bmodel\n");
 		return;
 	    }
 
@@ -257,7 +259,8 @@ R_RecursiveClipBPoly(const entity_t *e, bedge_t *pedges, mnode_t *pnode,
 // plane to both sides (but in opposite directions)
     if (makeclippededge) {
 	if (numbedges > MAX_BMODEL_EDGES - 2) {
-	    Con_Printf("Out of edges for bmodel\n");
+	    if (!r_concurrentview)
+		Con_Printf("Out of edges for bmodel\n");
 	    return;
 	}
 
@@ -289,11 +292,11 @@ R_RecursiveClipBPoly(const entity_t *e, bedge_t *pedges, mnode_t *pnode,
 	    if (pn->visframe == r_visframecount) {
 		if (pn->contents < 0) {
 		    if (pn->contents != CONTENTS_SOLID) {
-			r_currentbkey = ((mleaf_t *)pn)->key;
-			R_RenderBmodelFace(e, psideedges[i], psurf);
+			r_currentbkey = *R_LeafKey((mleaf_t *)pn);
+			R_RenderBmodelFace(e, psideedges[i], psurf, clipflags);
 		    }
 		} else {
-		    R_RecursiveClipBPoly(e, psideedges[i], pn, psurf);
+		    R_RecursiveClipBPoly(e, psideedges[i], pn, psurf, clipflags);
 		}
 	    }
 	}
@@ -301,24 +304,72 @@ R_RecursiveClipBPoly(const entity_t *e, bedge_t *pedges, mnode_t *pnode,
 }
 
 
+/*
+=============
+R_CullSubmodelSurface
+
+Returns the surface's frustum clip flags, or BMODEL_FULLY_CLIPPED if it is
+outside the frustum or facing away (modelorg and the frustum are in the
+submodel's space)
+=============
+*/
+static int
+R_CullSubmodelSurface(const msurface_t *surf, int clipflags)
+{
+    int i, side;
+    mplane_t *plane;
+    vec_t dist;
+
+    /* Clip the surface against the frustum */
+    for (i = 0; i < 4; i++) {
+	if (!(clipflags & (1 << i)))
+	    continue;
+	plane = &view_clipplanes[i].plane;
+	side = BoxOnPlaneSide(surf->mins, surf->maxs, plane);
+	if (side == PSIDE_BACK)
+	    return BMODEL_FULLY_CLIPPED;
+	if (side == PSIDE_FRONT)
+	    clipflags &= ~(1 << i);
+    }
+
+    /* Cull backward facing surfs */
+    if (surf->plane->type < 3) {
+	dist = modelorg[surf->plane->type] - surf->plane->dist;
+    } else {
+	dist = DotProduct(modelorg, surf->plane->normal);
+	dist -= surf->plane->dist;
+    }
+    if (surf->flags & SURF_PLANEBACK) {
+	if (dist > -BACKFACE_EPSILON)
+	    return BMODEL_FULLY_CLIPPED;
+    } else {
+	if (dist < BACKFACE_EPSILON)
+	    return BMODEL_FULLY_CLIPPED;
+    }
+
+    return clipflags;
+}
+
 /*
 ================
 R_DrawSolidClippedSubmodelPolygons
 ================
 */
 void
-R_DrawSolidClippedSubmodelPolygons(const entity_t *entity)
+R_DrawSolidClippedSubmodelPolygons(const entity_t *entity, int clipflags,
+				   mnode_t *topnode)
 {
     const brushmodel_t *brushmodel = BrushModel(entity->model);
     const int numsurfaces = brushmodel->nummodelsurfaces;
-    int i, j;
+    int i, j, surfclipflags;
     msurface_t *surf;
     mvertex_t bverts[MAX_BMODEL_VERTS];
     bedge_t bedges[MAX_BMODEL_EDGES], *pbedge;
 
     surf = &brushmodel->surfaces[brushmodel->firstmodelsurface];
     for (i = 0; i < numsurfaces; i++, surf++) {
-	if (surf->clipflags == BMODEL_FULLY_CLIPPED)
+	surfclipflags = R_CullSubmodelSurface(surf, clipflags);
+	if (surfclipflags == BMODEL_FULLY_CLIPPED)
 	    continue;
 
 	// draw the polygon
@@ -351,7 +402,7 @@ R_DrawSolidClippedSubmodelPolygons(const entity_t *entity)
 	}
 	pbedge[j - 1].pnext = NULL;	// mark end of edges
 
-	R_RecursiveClipBPoly(entity, pbedge, entity->topnode, surf);
+	R_RecursiveClipBPoly(entity, pbedge, topnode, surf, surfclipflags);
     }
 }
 
@@ -362,7 +413,8 @@ R_DrawSubmodelPolygons
 ================
 */
 void
-R_DrawSubmodelPolygons(const entity_t *entity, int clipflags)
+R_DrawSubmodelPolygons(const entity_t *entity, int clipflags,
+		       mnode_t *topnode)
 {
     const brushmodel_t *brushmodel = BrushModel(entity->model);
     const int numsurfaces = brushmodel->nummodelsurfaces;
@@ -373,100 +425,230 @@ R_DrawSubmodelPolygons(const entity_t *entity, int clipflags)
 
     surf = &brushmodel->surfaces[brushmodel->firstmodelsurface];
     for (i = 0; i < numsurfaces; i++, surf++) {
-	if (surf->clipflags == BMODEL_FULLY_CLIPPED)
+	if (R_CullSubmodelSurface(surf, clipflags) == BMODEL_FULLY_CLIPPED)
 	    continue;
 
-	r_currentkey = ((mleaf_t *)entity->topnode)->key;
+	r_currentkey = *R_LeafKey((mleaf_t *)topnode);
 	R_RenderFace(entity, surf, clipflags);
     }
 }
 
+/*
+ * The world list holds the part of the world that can be seen from the view
+ * origin: the nodes and leafs in the PVS, in front to back order, and the
+ * front facing surfaces on each node.  None of that depends on the view
+ * direction, so it is built once per scene and every view of the scene only
+ * clips it against its own frustum.
+ *
+ * A node entry is followed by its front subtree, an entry for the node's own
+ * surfaces and its back subtree.  A node that is clipped away skips straight
+ * to the entry after its subtree.
+ */
+typedef struct {
+    mnode_t *node;
+    int next;		// node: first entry after the subtree
+    int firstsurf;	// surfaces: index into worldlist.surfs
+    int numsurfs;	// surfaces: count, -1 for a node entry
+} worldentry_t;
+
+static struct {
+    worldentry_t *entries;
+    int numentries, maxentries;
+    msurface_t **surfs;
+    int numsurfs, maxsurfs;
+} worldlist;
+
+VIEWSTATE int *r_worldclipflags;
+VIEWSTATE int *r_leafkeys;
+
+static int
+R_NewWorldEntry(mnode_t *node, int numsurfs)
+{
+    worldentry_t *entry;
+
+    if (worldlist.numentries == worldlist.maxentries) {
+	worldlist.maxentries = worldlist.maxentries ? worldlist.maxentries * 2 : 1024;
+	worldlist.entries = realloc(worldlist.entries,
+				    worldlist.maxentries * sizeof(*entry));
+	if (!worldlist.entries)
+	    Sys_Error("%s: out of memory", __func__);
+    }
+    entry = &worldlist.entries[worldlist.numentries];
+    entry->node = node;
+    entry->next = worldlist.numentries + 1;
+    entry->firstsurf = worldlist.numsurfs;
+    entry->numsurfs = numsurfs;
+
+    return worldlist.numentries++;
+}
+
+static void
+R_AddWorldSurface(msurface_t *surf)
+{
+    if (worldlist.numsurfs == worldlist.maxsurfs) {
+	worldlist.maxsurfs = worldlist.maxsurfs ? worldlist.maxsurfs * 2 : 1024;
+	worldlist.surfs = realloc(worldlist.surfs,
+				  worldlist.maxsurfs * sizeof(*worldlist.surfs));
+	if (!worldlist.surfs)
+	    Sys_Error("%s: out of memory", __func__);
+    }
+    worldlist.surfs[worldlist.numsurfs++] = surf;
+}
+
+static vec_t
+R_PlaneDist(const mplane_t *plane)
+{
+    if (plane->type < 3)
+	return modelorg[plane->type] - plane->dist;
+    return DotProduct(modelorg, plane->normal) - plane->dist;
+}
+
 /*
 ================
-R_RecursiveWorldNode
+R_RecursiveWorldList
 ================
 */
 static void
-R_RecursiveWorldNode(const entity_t *e, mnode_t *node)
+R_RecursiveWorldList(mnode_t *node)
 {
-    int count, side;
-    mplane_t *plane;
+    int i, side, index;
     msurface_t *surf;
-    mleaf_t *pleaf;
-    vec_t dot;
+    worldentry_t *entry;
+    vec_t dist;
 
     if (node->contents == CONTENTS_SOLID)
 	return;
     if (node->visframe != r_visframecount)
 	return;
-    if (node->clipflags == BMODEL_FULLY_CLIPPED)
-	return;
-
-    /* if a leaf node, draw stuff */
-    if (node->contents < 0) {
-	pleaf = (mleaf_t *)node;
-	pleaf->key = r_currentkey;
-	r_currentkey++;		// all bmodels in a leaf share the same key
 
+    index = R_NewWorldEntry(node, -1);
+    if (node->contents < 0)
 	return;
-    }
 
-    /*
-     * The node is a decision point, so go down the apropriate sides.
-     * Find which side of the node we are on.
-     */
-    plane = node->plane;
-    switch (plane->type) {
-    case PLANE_X:
-	dot = modelorg[0] - plane->dist;
-	break;
-    case PLANE_Y:
-	dot = modelorg[1] - plane->dist;
-	break;
-    case PLANE_Z:
-	dot = modelorg[2] - plane->dist;
-	break;
-    default:
-	dot = DotProduct(modelorg, plane->normal) - plane->dist;
-	break;
-    }
-    side = (dot >= 0) ? 0 : 1;
+    /* go down the front side first */
+    side = (R_PlaneDist(node->plane) >= 0) ? 0 : 1;
+    R_RecursiveWorldList(node->children[side]);
 
-    /* recurse down the children, front side first */
-    R_RecursiveWorldNode(e, node->children[side]);
-
-    /* draw stuff */
-    count = node->numsurfaces;
-    if (count) {
+    /* keep the surfaces in the PVS that face the view origin */
+    if (node->numsurfaces) {
+	R_NewWorldEntry(node, 0);
 	surf = cl.worldmodel->surfaces + node->firstsurface;
-	for (count = node->numsurfaces; count; count--, surf++) {
+	for (i = 0; i < node->numsurfaces; i++, surf++) {
 	    if (surf->visframe != r_visframecount)
 		continue;
-	    if (surf->clipflags == BMODEL_FULLY_CLIPPED)
-		continue;
-	    R_RenderFace(e, surf, surf->clipflags);
+	    dist = R_PlaneDist(surf->plane);
+	    if (surf->flags & SURF_PLANEBACK) {
+		if (dist > -BACKFACE_EPSILON)
+		    continue;
+	    } else {
+		if (dist < BACKFACE_EPSILON)
+		    continue;
+	    }
+	    R_AddWorldSurface(surf);
 	}
-
-	/* all surfaces on the same node share the same sequence number */
-	r_currentkey++;
+	entry = &worldlist.entries[worldlist.numentries - 1];
+	entry->numsurfs = worldlist.numsurfs - entry->firstsurf;
     }
 
-    /* recurse down the back side */
-    R_RecursiveWorldNode(e, node->children[!side]);
+    R_RecursiveWorldList(node->children[!side]);
+    worldlist.entries[index].next = worldlist.numentries;
 }
 
+/*
+================
+R_BuildWorldList
+
+Called once per scene, after the PVS has been marked
+================
+*/
+void
+R_BuildWorldList(void)
+{
+    worldlist.numentries = 0;
+    worldlist.numsurfs = 0;
+
+    VectorCopy(r_origin, modelorg);
+    R_RecursiveWorldList(cl.worldmodel->nodes);
+}
+
+/*
+================
+R_ClipWorldBox
+
+Returns the frustum planes the box still crosses, or BMODEL_FULLY_CLIPPED
+================
+*/
+static int
+R_ClipWorldBox(const float *mins, const float *maxs, int clipflags)
+{
+    int i, side;
+
+    for (i = 0; i < 4; i++) {
+	if (!(clipflags & (1 << i)))
+	    continue;
+	side = BoxOnPlaneSide(mins, maxs, &view_clipplanes[i].plane);
+	if (side == PSIDE_BACK)
+	    return BMODEL_FULLY_CLIPPED;
+	if (side == PSIDE_FRONT)
+	    clipflags &= ~(1 << i);
+    }
 
+    return clipflags;
+}
 
 /*
 ================
 R_RenderWorld
+
+Clip the world list against the view frustum and draw what is left
 ================
 */
 void
 R_RenderWorld(void)
 {
-    brushmodel_t *brushmodel = BrushModel(r_worldentity.model);
+    const worldentry_t *entry, *end;
+    msurface_t **surf;
+    mnode_t *node;
+    int i, clipflags;
 
     VectorCopy(r_origin, modelorg);
-    R_RecursiveWorldNode(&r_worldentity, brushmodel->nodes);
+
+    entry = worldlist.entries;
+    end = entry + worldlist.numentries;
+    while (entry < end) {
+	node = entry->node;
+	if (entry->numsurfs < 0) {
+	    /* parents come first, so theirs are already this view's flags */
+	    clipflags = node->parent ? *R_NodeClipFlags(node->parent) : 15;
+	    if (clipflags)
+		clipflags = R_ClipWorldBox(node->mins, node->maxs,
+					   clipflags);
+	    *R_NodeClipFlags(node) = clipflags;
+	    if (clipflags == BMODEL_FULLY_CLIPPED) {
+		entry = worldlist.entries + entry->next;
+		continue;
+	    }
+	    if (node->contents < 0) {
+		*R_LeafKey((mleaf_t *)node) = r_currentkey;
+		r_currentkey++;	// all bmodels in a leaf share the same key
+	    }
+	    entry++;
+	    continue;
+	}
+
+	surf = worldlist.surfs + entry->firstsurf;
+	for (i = 0; i < entry->numsurfs; i++, surf++) {
+	    clipflags = *R_NodeClipFlags(node);
+	    if (clipflags)
+		clipflags = R_ClipWorldBox((*surf)->mins, (*surf)->maxs,
+					   clipflags);
+	    if (clipflags == BMODEL_FULLY_CLIPPED)
+		continue;
+	    R_RenderFace(&r_worldentity, *surf, clipflags);
+	}
+
+	/* all surfaces on the same node share the same sequence number */
+	r_currentkey++;
+	entry++;
+    }
 }
@@ -30,28 +30,28 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define FULLY_CLIPPED_CACHED	0x80000000
 #define FRAMECOUNT_MASK		0x7FFFFFFF
 
-int c_faceclip;			// number of faces clipped
-unsigned int cacheoffset;
-clipplane_t view_clipplanes[4];
+VIEWSTATE int c_faceclip;			// number of faces clipped
+VIEWSTATE unsigned int cacheoffset;
+VIEWSTATE clipplane_t view_clipplanes[4];
 
-medge_t *r_pedge;
+VIEWSTATE medge_t *r_pedge;
 
-qboolean r_leftclipped, r_rightclipped;
-static qboolean makeleftedge, makerightedge;
-qboolean r_nearzionly;
+VIEWSTATE qboolean r_leftclipped, r_rightclipped;
+static VIEWSTATE qboolean makeleftedge, makerightedge;
+VIEWSTATE qboolean r_nearzionly;
 
 int sintable[TURB_TABLE_SIZE];
 int intsintable[TURB_TABLE_SIZE];
 
-mvertex_t r_leftenter, r_leftexit;
-mvertex_t r_rightenter, r_rightexit;
+VIEWSTATE mvertex_t r_leftenter, r_leftexit;
+VIEWSTATE mvertex_t r_rightenter, r_rightexit;
 
-int r_emitted;
-float r_nearzi;
-float r_u1, r_v1, r_lzi1;
-int r_ceilv1;
+VIEWSTATE int r_emitted;
+VIEWSTATE float r_nearzi;
+VIEWSTATE float r_u1, r_v1, r_lzi1;
+VIEWSTATE int r_ceilv1;
 
-qboolean r_lastvertvalid;
+VIEWSTATE qboolean r_lastvertvalid;
 
 
 #ifndef USE_X86_ASM
@@ -406,7 +406,8 @@ R_RenderFace(const entity_t *e, msurface_t *fa, int clipflags)
 	    r_pedge = &pedges[lindex];
 
 	    // if the edge is cached, we can just reuse the edge
-	    if (!insubmodel && R_EmitCachedEdge()) {
+	    // (the cache is in the shared model, so concurrent views skip it)
+	    if (!insubmodel && !r_concurrentview && R_EmitCachedEdge()) {
 		r_lastvertvalid = false;
 		continue;
 	    }
@@ -416,7 +417,8 @@ R_RenderFace(const entity_t *e, msurface_t *fa, int clipflags)
 	    r_leftclipped = r_rightclipped = false;
 	    R_ClipEdge(&brushmodel->vertexes[r_pedge->v[0]],
 		       &brushmodel->vertexes[r_pedge->v[1]], pclip);
-	    r_pedge->cachededgeoffset = cacheoffset;
+	    if (!r_concurrentview)
+		r_pedge->cachededgeoffset = cacheoffset;
 
 	    if (r_leftclipped)
 		makeleftedge = true;
@@ -427,7 +429,7 @@ R_RenderFace(const entity_t *e, msurface_t *fa, int clipflags)
 	    lindex = -lindex;
 	    r_pedge = &pedges[lindex];
 	    // if the edge is cached, we can just reuse the edge
-	    if (!insubmodel && R_EmitCachedEdge()) {
+	    if (!insubmodel && !r_concurrentview && R_EmitCachedEdge()) {
 		r_lastvertvalid = false;
 		continue;
 	    }
@@ -437,7 +439,8 @@ R_RenderFace(const entity_t *e, msurface_t *fa, int clipflags)
 	    r_leftclipped = r_rightclipped = false;
 	    R_ClipEdge(&brushmodel->vertexes[r_pedge->v[1]],
 		       &brushmodel->vertexes[r_pedge->v[0]], pclip);
-	    r_pedge->cachededgeoffset = cacheoffset;
+	    if (!r_concurrentview)
+		r_pedge->cachededgeoffset = cacheoffset;
 
 	    if (r_leftclipped)
 		makeleftedge = true;
@@ -498,7 +501,8 @@ R_RenderBmodelFace
 ================
 */
 void
-R_RenderBmodelFace(const entity_t *e, bedge_t *pedges, msurface_t *psurf)
+R_RenderBmodelFace(const entity_t *e, bedge_t *pedges, msurface_t *psurf,
+		   int clipflags)
 {
     int i;
     unsigned mask;
@@ -528,7 +532,7 @@ R_RenderBmodelFace(const entity_t *e, bedge_t *pedges, msurface_t *psurf)
     pclip = NULL;
 
     for (i = 3, mask = 0x08; i >= 0; i--, mask >>= 1) {
-	if (psurf->clipflags & mask) {
+	if (clipflags & mask) {
 	    view_clipplanes[i].next = pclip;
 	    pclip = &view_clipplanes[i];
 	}
@@ -19,12 +19,15 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 // r_edge.c
 
+#include <stdlib.h>
+
 #include "quakedef.h"
 #include "r_local.h"
 #include "sound.h"
+#include "sys.h"
 
 // FIXME - header hacks
-extern int screenwidth;
+extern VIEWSTATE int screenwidth;
 
 #if 0
 // FIXME
@@ -36,35 +39,44 @@ extern int screenwidth;
 */
 #endif
 
-edge_t *auxedges;
-edge_t *r_edges, *edge_p, *edge_max;
+VIEWSTATE edge_t *auxedges;
+VIEWSTATE edge_t *r_edges, *edge_p, *edge_max;
 
-surf_t *surfaces, *surface_p, *surf_max;
+VIEWSTATE surf_t *surfaces, *surface_p, *surf_max;
 
 // surfaces are generated in back to front order by the bsp, so if a surf
 // pointer is greater than another one, it should be drawn in front
 // surfaces[1] is the background, and is used as the active surface stack
 
-edge_t *newedges[MAXHEIGHT];
-edge_t *removeedges[MAXHEIGHT];
+VIEWSTATE edge_t *newedges[MAXHEIGHT];
+VIEWSTATE edge_t *removeedges[MAXHEIGHT];
+
+VIEWSTATE espan_t *span_p;
+static VIEWSTATE espan_t *max_span_p;
 
-espan_t *span_p;
-static espan_t *max_span_p;
+/*
+ * When the span fill is split between threads (see D_DrawSurfaces), the spans
+ * are collected for most of the view before they are drawn, so there is
+ * enough work to share out.
+ */
+#define BANDED_SPANS_PER_ROW	64
+static espan_t *bandedspans;
+static int numbandedspans;
 
-int r_currentkey;
+VIEWSTATE int r_currentkey;
 
-int current_iv;
+VIEWSTATE int current_iv;
 
-int edge_head_u_shift20, edge_tail_u_shift20;
+VIEWSTATE int edge_head_u_shift20, edge_tail_u_shift20;
 
-static void (*pdrawfunc) (void);
+static VIEWSTATE void (*pdrawfunc) (void);
 
-edge_t edge_head;
-edge_t edge_tail;
-edge_t edge_aftertail;
-edge_t edge_sentinel;
+VIEWSTATE edge_t edge_head;
+VIEWSTATE edge_t edge_tail;
+VIEWSTATE edge_t edge_aftertail;
+VIEWSTATE edge_t edge_sentinel;
 
-float fv;
+VIEWSTATE float fv;
 
 void R_GenerateSpans(void);
 void R_GenerateSpansBackward(void);
@@ -591,13 +603,27 @@ Each surface has a linked list of its visible spans
 void
 R_ScanEdges(void)
 {
-    int iv, bottom;
+    int iv, bottom, top, maxspans;
     espan_t basespans[CACHE_PAD_ARRAY(MAXSPANS, espan_t)];
     espan_t *basespan_p;
     surf_t *s;
 
     basespan_p = CACHE_ALIGN_PTR(basespans);
-    max_span_p = &basespan_p[MAXSPANS - r_refdef.vrect.width];
+    maxspans = MAXSPANS;
+    if (d_spanbands) {
+	maxspans = r_refdef.vrect.height * BANDED_SPANS_PER_ROW;
+	if (maxspans < MAXSPANS)
+	    maxspans = MAXSPANS;
+	if (maxspans > numbandedspans) {
+	    free(bandedspans);
+	    bandedspans = malloc(maxspans * sizeof(espan_t));
+	    if (!bandedspans)
+		Sys_Error("%s: out of memory", __func__);
+	    numbandedspans = maxspans;
+	}
+	basespan_p = bandedspans;
+    }
+    max_span_p = &basespan_p[maxspans - r_refdef.vrect.width];
 
     span_p = basespan_p;
 
@@ -632,6 +658,7 @@ R_ScanEdges(void)
 // process all scan lines
 //
     bottom = r_refdef.vrectbottom - 1;
+    top = r_refdef.vrect.y;
 
     for (iv = r_refdef.vrect.y; iv < bottom; iv++) {
 	current_iv = iv;
@@ -652,11 +679,14 @@ R_ScanEdges(void)
 	// FIXME - which is correct QW had >, NQ had >= (and QF has >)
 	//if (span_p >= max_span_p) {
 	if (span_p > max_span_p) {
-	    VID_UnlockBuffer();
-	    S_ExtraUpdate();	// don't let sound get messed up if going slow
-	    VID_LockBuffer();
+	    if (!r_concurrentview) {
+		VID_UnlockBuffer();
+		S_ExtraUpdate();	// don't let sound get messed up if going slow
+		VID_LockBuffer();
+	    }
 
-	    D_DrawSurfaces();
+	    D_DrawSurfaces(top, iv + 1);
+	    top = iv + 1;
 
 	    // clear the surface span pointers
 	    for (s = &surfaces[1]; s < surface_p; s++)
@@ -686,5 +716,5 @@ R_ScanEdges(void)
     (*pdrawfunc) ();
 
 // draw whatever's left in the span list
-    D_DrawSurfaces();
+    D_DrawSurfaces(top, iv + 1);
 }
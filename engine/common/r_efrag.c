@@ -30,7 +30,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "r_local.h"
 #endif
 
-mnode_t *r_pefragtopnode;
+VIEWSTATE mnode_t *r_pefragtopnode;
 
 
 //===========================================================================
@@ -46,7 +46,7 @@ mnode_t *r_pefragtopnode;
 static efrag_t **lastlink;
 static entity_t *r_addent;
 
-vec3_t r_emins, r_emaxs;
+VIEWSTATE vec3_t r_emins, r_emaxs;
 
 /*
 ================
@@ -166,7 +166,7 @@ R_SplitEntityOnNode2(mnode_t *node)
 
     if (node->visframe != r_visframecount)
 	return;
-    if (node->clipflags == BMODEL_FULLY_CLIPPED)
+    if (*R_NodeClipFlags(node) == BMODEL_FULLY_CLIPPED)
 	return;
 
     if (node->contents < 0) {
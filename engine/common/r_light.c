@@ -138,7 +138,7 @@ R_PushDlights(void)
 /* --------------------------------------------------------------------------*/
 
 #ifdef GLQUAKE
-vec3_t lightspot;
+VIEWSTATE vec3_t lightspot;
 #endif
 
 __attribute__((noinline))
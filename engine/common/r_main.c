@@ -23,11 +23,13 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "cmd.h"
 #include "console.h"
+#include "d_local.h"
 #include "quakedef.h"
 #include "r_local.h"
 #include "screen.h"
 #include "sound.h"
 #include "sys.h"
+#include "thread.h"
 #include "view.h"
 
 void *colormap;
@@ -38,13 +40,10 @@ qboolean r_recursiveaffinetriangles = true;
 
 int r_pixbytes = 1;
 float r_aliasuvscale = 1.0;
-int r_outofsurfaces;
-int r_outofedges;
+VIEWSTATE int r_outofsurfaces;
+VIEWSTATE int r_outofedges;
 
-static vec3_t viewlightvec;
-static alight_t r_viewlighting = { 128, 192, viewlightvec };
-
-qboolean r_dowarp, r_dowarpold, r_viewchanged;
+VIEWSTATE qboolean r_dowarp, r_dowarpold, r_viewchanged;
 
 int c_surf;
 int r_maxsurfsseen, r_maxedgesseen;
@@ -52,7 +51,7 @@ int r_maxsurfsseen, r_maxedgesseen;
 static int r_cnumsurfs;
 static qboolean r_surfsonstack;
 
-byte *r_warpbuffer;
+VIEWSTATE byte *r_warpbuffer;
 
 static byte *r_stack_start;
 
@@ -61,43 +60,55 @@ entity_t r_worldentity;
 //
 // view origin
 //
-vec3_t vup, base_vup;
-vec3_t vpn, base_vpn;
-vec3_t vright, base_vright;
-vec3_t r_origin;
+VIEWSTATE vec3_t vup, base_vup;
+VIEWSTATE vec3_t vpn, base_vpn;
+VIEWSTATE vec3_t vright, base_vright;
+VIEWSTATE vec3_t r_origin;
 
 //
 // screen size info
 //
-refdef_t r_refdef;
-float xcenter, ycenter;
-float xscale, yscale;
-float xscaleinv, yscaleinv;
-float xscaleshrink, yscaleshrink;
-float aliasxscale, aliasyscale, aliasxcenter, aliasycenter;
+VIEWSTATE refdef_t r_refdef;
+VIEWSTATE float xcenter, ycenter;
+VIEWSTATE float xscale, yscale;
+VIEWSTATE float xscaleinv, yscaleinv;
+VIEWSTATE float xscaleshrink, yscaleshrink;
+VIEWSTATE float aliasxscale, aliasyscale, aliasxcenter, aliasycenter;
 
-int screenwidth;
+VIEWSTATE rendertarget_t *r_target;
+static VIEWSTATE short *r_vidzbuffer;
 
-float pixelAspect;
-static float screenAspect;
-static float verticalFieldOfView;
-static float xOrigin, yOrigin;
+VIEWSTATE float pixelAspect;
+static VIEWSTATE float screenAspect;
+static VIEWSTATE float verticalFieldOfView;
+static VIEWSTATE float xOrigin, yOrigin;
 
-mplane_t screenedge[4];
+VIEWSTATE mplane_t screenedge[4];
 
 //
 // refresh flags
 //
-int r_framecount = 1;		// so frame counts initialized to 0 don't match
+VIEWSTATE int r_framecount = 1;		// so frame counts initialized to 0 don't match
+int r_sceneframe;
 int r_visframecount;
-int r_polycount;
-int r_drawnpolycount;
+
+/*
+ * Views rendered to a target in the same frame (the fisheye plates) share
+ * one origin, so they are one scene: the first view marks the PVS, stores
+ * the static entities and builds the world list, and the others only clip
+ * the world list against their own frustum.  The dynamic lights are pushed
+ * once, just before the first view.  A view on the screen is its own scene.
+ */
+static int r_sceneviews;
+VIEWSTATE qboolean r_concurrentview;
+VIEWSTATE int r_polycount;
+VIEWSTATE int r_drawnpolycount;
 
 mleaf_t *r_viewleaf, *r_oldviewleaf;
 
 texture_t *r_notexture_mip;
 
-float r_aliastransition, r_resfudge;
+VIEWSTATE float r_aliastransition, r_resfudge;
 
 int d_lightstylevalue[256];	// 8.8 fraction of base light value
 
@@ -195,6 +206,22 @@ R_InitTurb(void)
 }
 
 
+/*
+===============
+R_InitClipPlanes
+===============
+*/
+static void
+R_InitClipPlanes(void)
+{
+    view_clipplanes[0].leftedge = true;
+    view_clipplanes[1].rightedge = true;
+    view_clipplanes[1].leftedge = view_clipplanes[2].leftedge =
+	view_clipplanes[3].leftedge = false;
+    view_clipplanes[0].rightedge = view_clipplanes[2].rightedge =
+	view_clipplanes[3].rightedge = false;
+}
+
 /*
 ===============
 R_Init
@@ -209,6 +236,7 @@ R_Init(void)
     r_stack_start = (byte *)&dummy;
 
     R_InitTurb();
+    R_InitSurfaceKernels();
 
     Cmd_AddCommand("timerefresh", R_TimeRefresh_f);
     Cmd_AddCommand("pointfile", R_ReadPointFile_f);
@@ -251,12 +279,7 @@ R_Init(void)
     Cvar_SetValue("r_maxedges", (float)NUMSTACKEDGES);
     Cvar_SetValue("r_maxsurfs", (float)NUMSTACKSURFACES);
 
-    view_clipplanes[0].leftedge = true;
-    view_clipplanes[1].rightedge = true;
-    view_clipplanes[1].leftedge = view_clipplanes[2].leftedge =
-	view_clipplanes[3].leftedge = false;
-    view_clipplanes[0].rightedge = view_clipplanes[2].rightedge =
-	view_clipplanes[3].rightedge = false;
+    R_InitClipPlanes();
 
     r_refdef.xOrigin = XCENTERING;
     r_refdef.yOrigin = YCENTERING;
@@ -292,6 +315,11 @@ R_NewMap(void)
     r_viewleaf = NULL;
     R_ClearParticles();
 
+    r_worldclipflags = Hunk_AllocName(R_NumWorldClipFlags() * sizeof(int),
+				      "clipflags");
+    r_leafkeys = Hunk_AllocName((cl.worldmodel->numleafs + 1) * sizeof(int),
+				"leafkeys");
+
     r_cnumsurfs = r_maxsurfs.value;
 
     if (r_cnumsurfs <= MINSURFACES)
@@ -386,6 +414,26 @@ R_SetVrect(const vrect_t *pvrectin, vrect_t *pvrect, int lineadj)
 }
 
 
+/*
+===============
+R_SetRenderTarget
+
+Redirect rendering into an offscreen buffer, or back to the screen if
+target is NULL. The view is recalculated on the next R_RenderView.
+===============
+*/
+void
+R_SetRenderTarget(rendertarget_t *target)
+{
+    if (target && !r_target)
+	r_vidzbuffer = d_pzbuffer;
+
+    r_target = target;
+    d_pzbuffer = target ? target->zbuffer : r_vidzbuffer;
+    r_viewchanged = true;
+}
+
+
 /*
 ===============
 R_ViewChanged
@@ -399,22 +447,32 @@ R_ViewChanged(vrect_t *pvrect, int lineadj, float aspect)
 {
     int i;
     float res_scale;
+    vrect_t view;		// the whole view, which sets the projection
+    float left, right, top, bottom;
 
     r_viewchanged = true;
 
-    R_SetVrect(pvrect, &r_refdef.vrect, lineadj);
+    if (r_target) {
+	view.x = 0;
+	view.y = 0;
+	view.width = r_target->width;
+	view.height = r_target->height;
+
+	/* clip to the scissor rect, but keep the projection of the full view */
+	if (r_target->scissor.width > 0)
+	    r_refdef.vrect = r_target->scissor;
+	else
+	    r_refdef.vrect = view;
+    } else {
+	R_SetVrect(pvrect, &r_refdef.vrect, lineadj);
+	view = r_refdef.vrect;
+    }
 
     extern qboolean fisheye_enabled;
     if (fisheye_enabled) {
 
-        // Make render size a square
-        int minsize = r_refdef.vrect.width;
-        if (r_refdef.vrect.height < minsize)
-           minsize = r_refdef.vrect.height;
-        r_refdef.vrect.width = r_refdef.vrect.height = minsize;
-
         // set fov
-        extern double fisheye_plate_fov;
+        extern VIEWSTATE double fisheye_plate_fov;
         r_refdef.horizontalFieldOfView = 2.0 * tan(fisheye_plate_fov / 2);
     }
     else {
@@ -447,7 +505,7 @@ R_ViewChanged(vrect_t *pvrect, int lineadj, float aspect)
 	r_refdef.aliasvrect.y + r_refdef.aliasvrect.height;
 
     if (fisheye_enabled) {
-        pixelAspect = (float)r_refdef.vrect.height / r_refdef.vrect.width;
+        pixelAspect = (float)view.height / view.width;
     }
     else {
         pixelAspect = aspect;
@@ -455,7 +513,7 @@ R_ViewChanged(vrect_t *pvrect, int lineadj, float aspect)
     xOrigin = r_refdef.xOrigin;
     yOrigin = r_refdef.yOrigin;
 
-    screenAspect = r_refdef.vrect.width * pixelAspect / r_refdef.vrect.height;
+    screenAspect = view.width * pixelAspect / view.height;
 // 320*200 1.0 pixelAspect = 1.6 screenAspect
 // 320*240 1.0 pixelAspect = 1.3333 screenAspect
 // proper 320*200 pixelAspect = 0.8333333
@@ -468,54 +526,61 @@ R_ViewChanged(vrect_t *pvrect, int lineadj, float aspect)
 // the polygon rasterization will never render in the first row or column
 // but will definately render in the [range] row and column, so adjust the
 // buffer origin to get an exact edge to edge fill
-    xcenter = ((float)r_refdef.vrect.width * XCENTERING) +
-	r_refdef.vrect.x - 0.5;
+    xcenter = ((float)view.width * XCENTERING) + view.x - 0.5;
     aliasxcenter = xcenter * r_aliasuvscale;
-    ycenter = ((float)r_refdef.vrect.height * YCENTERING) +
-	r_refdef.vrect.y - 0.5;
+    ycenter = ((float)view.height * YCENTERING) + view.y - 0.5;
     aliasycenter = ycenter * r_aliasuvscale;
 
-    xscale = r_refdef.vrect.width / r_refdef.horizontalFieldOfView;
+    xscale = view.width / r_refdef.horizontalFieldOfView;
     aliasxscale = xscale * r_aliasuvscale;
     xscaleinv = 1.0 / xscale;
     yscale = xscale * pixelAspect;
     aliasyscale = yscale * r_aliasuvscale;
     yscaleinv = 1.0 / yscale;
-    xscaleshrink =
-	(r_refdef.vrect.width - 6) / r_refdef.horizontalFieldOfView;
+    xscaleshrink = (view.width - 6) / r_refdef.horizontalFieldOfView;
     yscaleshrink = xscaleshrink * pixelAspect;
 
+// distances (at Z = 1.0) from the view center to the edges of vrect
+// (the edges may all be on one side of the center when vrect is a scissor
+// rect, so the normals are written in a form that works for either sign)
+    left = (xOrigin - (float)(r_refdef.vrect.x - view.x) / view.width) *
+	r_refdef.horizontalFieldOfView;
+    right = ((float)(r_refdef.vrect.x + r_refdef.vrect.width - view.x) /
+	     view.width - xOrigin) * r_refdef.horizontalFieldOfView;
+    top = (yOrigin - (float)(r_refdef.vrect.y - view.y) / view.height) *
+	verticalFieldOfView;
+    bottom = ((float)(r_refdef.vrect.y + r_refdef.vrect.height - view.y) /
+	      view.height - yOrigin) * verticalFieldOfView;
+
 // left side clip
-    screenedge[0].normal[0] =
-	-1.0 / (xOrigin * r_refdef.horizontalFieldOfView);
+    screenedge[0].normal[0] = -1;
     screenedge[0].normal[1] = 0;
-    screenedge[0].normal[2] = 1;
+    screenedge[0].normal[2] = left;
     screenedge[0].type = PLANE_ANYZ;
 
 // right side clip
-    screenedge[1].normal[0] =
-	1.0 / ((1.0 - xOrigin) * r_refdef.horizontalFieldOfView);
+    screenedge[1].normal[0] = 1;
     screenedge[1].normal[1] = 0;
-    screenedge[1].normal[2] = 1;
+    screenedge[1].normal[2] = right;
     screenedge[1].type = PLANE_ANYZ;
 
 // top side clip
     screenedge[2].normal[0] = 0;
-    screenedge[2].normal[1] = -1.0 / (yOrigin * verticalFieldOfView);
-    screenedge[2].normal[2] = 1;
+    screenedge[2].normal[1] = -1;
+    screenedge[2].normal[2] = top;
     screenedge[2].type = PLANE_ANYZ;
 
 // bottom side clip
     screenedge[3].normal[0] = 0;
-    screenedge[3].normal[1] = 1.0 / ((1.0 - yOrigin) * verticalFieldOfView);
-    screenedge[3].normal[2] = 1;
+    screenedge[3].normal[1] = 1;
+    screenedge[3].normal[2] = bottom;
     screenedge[3].type = PLANE_ANYZ;
 
     for (i = 0; i < 4; i++)
 	VectorNormalize(screenedge[i].normal);
 
     res_scale =
-	sqrt((double)(r_refdef.vrect.width * r_refdef.vrect.height) /
+	sqrt((double)(view.width * view.height) /
 	     (320.0 * 152.0)) * (2.0 / r_refdef.horizontalFieldOfView);
     r_aliastransition = r_aliastransbase.value * res_scale;
     r_resfudge = r_aliastransadj.value * res_scale;
@@ -589,170 +654,6 @@ R_MarkSurfaces(void)
     }
 }
 
-/*
-=============
-R_CullSurfaces
-=============
-*/
-static void
-R_CullSurfaces(brushmodel_t *brushmodel, vec3_t vieworg)
-{
-    int i, j;
-    int side;
-    mnode_t *node;
-    msurface_t *surf;
-    mplane_t *plane;
-    vec_t dist;
-
-    node = brushmodel->nodes;
-    node->clipflags = 15;
-
-    for (;;) {
-	if (node->visframe != r_visframecount)
-	    goto NodeUp;
-
-	if (node->clipflags) {
-	    /* Clip the node against the frustum */
-	    for (i = 0; i < 4; i++) {
-		if (!(node->clipflags & (1 << i)))
-		    continue;
-		plane = &view_clipplanes[i].plane;
-		side = BoxOnPlaneSide(node->mins, node->maxs, plane);
-		if (side == PSIDE_BACK) {
-		    node->clipflags = BMODEL_FULLY_CLIPPED;
-		    goto NodeUp;
-		}
-		if (side == PSIDE_FRONT)
-		    node->clipflags &= ~(1 << i);
-	    }
-	}
-
-	if (node->contents < 0)
-	    goto NodeUp;
-
-	surf = brushmodel->surfaces + node->firstsurface;
-	for (i = 0; i < node->numsurfaces; i++, surf++) {
-	    /* Clip the surfaces against the frustum */
-	    surf->clipflags = node->clipflags;
-	    for (j = 0; j < 4; j++) {
-		if (!(node->clipflags & (1 << j)))
-		    continue;
-		plane = &view_clipplanes[j].plane;
-		side = BoxOnPlaneSide(surf->mins, surf->maxs, plane);
-		if (side == PSIDE_BACK) {
-		    surf->clipflags = BMODEL_FULLY_CLIPPED;
-		    break;
-		}
-		if (side == PSIDE_FRONT)
-		    surf->clipflags &= ~(1 << j);
-	    }
-	    if (j < 4)
-		continue;
-
-	    /* Cull backward facing surfs */
-	    if (surf->plane->type < 3) {
-		dist = vieworg[surf->plane->type] - surf->plane->dist;
-	    } else {
-		dist = DotProduct(vieworg, surf->plane->normal);
-		dist -= surf->plane->dist;
-	    }
-	    if (surf->flags & SURF_PLANEBACK) {
-		if (dist > -BACKFACE_EPSILON)
-		    surf->clipflags = BMODEL_FULLY_CLIPPED;
-	    } else {
-		if (dist < BACKFACE_EPSILON)
-		    surf->clipflags = BMODEL_FULLY_CLIPPED;
-	    }
-	}
-
-//  DownLeft:
-	/* Don't descend into solid leafs because parent links are broken */
-	if (node->children[0]->contents == CONTENTS_SOLID)
-	    goto DownRight;
-	node->children[0]->clipflags = node->clipflags;
-	node = node->children[0];
-	continue;
-
-    DownRight:
-	/* Don't descent into solid leafs because parent links are broken */
-	if (node->children[1]->contents == CONTENTS_SOLID)
-	    goto NodeUp;
-	node->children[1]->clipflags = node->clipflags;
-	node = node->children[1];
-	continue;
-
-    NodeUp:
-	/* If we just processed the left node, go right */
-	if (node->parent && node == node->parent->children[0]) {
-	    node = node->parent;
-	    goto DownRight;
-	}
-
-	/* If we were on a right branch, backtrack */
-	while (node->parent && node == node->parent->children[1])
-	    node = node->parent;
-
-	/* If we still have a parent, we need to cross to the right */
-	if (node->parent) {
-	    node = node->parent;
-	    goto DownRight;
-	}
-
-	/* If no more parents, we are done */
-	break;
-    }
-}
-
-/*
-=============
-R_CullSubmodelSurfaces
-=============
-*/
-static void
-R_CullSubmodelSurfaces(const brushmodel_t *submodel, const vec3_t vieworg,
-		       int clipflags)
-{
-    int i, j, side;
-    msurface_t *surf;
-    mplane_t *plane;
-    vec_t dist;
-
-    surf = submodel->surfaces + submodel->firstmodelsurface;
-    for (i = 0; i < submodel->nummodelsurfaces; i++, surf++) {
-	/* Clip the surface against the frustum */
-	surf->clipflags = clipflags;
-	for (j = 0; j < 4; j++) {
-	    if (!(surf->clipflags & (1 << j)))
-		continue;
-	    plane = &view_clipplanes[j].plane;
-	    side = BoxOnPlaneSide(surf->mins, surf->maxs, plane);
-	    if (side == PSIDE_BACK) {
-		surf->clipflags = BMODEL_FULLY_CLIPPED;
-		break;
-	    }
-	    if (side == PSIDE_FRONT)
-		surf->clipflags &= ~(1 << j);
-	}
-	if (j < 4)
-	    continue;
-
-	/* Cull backward facing surfs */
-	if (surf->plane->type < 3) {
-	    dist = vieworg[surf->plane->type] - surf->plane->dist;
-	} else {
-	    dist = DotProduct(vieworg, surf->plane->normal);
-	    dist -= surf->plane->dist;
-	}
-	if (surf->flags & SURF_PLANEBACK) {
-	    if (dist > -BACKFACE_EPSILON)
-		surf->clipflags = BMODEL_FULLY_CLIPPED;
-	} else {
-	    if (dist < BACKFACE_EPSILON)
-		surf->clipflags = BMODEL_FULLY_CLIPPED;
-	}
-    }
-}
-
 /*
 =============
 R_DrawEntitiesOnList
@@ -764,6 +665,7 @@ R_DrawEntitiesOnList(void)
     entity_t *e;
     int i, j;
     int lnum;
+    int trivial_accept;
     alight_t lighting;
 
 // FIXME: remove and do real lighting
@@ -810,7 +712,7 @@ R_DrawEntitiesOnList(void)
 
 	    // see if the bounding box lets us trivially reject, also sets
 	    // trivial accept status
-	    if (R_AliasCheckBBox(e)) {
+	    if (R_AliasCheckBBox(e, &trivial_accept)) {
 		j = R_LightPoint(e->origin);
 
 		lighting.ambientlight = j;
@@ -835,7 +737,7 @@ R_DrawEntitiesOnList(void)
 		if (lighting.ambientlight + lighting.shadelight > 192)
 		    lighting.shadelight = 192 - lighting.ambientlight;
 
-		R_AliasDrawModel(e, &lighting);
+		R_AliasDrawModel(e, &lighting, trivial_accept);
 	    }
 	    break;
 
@@ -861,6 +763,7 @@ R_DrawViewModel(void)
     vec3_t dist;
     float add;
     dlight_t *dl;
+    alight_t lighting;
 
 #ifdef NQ_HACK
     if (!r_drawviewmodel.value)
@@ -884,15 +787,12 @@ R_DrawViewModel(void)
     VectorCopy(e->origin, r_entorigin);
     VectorSubtract(r_origin, r_entorigin, modelorg);
 
-    VectorCopy(vup, viewlightvec);
-    VectorInverse(viewlightvec);
-
     j = R_LightPoint(e->origin);
 
     if (j < 24)
 	j = 24;			// always give some light on gun
-    r_viewlighting.ambientlight = j;
-    r_viewlighting.shadelight = j;
+    lighting.ambientlight = j;
+    lighting.shadelight = j;
 
 // add dynamic lights
     for (lnum = 0; lnum < MAX_DLIGHTS; lnum++) {
@@ -907,18 +807,18 @@ R_DrawViewModel(void)
 	VectorSubtract(e->origin, dl->origin, dist);
 	add = dl->radius - Length(dist);
 	if (add > 0)
-	    r_viewlighting.ambientlight += add;
+	    lighting.ambientlight += add;
     }
 
 // clamp lighting so it doesn't overbright as much
-    if (r_viewlighting.ambientlight > 128)
-	r_viewlighting.ambientlight = 128;
-    if (r_viewlighting.ambientlight + r_viewlighting.shadelight > 192)
-	r_viewlighting.shadelight = 192 - r_viewlighting.ambientlight;
+    if (lighting.ambientlight > 128)
+	lighting.ambientlight = 128;
+    if (lighting.ambientlight + lighting.shadelight > 192)
+	lighting.shadelight = 192 - lighting.ambientlight;
 
-    r_viewlighting.plightvec = lightvec;
+    lighting.plightvec = lightvec;
 
-    R_AliasDrawModel(e, &r_viewlighting);
+    R_AliasDrawModel(e, &lighting, 0);
 }
 
 
@@ -970,17 +870,15 @@ static void
 R_DrawBEntitiesOnList(void)
 {
     entity_t *entity;
-    int i, j, clipflags;
+    int i, clipflags;
     vec3_t oldorigin;
     model_t *model;
-    brushmodel_t *brushmodel;
     vec3_t mins, maxs;
 
     if (!r_drawentities.value)
 	return;
 
     VectorCopy(modelorg, oldorigin);
-    r_dlightframecount = r_framecount;
 
     for (i = 0; i < cl_numvisedicts; i++) {
 	entity = &cl_visedicts[i];
@@ -988,7 +886,6 @@ R_DrawBEntitiesOnList(void)
 	    continue;
 
 	model = entity->model;
-	brushmodel = BrushModel(model);
 
 	// see if the bounding box lets us trivially reject, also sets
 	// trivial accept status
@@ -1005,36 +902,22 @@ R_DrawBEntitiesOnList(void)
 	// FIXME: stop transforming twice
 	R_RotateBmodel(entity);
 
-	// calculate dynamic lighting for bmodel if it's not an
-	// instanced model
-	if (brushmodel->firstmodelsurface != 0) {
-	    for (j = 0; j < MAX_DLIGHTS; j++) {
-		if ((cl_dlights[j].die < cl.time) || (!cl_dlights[j].radius))
-		    continue;
-		R_MarkLights(&cl_dlights[j], 1 << j,
-			     brushmodel->nodes + brushmodel->hulls[0].firstclipnode);
-	    }
-	}
-
 	r_pefragtopnode = NULL;
 	VectorCopy(mins, r_emins);
 	VectorCopy(maxs, r_emaxs);
 	R_SplitEntityOnNode2(cl.worldmodel->nodes);
-	R_CullSubmodelSurfaces(brushmodel, modelorg, clipflags);
 
 	if (r_pefragtopnode) {
-	    entity->topnode = r_pefragtopnode;
-
 	    if (r_pefragtopnode->contents >= 0) {
 		// not a leaf; has to be clipped to the world BSP
-		R_DrawSolidClippedSubmodelPolygons(entity);
+		R_DrawSolidClippedSubmodelPolygons(entity, clipflags,
+						   r_pefragtopnode);
 	    } else {
 		// falls entirely in one leaf, so we just put all
 		// the edges in the edge list and let 1/z sorting
 		// handle drawing order
-		R_DrawSubmodelPolygons(entity, clipflags);
+		R_DrawSubmodelPolygons(entity, clipflags, r_pefragtopnode);
 	    }
-	    entity->topnode = NULL;
 	}
 
 	// put back world rotation and frustum clipping
@@ -1100,7 +983,7 @@ R_EdgeDrawing(void)
 	se_time1 = db_time2;
     }
 
-    if (!r_dspeeds.value) {
+    if (!r_dspeeds.value && !r_concurrentview) {
 	VID_UnlockBuffer();
 	S_ExtraUpdate();	// don't let sound get messed up if going slow
 	VID_LockBuffer();
@@ -1110,6 +993,47 @@ R_EdgeDrawing(void)
 }
 
 
+/*
+================
+R_MarkScene
+
+The work done once for all the views of a scene
+================
+*/
+static void
+R_MarkScene(void)
+{
+    entity_t *entity;
+    brushmodel_t *brushmodel;
+    int i, j;
+
+    r_sceneframe = r_framecount;
+    R_MarkSurfaces();		// done here so we know if we're in water
+    R_BuildWorldList();
+
+    if (!r_drawentities.value)
+	return;
+
+    // calculate dynamic lighting for the bmodels that aren't instanced
+    r_dlightframecount = r_sceneframe;
+    for (i = 0; i < cl_numvisedicts; i++) {
+	entity = &cl_visedicts[i];
+	if (entity->model->type != mod_brush)
+	    continue;
+
+	brushmodel = BrushModel(entity->model);
+	if (brushmodel->firstmodelsurface == 0)
+	    continue;
+
+	for (j = 0; j < MAX_DLIGHTS; j++) {
+	    if ((cl_dlights[j].die < cl.time) || (!cl_dlights[j].radius))
+		continue;
+	    R_MarkLights(&cl_dlights[j], 1 << j,
+			 brushmodel->nodes + brushmodel->hulls[0].firstclipnode);
+	}
+    }
+}
+
 /*
 ================
 R_RenderView
@@ -1127,9 +1051,12 @@ R_RenderView_(void)
     if (r_timegraph.value || r_speeds.value || r_dspeeds.value)
 	r_time1 = Sys_DoubleTime();
 
+    if (!r_target)
+	R_BeginScene();
+
     R_SetupFrame();
-    R_MarkSurfaces();		// done here so we know if we're in water
-    R_CullSurfaces(BrushModel(r_worldentity.model), r_refdef.vieworg);
+    if (!r_concurrentview && !r_sceneviews++)
+	R_MarkScene();
 
     // make FDIV fast. This reduces timing precision after we've been running
     // for a while, so we don't do it globally.  This also sets chop mode, and
@@ -1140,7 +1067,7 @@ R_RenderView_(void)
     if (!r_worldentity.model || !cl.worldmodel)
 	Sys_Error("%s: NULL worldmodel", __func__);
 
-    if (!r_dspeeds.value) {
+    if (!r_dspeeds.value && !r_concurrentview) {
 	VID_UnlockBuffer();
 	S_ExtraUpdate();	// don't let sound get messed up if going slow
 	VID_LockBuffer();
@@ -1148,7 +1075,7 @@ R_RenderView_(void)
 
     R_EdgeDrawing();
 
-    if (!r_dspeeds.value) {
+    if (!r_dspeeds.value && !r_concurrentview) {
 	VID_UnlockBuffer();
 	S_ExtraUpdate();	// don't let sound get messed up if going slow
 	VID_LockBuffer();
@@ -1181,7 +1108,8 @@ R_RenderView_(void)
     if (r_dowarp)
 	D_WarpScreen();
 
-    V_SetContentsColor(r_viewleaf->contents);
+    if (!r_concurrentview)
+	V_SetContentsColor(r_viewleaf->contents);
 
     if (r_timegraph.value)
 	R_TimeGraph();
@@ -1213,6 +1141,17 @@ R_RenderView_(void)
     Sys_HighFPPrecision();
 }
 
+/*
+================
+R_BeginScene
+================
+*/
+void
+R_BeginScene(void)
+{
+    r_sceneviews = 0;
+}
+
 void
 R_RenderView(void)
 {
@@ -1229,3 +1168,155 @@ R_RenderView(void)
 
     R_RenderView_();
 }
+
+/*
+ * Views drawn at the same time each get their own edges, surfaces and
+ * world clip flags, kept in a slot for their index so they are only
+ * allocated when they grow.
+ */
+#define MAX_CONCURRENT_VIEWS 8
+
+typedef struct {
+    edge_t *edges;
+    surf_t *surfs;
+    int *clipflags;
+    int *leafkeys;
+    int numedges, numsurfs, numclipflags, numleafkeys;
+} viewslot_t;
+
+static struct {
+    thread_job_t job;
+    void *arg;
+    refdef_t refdef;
+    int frame;
+    viewslot_t slots[MAX_CONCURRENT_VIEWS];
+} r_views;
+
+static void *
+R_GrowViewSlot(void *buffer, int *count, int needed, size_t size)
+{
+    if (needed <= *count)
+	return buffer;
+
+    free(buffer);
+    buffer = malloc(needed * size);
+    if (!buffer)
+	Sys_Error("%s: out of memory", __func__);
+    *count = needed;
+
+    return buffer;
+}
+
+static void
+R_RenderViewJob(void *arg, int index)
+{
+    viewslot_t *slot = &r_views.slots[index];
+    edge_t *oldauxedges = auxedges;
+    surf_t *oldsurfaces = surfaces;
+    surf_t *oldsurf_max = surf_max;
+    int *oldclipflags = r_worldclipflags;
+    int *oldleafkeys = r_leafkeys;
+
+    r_concurrentview = true;
+    r_refdef = r_views.refdef;
+    r_framecount = r_views.frame + index - 1;	// R_SetupFrame advances it
+
+    if (r_numallocatededges > NUMSTACKEDGES)
+	auxedges = slot->edges;
+    if (!r_surfsonstack) {
+	surfaces = slot->surfs - 1;	// see R_NewMap
+	surf_max = &slot->surfs[r_cnumsurfs];
+    }
+    r_worldclipflags = slot->clipflags;
+    r_leafkeys = slot->leafkeys;
+    R_InitClipPlanes();
+
+    r_views.job(r_views.arg, index);
+
+    auxedges = oldauxedges;
+    surfaces = oldsurfaces;
+    surf_max = oldsurf_max;
+    r_worldclipflags = oldclipflags;
+    r_leafkeys = oldleafkeys;
+    r_concurrentview = false;
+}
+
+/*
+================
+R_RenderViews
+
+Run job(arg, index) for count views of one scene on the job pool, each
+calling R_RenderView with its own render target.  The scene is set up here
+first, and the views share the surface cache.  Returns false without
+running anything if the views can't be drawn at the same time.
+================
+*/
+qboolean
+R_RenderViews(thread_job_t job, void *arg, int count)
+{
+    viewslot_t *slot;
+    entity_t *entity;
+    int i;
+
+#ifdef USE_X86_ASM
+    return false;		// the assembly keeps its state in plain globals
+#endif
+    if (!Thread_PoolSize() || count < 2 || count > MAX_CONCURRENT_VIEWS)
+	return false;
+
+    /* these all report on a single view */
+    if (r_speeds.value || r_dspeeds.value || r_timegraph.value
+	|| r_aliasstats.value || r_numsurfs.value || r_numedges.value
+	|| r_reportsurfout.value || r_reportedgeout.value)
+	return false;
+
+    if (!r_worldentity.model || !cl.worldmodel)
+	Sys_Error("%s: NULL worldmodel", __func__);
+
+    R_SetupScene();
+    VectorCopy(r_refdef.vieworg, r_origin);
+    VectorCopy(r_refdef.vieworg, modelorg);
+    r_framecount++;
+    R_MarkScene();
+
+    /* the views can only look these up */
+    if (!r_skymade)
+	R_MakeSky();
+    for (i = 0; i < cl_numvisedicts; i++) {
+	entity = &cl_visedicts[i];
+	if (entity->model->type == mod_alias)
+	    Mod_Extradata(entity->model);
+    }
+    if (cl.viewent.model && cl.viewent.model->type == mod_alias)
+	Mod_Extradata(cl.viewent.model);
+
+    d_roverwrapped = false;
+    d_initial_rover = sc_rover;
+    r_sceneviews = count;
+
+    for (i = 0; i < count; i++) {
+	slot = &r_views.slots[i];
+	if (r_numallocatededges > NUMSTACKEDGES)
+	    slot->edges = R_GrowViewSlot(slot->edges, &slot->numedges,
+					 r_numallocatededges, sizeof(edge_t));
+	if (!r_surfsonstack)
+	    slot->surfs = R_GrowViewSlot(slot->surfs, &slot->numsurfs,
+					 r_cnumsurfs, sizeof(surf_t));
+	slot->clipflags = R_GrowViewSlot(slot->clipflags, &slot->numclipflags,
+					 R_NumWorldClipFlags(), sizeof(int));
+	slot->leafkeys = R_GrowViewSlot(slot->leafkeys, &slot->numleafkeys,
+					cl.worldmodel->numleafs + 1,
+					sizeof(int));
+    }
+
+    r_views.job = job;
+    r_views.arg = arg;
+    r_views.refdef = r_refdef;
+    r_views.frame = r_framecount;
+    Thread_RunJobs(R_RenderViewJob, NULL, count);
+
+    r_framecount = r_views.frame + count - 1;
+    V_SetContentsColor(r_viewleaf->contents);
+
+    return true;
+}
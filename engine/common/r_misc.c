@@ -415,16 +415,14 @@ R_TransformPlane(mplane_t *p, float *normal, float *dist)
 
 /*
 ===============
-R_SetupFrame
+R_SetupScene
+
+The part of the frame setup that is shared by all the views of a scene
 ===============
 */
 void
-R_SetupFrame(void)
+R_SetupScene(void)
 {
-    int edgecount;
-    vrect_t vrect;
-    float w, h;
-
 // don't allow cheats in multiplayer
 #ifdef NQ_HACK
     if (cl.maxclients > 1) {
@@ -441,6 +439,43 @@ R_SetupFrame(void)
     r_drawflat.value = 0;
 #endif
 
+#ifdef NQ_HACK
+    if (!sv.active)
+	r_draworder.value = 0;	// don't let cheaters look behind walls
+#endif
+#ifdef QW_HACK
+    r_draworder.value = 0;	// don't let cheaters look behind walls
+#endif
+
+    R_CheckVariables();
+
+    R_AnimateLight();
+
+// current viewleaf
+    r_oldviewleaf = r_viewleaf;
+    r_viewleaf = Mod_PointInLeaf(cl.worldmodel, r_refdef.vieworg);
+
+    R_SetSkyFrame();
+
+    r_cache_thrash = false;
+}
+
+/*
+===============
+R_SetupFrame
+===============
+*/
+void
+R_SetupFrame(void)
+{
+    int edgecount;
+    vrect_t vrect;
+    float w, h;
+
+    /* R_RenderViews sets up the scene for the views it draws */
+    if (!r_concurrentview)
+	R_SetupScene();
+
     if (r_numsurfs.value) {
 	if ((surface_p - surfaces) > r_maxsurfsseen)
 	    r_maxsurfsseen = surface_p - surfaces;
@@ -465,18 +500,6 @@ R_SetupFrame(void)
     if (r_refdef.ambientlight < 0)
 	r_refdef.ambientlight = 0;
 
-#ifdef NQ_HACK
-    if (!sv.active)
-	r_draworder.value = 0;	// don't let cheaters look behind walls
-#endif
-#ifdef QW_HACK
-    r_draworder.value = 0;	// don't let cheaters look behind walls
-#endif
-
-    R_CheckVariables();
-
-    R_AnimateLight();
-
     r_framecount++;
 
 // debugging
@@ -503,12 +526,8 @@ R_SetupFrame(void)
         AngleVectors(r_refdef.viewangles, vpn, vright, vup);
     }
 
-// current viewleaf
-    r_oldviewleaf = r_viewleaf;
-    r_viewleaf = Mod_PointInLeaf(cl.worldmodel, r_origin);
-
     r_dowarpold = r_dowarp;
-    if (fisheye_enabled) {
+    if (fisheye_enabled || r_target) {
         r_dowarp = 0;
     }
     else {
@@ -570,10 +589,6 @@ R_SetupFrame(void)
     VectorCopy(vup, base_vup);
     VectorCopy(modelorg, base_modelorg);
 
-    R_SetSkyFrame();
-
-    r_cache_thrash = false;
-
 // clear frame counts
     c_faceclip = 0;
     r_polycount = 0;
@@ -46,7 +46,7 @@ particle_t *active_particles, *free_particles;
 particle_t *particles;
 int r_numparticles;
 
-vec3_t r_pright, r_pup, r_ppn;
+VIEWSTATE vec3_t r_pright, r_pup, r_ppn;
 
 
 /*
@@ -25,11 +25,11 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "r_local.h"
 #include "sys.h"
 
-static int clip_current;
-static vec5_t clip_verts[2][MAXWORKINGVERTS];
-static int sprite_width, sprite_height;
+static VIEWSTATE int clip_current;
+static VIEWSTATE vec5_t clip_verts[2][MAXWORKINGVERTS];
+static VIEWSTATE int sprite_width, sprite_height;
 
-spritedesc_t r_spritedesc;
+VIEWSTATE spritedesc_t r_spritedesc;
 
 int
 R_SpriteDataSize(int pixels)
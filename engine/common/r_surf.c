@@ -19,26 +19,39 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 // r_surf.c: surface-related refresh code
 
+#include <stdlib.h>
+#include <string.h>
+
+#include "cmd.h"
+#include "console.h"
 #include "quakedef.h"
 #include "r_local.h"
 #include "sys.h"
 
-drawsurf_t r_drawsurf;
+// vector versions of the lightmap and block kernels (selected at runtime)
+#if !defined(USE_X86_ASM) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SURF_SIMD
+#include <immintrin.h>
+#endif
+
+SPANSTATE drawsurf_t r_drawsurf;
 
-int lightleft, sourcesstep, blocksize, sourcetstep;
-int lightdelta, lightdeltastep;
-int lightright, lightleftstep, lightrightstep, blockdivshift;
-unsigned blockdivmask;
-void *prowdestbase;
-unsigned char *pbasesource;
-int surfrowbytes;		// used by ASM files
-unsigned *r_lightptr;
-int r_stepback;
-int r_lightwidth;
-unsigned char *r_source, *r_sourcemax;
+SPANSTATE int lightleft, sourcesstep, blocksize, sourcetstep;
+SPANSTATE int lightdelta, lightdeltastep;
+SPANSTATE int lightright, lightleftstep, lightrightstep, blockdivshift;
+SPANSTATE unsigned blockdivmask;
+SPANSTATE void *prowdestbase;
+SPANSTATE unsigned char *pbasesource;
+SPANSTATE int surfrowbytes;	// used by ASM files
+SPANSTATE unsigned *r_lightptr;
+SPANSTATE int r_stepback;
+SPANSTATE int r_lightwidth;
+SPANSTATE unsigned char *r_source, *r_sourcemax;
 
-static int r_numhblocks;
-int r_numvblocks;
+static SPANSTATE int r_numhblocks;
+SPANSTATE int r_numvblocks;
 
 #ifndef USE_X86_ASM
 void R_DrawSurfaceBlock8_mip0(void);
@@ -47,14 +60,45 @@ void R_DrawSurfaceBlock8_mip2(void);
 void R_DrawSurfaceBlock8_mip3(void);
 #endif
 
-static void (*surfmiptable[4]) (void) = {
-    R_DrawSurfaceBlock8_mip0,
-    R_DrawSurfaceBlock8_mip1,
-    R_DrawSurfaceBlock8_mip2,
-    R_DrawSurfaceBlock8_mip3
+static SPANSTATE unsigned blocklights[18 * 18];
+
+/*
+ * The inner loops of the surface builder, in C or with vector instructions.
+ * The vector versions must give exactly the same results as the C ones,
+ * which is checked when they are selected (see R_InitSurfaceKernels).
+ */
+typedef struct {
+    const char *name;
+    void (*addlightmap)(unsigned *dest, const byte *lightmap,
+			unsigned scale, int size);
+    void (*finishlightmap)(unsigned *dest, int size);
+    void (*drawblock[4])(void);
+} surfkernels_t;
+
+static void R_AddLightmap(unsigned *dest, const byte *lightmap,
+			  unsigned scale, int size);
+static void R_FinishLightmap(unsigned *dest, int size);
+
+static const surfkernels_t surfkernels_c = {
+    "C",
+    R_AddLightmap,
+    R_FinishLightmap,
+    {
+	R_DrawSurfaceBlock8_mip0,
+	R_DrawSurfaceBlock8_mip1,
+	R_DrawSurfaceBlock8_mip2,
+	R_DrawSurfaceBlock8_mip3
+    }
 };
 
-static unsigned blocklights[18 * 18];
+static const surfkernels_t *surfkernels_simd = &surfkernels_c;
+static cvar_t r_surfsimd = { "r_surfsimd", "1" };
+
+static const surfkernels_t *
+R_SurfaceKernels(void)
+{
+    return r_surfsimd.value ? surfkernels_simd : &surfkernels_c;
+}
 
 /*
 ===============
@@ -133,14 +177,15 @@ static void
 R_BuildLightMap(void)
 {
     int smax, tmax;
-    int t;
     int i, size;
     byte *lightmap;
     unsigned scale;
     int maps;
     msurface_t *surf;
+    const surfkernels_t *kernels;
 
     surf = r_drawsurf.surf;
+    kernels = R_SurfaceKernels();
 
     smax = (surf->extents[0] >> 4) + 1;
     tmax = (surf->extents[1] >> 4) + 1;
@@ -154,7 +199,7 @@ R_BuildLightMap(void)
     }
 // clear to ambient
     for (i = 0; i < size; i++)
-	blocklights[i] = r_refdef.ambientlight << 8;
+	blocklights[i] = r_drawsurf.ambientlight << 8;
 
 
 // add all the lightmaps
@@ -162,22 +207,38 @@ R_BuildLightMap(void)
 	for (maps = 0; maps < MAXLIGHTMAPS && surf->styles[maps] != 255;
 	     maps++) {
 	    scale = r_drawsurf.lightadj[maps];	// 8.8 fraction
-	    for (i = 0; i < size; i++)
-		blocklights[i] += lightmap[i] * scale;
+	    kernels->addlightmap(blocklights, lightmap, scale, size);
 	    lightmap += size;	// skip to next lightmap
 	}
 // add all the dynamic lights
-    if (surf->dlightframe == r_framecount)
+    if (surf->dlightframe == r_sceneframe)
 	R_AddDynamicLights();
 
 // bound, invert, and shift
+    kernels->finishlightmap(blocklights, size);
+}
+
+static void
+R_AddLightmap(unsigned *dest, const byte *lightmap, unsigned scale, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+	dest[i] += lightmap[i] * scale;
+}
+
+static void
+R_FinishLightmap(unsigned *dest, int size)
+{
+    int i, t;
+
     for (i = 0; i < size; i++) {
-	t = (255 * 256 - (int)blocklights[i]) >> (8 - VID_CBITS);
+	t = (255 * 256 - (int)dest[i]) >> (8 - VID_CBITS);
 
 	if (t < (1 << 6))
 	    t = (1 << 6);
 
-	blocklights[i] = t;
+	dest[i] = t;
     }
 }
 
@@ -261,7 +322,7 @@ R_DrawSurface(void)
 //==============================
 
     if (r_pixbytes == 1) {
-	pblockdrawer = surfmiptable[r_drawsurf.surfmip];
+	pblockdrawer = R_SurfaceKernels()->drawblock[r_drawsurf.surfmip];
 	// TODO: only needs to be set when there is a display settings change
 	horzblockstep = blocksize;
     } else {
@@ -550,6 +611,423 @@ R_DrawSurfaceBlock16(void)
 
 #endif
 
+//============================================================================
+
+#ifdef SURF_SIMD
+
+static void
+R_AddLightmapFallback(unsigned *dest, const byte *lightmap, unsigned scale,
+		      int size, int done)
+{
+    for (; done < size; done++)
+	dest[done] += lightmap[done] * scale;
+}
+
+/*
+ * SSE2 has no 32 bit multiply, so the lightmap is scaled with a 16 bit
+ * multiply-add, which is exact while the scale fits in 15 bits (lightstyle
+ * scales are at most a few hundred).
+ */
+__attribute__((target("sse2")))
+static void
+R_AddLightmap_SSE2(unsigned *dest, const byte *lightmap, unsigned scale,
+		   int size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vscale = _mm_set1_epi32(scale);
+    __m128i words, lo, hi;
+    int i = 0;
+
+    if (scale <= 0x7fff) {
+	for (; i + 8 <= size; i += 8) {
+	    words = _mm_loadl_epi64((const __m128i *)(lightmap + i));
+	    words = _mm_unpacklo_epi8(words, zero);
+	    lo = _mm_madd_epi16(_mm_unpacklo_epi16(words, zero), vscale);
+	    hi = _mm_madd_epi16(_mm_unpackhi_epi16(words, zero), vscale);
+	    lo = _mm_add_epi32(_mm_loadu_si128((__m128i *)(dest + i)), lo);
+	    hi = _mm_add_epi32(_mm_loadu_si128((__m128i *)(dest + i + 4)), hi);
+	    _mm_storeu_si128((__m128i *)(dest + i), lo);
+	    _mm_storeu_si128((__m128i *)(dest + i + 4), hi);
+	}
+    }
+    R_AddLightmapFallback(dest, lightmap, scale, size, i);
+}
+
+__attribute__((target("sse2")))
+static void
+R_FinishLightmap_SSE2(unsigned *dest, int size)
+{
+    const __m128i full = _mm_set1_epi32(255 * 256);
+    const __m128i minlight = _mm_set1_epi32(1 << 6);
+    __m128i t, low;
+    int i;
+
+    for (i = 0; i + 4 <= size; i += 4) {
+	t = _mm_sub_epi32(full, _mm_loadu_si128((__m128i *)(dest + i)));
+	t = _mm_srai_epi32(t, 8 - VID_CBITS);
+	low = _mm_cmplt_epi32(t, minlight);
+	t = _mm_or_si128(_mm_andnot_si128(low, t), _mm_and_si128(low, minlight));
+	_mm_storeu_si128((__m128i *)(dest + i), t);
+    }
+    R_FinishLightmap(dest + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static void
+R_AddLightmap_AVX2(unsigned *dest, const byte *lightmap, unsigned scale,
+		   int size)
+{
+    const __m256i vscale = _mm256_set1_epi32(scale);
+    __m256i light;
+    int i;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+	light = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(lightmap + i)));
+	light = _mm256_mullo_epi32(light, vscale);
+	light = _mm256_add_epi32(_mm256_loadu_si256((__m256i *)(dest + i)), light);
+	_mm256_storeu_si256((__m256i *)(dest + i), light);
+    }
+    R_AddLightmapFallback(dest, lightmap, scale, size, i);
+}
+
+__attribute__((target("avx2")))
+static void
+R_FinishLightmap_AVX2(unsigned *dest, int size)
+{
+    const __m256i full = _mm256_set1_epi32(255 * 256);
+    const __m256i minlight = _mm256_set1_epi32(1 << 6);
+    __m256i t;
+    int i;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+	t = _mm256_sub_epi32(full, _mm256_loadu_si256((__m256i *)(dest + i)));
+	t = _mm256_srai_epi32(t, 8 - VID_CBITS);
+	t = _mm256_max_epi32(t, minlight);
+	_mm256_storeu_si256((__m256i *)(dest + i), t);
+    }
+    R_FinishLightmap(dest + i, size - i);
+}
+
+/*
+ * The block drawers look up 8 texels at a time in the colormap with a
+ * gather.  A gather reads 4 bytes at each offset and only the low byte is
+ * kept, so it reads from a copy of the colormap padded to cover every
+ * offset the lookup can make.
+ */
+#define GATHER_COLORMAP_SIZE	(0x10000 + 4)
+static byte *gathercolormap;
+
+__attribute__((target("avx2")))
+static inline void
+R_DrawBlockRow8_AVX2(byte *prowdest, const byte *psource, int light,
+		     int lightstep, __m256i ramp)
+{
+    const __m256i lowbytes = _mm256_setr_epi8(
+	0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m256i lights, index, texels;
+    unsigned lo, hi;
+
+    // pixel b gets the light after (n - 1 - b) steps, as in the C loop
+    lights = _mm256_mullo_epi32(ramp, _mm256_set1_epi32(lightstep));
+    lights = _mm256_add_epi32(lights, _mm256_set1_epi32(light));
+    index = _mm256_and_si256(lights, _mm256_set1_epi32(0xFF00));
+    texels = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)psource));
+    index = _mm256_add_epi32(index, texels);
+
+    texels = _mm256_i32gather_epi32((const int *)gathercolormap, index, 1);
+    texels = _mm256_shuffle_epi8(texels, lowbytes);
+    lo = _mm256_extract_epi32(texels, 0);
+    hi = _mm256_extract_epi32(texels, 4);
+    memcpy(prowdest, &lo, 4);
+    memcpy(prowdest + 4, &hi, 4);
+}
+
+__attribute__((target("avx2")))
+static void
+R_DrawSurfaceBlock8_mip0_AVX2(void)
+{
+    const __m256i ramp0 = _mm256_setr_epi32(15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i ramp1 = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    int v, i, left, right, leftstep, rightstep, lightstep;
+    unsigned char *psource, *prowdest;
+
+    psource = pbasesource;
+    prowdest = prowdestbase;
+
+    for (v = 0; v < r_numvblocks; v++) {
+	left = r_lightptr[0];
+	right = r_lightptr[1];
+	r_lightptr += r_lightwidth;
+	leftstep = (r_lightptr[0] - left) >> 4;
+	rightstep = (r_lightptr[1] - right) >> 4;
+
+	for (i = 0; i < 16; i++) {
+	    lightstep = (left - right) >> 4;
+	    R_DrawBlockRow8_AVX2(prowdest, psource, right, lightstep, ramp0);
+	    R_DrawBlockRow8_AVX2(prowdest + 8, psource + 8, right, lightstep,
+				 ramp1);
+
+	    psource += sourcetstep;
+	    right += rightstep;
+	    left += leftstep;
+	    prowdest += surfrowbytes;
+	}
+
+	if (psource >= r_sourcemax)
+	    psource -= r_stepback;
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+R_DrawSurfaceBlock8_mip1_AVX2(void)
+{
+    const __m256i ramp = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    int v, i, left, right, leftstep, rightstep, lightstep;
+    unsigned char *psource, *prowdest;
+
+    psource = pbasesource;
+    prowdest = prowdestbase;
+
+    for (v = 0; v < r_numvblocks; v++) {
+	left = r_lightptr[0];
+	right = r_lightptr[1];
+	r_lightptr += r_lightwidth;
+	leftstep = (r_lightptr[0] - left) >> 3;
+	rightstep = (r_lightptr[1] - right) >> 3;
+
+	for (i = 0; i < 8; i++) {
+	    lightstep = (left - right) >> 3;
+	    R_DrawBlockRow8_AVX2(prowdest, psource, right, lightstep, ramp);
+
+	    psource += sourcetstep;
+	    right += rightstep;
+	    left += leftstep;
+	    prowdest += surfrowbytes;
+	}
+
+	if (psource >= r_sourcemax)
+	    psource -= r_stepback;
+    }
+}
+
+/*
+ * SSE2 has no gather, so the block drawers stay in C; the mip 2 and 3
+ * blocks (4 and 2 texels wide) are too narrow to gain from vectors.
+ */
+static const surfkernels_t surfkernels_sse2 = {
+    "SSE2",
+    R_AddLightmap_SSE2,
+    R_FinishLightmap_SSE2,
+    {
+	R_DrawSurfaceBlock8_mip0,
+	R_DrawSurfaceBlock8_mip1,
+	R_DrawSurfaceBlock8_mip2,
+	R_DrawSurfaceBlock8_mip3
+    }
+};
+
+static const surfkernels_t surfkernels_avx2 = {
+    "AVX2",
+    R_AddLightmap_AVX2,
+    R_FinishLightmap_AVX2,
+    {
+	R_DrawSurfaceBlock8_mip0_AVX2,
+	R_DrawSurfaceBlock8_mip1_AVX2,
+	R_DrawSurfaceBlock8_mip2,
+	R_DrawSurfaceBlock8_mip3
+    }
+};
+
+#endif /* SURF_SIMD */
+
+/*
+ * Bit exact check of a set of kernels against the C ones, on random input
+ */
+static unsigned
+R_KernelTestRandom(unsigned *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static qboolean
+R_TestLightmapKernels(const surfkernels_t *kernels)
+{
+    unsigned expected[18 * 18], result[18 * 18];
+    byte lightmap[18 * 18];
+    unsigned seed, scale;
+    int trial, i, size;
+
+    seed = 1;
+    for (trial = 0; trial < 256; trial++) {
+	size = 1 + R_KernelTestRandom(&seed) % (18 * 18);
+	scale = R_KernelTestRandom(&seed);
+	if (trial & 1)
+	    scale %= 1024;
+	for (i = 0; i < size; i++) {
+	    lightmap[i] = R_KernelTestRandom(&seed);
+	    expected[i] = result[i] = R_KernelTestRandom(&seed) % 0x10000;
+	}
+	R_AddLightmap(expected, lightmap, scale, size);
+	kernels->addlightmap(result, lightmap, scale, size);
+	if (memcmp(expected, result, size * sizeof(unsigned)))
+	    return false;
+
+	// around the clamp as well as the whole range a lightmap can reach
+	for (i = 0; i < size; i++) {
+	    if (trial & 1)
+		expected[i] = 255 * 256 - 512 + R_KernelTestRandom(&seed) % 1024;
+	    else
+		expected[i] = R_KernelTestRandom(&seed) % (1 << 24);
+	    result[i] = expected[i];
+	}
+	R_FinishLightmap(expected, size);
+	kernels->finishlightmap(result, size);
+	if (memcmp(expected, result, size * sizeof(unsigned)))
+	    return false;
+    }
+
+    return true;
+}
+
+static void
+R_RunBlockKernel(void (*drawblock)(void), int mip, byte *texture,
+		 unsigned *lights, byte *dest)
+{
+    r_numvblocks = 2;
+    r_lightwidth = 2;
+    r_lightptr = lights;
+    sourcetstep = 64;
+    r_sourcemax = texture + 64 * 64;
+    r_stepback = 64 * 64;
+    surfrowbytes = 16 >> mip;
+    pbasesource = texture;
+    prowdestbase = dest;
+    drawblock();
+}
+
+static qboolean
+R_TestBlockKernels(const surfkernels_t *kernels)
+{
+    byte texture[64 * 64], expected[16 * 32], result[16 * 32];
+    unsigned lights[2 * 3];
+    unsigned seed;
+    int trial, mip, i;
+
+    seed = 2;
+    for (trial = 0; trial < 64; trial++) {
+	for (i = 0; i < 64 * 64; i++)
+	    texture[i] = R_KernelTestRandom(&seed);
+	for (i = 0; i < 2 * 3; i++)
+	    lights[i] = (1 << 6) + R_KernelTestRandom(&seed) % (255 * 64 - 64);
+
+	for (mip = 0; mip < 4; mip++) {
+	    if (kernels->drawblock[mip] == surfkernels_c.drawblock[mip])
+		continue;
+	    memset(expected, 0, sizeof(expected));
+	    memset(result, 0, sizeof(result));
+	    R_RunBlockKernel(surfkernels_c.drawblock[mip], mip, texture,
+			     lights, expected);
+	    R_RunBlockKernel(kernels->drawblock[mip], mip, texture, lights,
+			     result);
+	    if (memcmp(expected, result, sizeof(expected)))
+		return false;
+	}
+    }
+
+    return true;
+}
+
+static qboolean
+R_TestSurfaceKernels(const surfkernels_t *kernels)
+{
+    unsigned *lightptr;
+    qboolean lightmaps, blocks;
+
+    /* the test borrows the block drawer state */
+    lightptr = r_lightptr;
+    lightmaps = R_TestLightmapKernels(kernels);
+    blocks = R_TestBlockKernels(kernels);
+    r_lightptr = lightptr;
+
+    Con_DPrintf("%s surface kernels: lightmaps %s, blocks %s\n",
+		kernels->name, lightmaps ? "ok" : "MISMATCH",
+		blocks ? "ok" : "MISMATCH");
+
+    return lightmaps && blocks;
+}
+
+/*
+ * Supported vector kernels, best first
+ */
+static int
+R_SupportedSurfaceKernels(const surfkernels_t **list)
+{
+    int count = 0;
+
+#ifdef SURF_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && gathercolormap)
+	list[count++] = &surfkernels_avx2;
+    if (__builtin_cpu_supports("sse2"))
+	list[count++] = &surfkernels_sse2;
+#endif
+
+    return count;
+}
+
+static void
+R_SurfSimdTest_f(void)
+{
+    const surfkernels_t *list[2];
+    int i, count;
+
+    count = R_SupportedSurfaceKernels(list);
+    if (!count)
+	Con_Printf("No vector surface kernels for this cpu/build\n");
+    for (i = 0; i < count; i++) {
+	Con_Printf("%s surface kernels: %s\n", list[i]->name,
+		   R_TestSurfaceKernels(list[i]) ? "match the C code"
+		   : "DO NOT match the C code");
+    }
+    Con_Printf("Using %s surface kernels\n", R_SurfaceKernels()->name);
+}
+
+/*
+================
+R_InitSurfaceKernels
+
+Pick the best vector kernels that give the same results as the C ones
+================
+*/
+void
+R_InitSurfaceKernels(void)
+{
+    const surfkernels_t *list[2];
+    int i, count;
+
+    Cvar_RegisterVariable(&r_surfsimd);
+    Cmd_AddCommand("r_surfsimdtest", R_SurfSimdTest_f);
+
+#ifdef SURF_SIMD
+    gathercolormap = calloc(1, GATHER_COLORMAP_SIZE);
+    if (gathercolormap)
+	memcpy(gathercolormap, vid.colormap, VID_GRADES * 256);
+#endif
+
+    count = R_SupportedSurfaceKernels(list);
+    for (i = 0; i < count; i++) {
+	if (R_TestSurfaceKernels(list[i])) {
+	    surfkernels_simd = list[i];
+	    break;
+	}
+	Con_Printf("%s surface kernels don't match the C code, "
+		   "not using them\n", list[i]->name);
+    }
+}
+
 
 //============================================================================
 
@@ -20,6 +20,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 // r_vars.c: global refresh variables
 
 #include	"quakedef.h"
+#include	"render.h"
 
 #ifndef USE_X86_ASM
 
@@ -33,6 +34,6 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 // FIXME: make into one big structure, like cl or sv
 // FIXME: do separately for refresh engine and driver
 
-int r_bmodelactive;
+VIEWSTATE int r_bmodelactive;
 
 #endif /* USE_X86_ASM */
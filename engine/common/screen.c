@@ -25,6 +25,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "common.h"
 #include "console.h"
 #include "draw.h"
+#include "fisheye.h"
 #include "keys.h"
 #include "menu.h"
 #include "quakedef.h"
@@ -1406,6 +1407,9 @@ SCR_UpdateScreen(void)
 	SCR_DrawRam();
 	SCR_DrawNet();
 	SCR_DrawFPS();
+#ifdef NQ_HACK
+	F_DrawStats();
+#endif
 	SCR_DrawTurtle();
 	SCR_DrawPause();
 	SCR_DrawCenterString();
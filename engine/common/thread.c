@@ -0,0 +1,358 @@
+/*
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+
+#ifdef _WIN32
+/* condition variables need Vista or later */
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include "thread.h"
+
+struct thread_s {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    thread_func_t func;
+    void *arg;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI
+Thread_Start(LPVOID param)
+{
+    thread_t *thread = param;
+
+    thread->func(thread->arg);
+    return 0;
+}
+#else
+static void *
+Thread_Start(void *param)
+{
+    thread_t *thread = param;
+
+    thread->func(thread->arg);
+    return NULL;
+}
+#endif
+
+thread_t *
+Thread_Create(thread_func_t func, void *arg)
+{
+    thread_t *thread;
+
+    thread = malloc(sizeof(*thread));
+    if (!thread)
+	return NULL;
+
+    thread->func = func;
+    thread->arg = arg;
+
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, Thread_Start, thread, 0, NULL);
+    if (!thread->handle) {
+	free(thread);
+	return NULL;
+    }
+#else
+    if (pthread_create(&thread->handle, NULL, Thread_Start, thread)) {
+	free(thread);
+	return NULL;
+    }
+#endif
+
+    return thread;
+}
+
+void
+Thread_Join(thread_t *thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+    free(thread);
+}
+
+int
+Thread_NumCPUs(void)
+{
+    int count;
+
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    count = info.dwNumberOfProcessors;
+#else
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    return count > 0 ? count : 1;
+}
+
+struct thread_mutex_s {
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+};
+
+thread_mutex_t *
+Thread_CreateMutex(void)
+{
+    thread_mutex_t *mutex;
+
+    mutex = malloc(sizeof(*mutex));
+    if (!mutex)
+	return NULL;
+
+#ifdef _WIN32
+    InitializeCriticalSection(&mutex->lock);
+#else
+    if (pthread_mutex_init(&mutex->lock, NULL)) {
+	free(mutex);
+	return NULL;
+    }
+#endif
+
+    return mutex;
+}
+
+void
+Thread_DestroyMutex(thread_mutex_t *mutex)
+{
+#ifdef _WIN32
+    DeleteCriticalSection(&mutex->lock);
+#else
+    pthread_mutex_destroy(&mutex->lock);
+#endif
+    free(mutex);
+}
+
+void
+Thread_LockMutex(thread_mutex_t *mutex)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&mutex->lock);
+#else
+    pthread_mutex_lock(&mutex->lock);
+#endif
+}
+
+void
+Thread_UnlockMutex(thread_mutex_t *mutex)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&mutex->lock);
+#else
+    pthread_mutex_unlock(&mutex->lock);
+#endif
+}
+
+void
+Thread_Yield(void)
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Job pool
+ * ---------------------------------------------------------------------------
+ */
+
+#define MAX_POOL_THREADS 32
+
+static struct {
+    qboolean initialized;
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE wake;
+    CONDITION_VARIABLE done;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+#endif
+    int count;
+    thread_t *threads[MAX_POOL_THREADS];
+
+    /* the current batch of jobs (changed under the lock) */
+    unsigned int generation;
+    unsigned int startgeneration;
+    qboolean quit;
+    thread_job_t job;
+    void *arg;
+    int numjobs;
+    int busy;
+
+    /* next job index to run (taken with Thread_AtomicAdd) */
+    volatile int nextjob;
+} pool;
+
+#ifdef _WIN32
+#define Pool_Lock()		EnterCriticalSection(&pool.lock)
+#define Pool_Unlock()		LeaveCriticalSection(&pool.lock)
+#define Pool_Wait(cond)		SleepConditionVariableCS(&(cond), &pool.lock, INFINITE)
+#define Pool_Signal(cond)	WakeConditionVariable(&(cond))
+#define Pool_Broadcast(cond)	WakeAllConditionVariable(&(cond))
+#else
+#define Pool_Lock()		pthread_mutex_lock(&pool.lock)
+#define Pool_Unlock()		pthread_mutex_unlock(&pool.lock)
+#define Pool_Wait(cond)		pthread_cond_wait(&(cond), &pool.lock)
+#define Pool_Signal(cond)	pthread_cond_signal(&(cond))
+#define Pool_Broadcast(cond)	pthread_cond_broadcast(&(cond))
+#endif
+
+static void
+Pool_RunBatch(void)
+{
+    int index;
+
+    while ((index = Thread_AtomicAdd(&pool.nextjob, 1)) < pool.numjobs)
+	pool.job(pool.arg, index);
+}
+
+static void
+Pool_Main(void *arg)
+{
+    unsigned int generation;
+
+    /* (pool.generation may already be ahead by the time we get the lock) */
+    generation = pool.startgeneration;
+
+    Pool_Lock();
+    for (;;) {
+	while (pool.generation == generation && !pool.quit)
+	    Pool_Wait(pool.wake);
+	if (pool.quit)
+	    break;
+	generation = pool.generation;
+
+	Pool_Unlock();
+	Pool_RunBatch();
+	Pool_Lock();
+
+	if (--pool.busy == 0)
+	    Pool_Signal(pool.done);
+    }
+    Pool_Unlock();
+}
+
+void
+Thread_RunJobs(thread_job_t job, void *arg, int count)
+{
+    int index;
+
+    if (count <= 0)
+	return;
+
+    /* nothing to share the work with */
+    if (!pool.count || count == 1) {
+	for (index = 0; index < count; index++)
+	    job(arg, index);
+	return;
+    }
+
+    Pool_Lock();
+    pool.job = job;
+    pool.arg = arg;
+    pool.numjobs = count;
+    pool.nextjob = 0;
+    pool.busy = pool.count;
+    pool.generation++;
+    Pool_Broadcast(pool.wake);
+    Pool_Unlock();
+
+    Pool_RunBatch();
+
+    Pool_Lock();
+    while (pool.busy)
+	Pool_Wait(pool.done);
+    Pool_Unlock();
+}
+
+void
+Thread_SetPoolSize(int count)
+{
+    int i;
+
+    if (count < 0)
+	count = 0;
+    if (count > MAX_POOL_THREADS)
+	count = MAX_POOL_THREADS;
+    if (count == pool.count)
+	return;
+
+    if (!pool.initialized) {
+#ifdef _WIN32
+	InitializeCriticalSection(&pool.lock);
+	InitializeConditionVariable(&pool.wake);
+	InitializeConditionVariable(&pool.done);
+#else
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	pthread_cond_init(&pool.done, NULL);
+#endif
+	pool.initialized = true;
+    }
+
+    /* stop the old threads */
+    Pool_Lock();
+    pool.quit = true;
+    Pool_Broadcast(pool.wake);
+    Pool_Unlock();
+    for (i = 0; i < pool.count; i++)
+	Thread_Join(pool.threads[i]);
+    pool.count = 0;
+    pool.quit = false;
+
+    /* start the new ones */
+    pool.startgeneration = pool.generation;
+    for (i = 0; i < count; i++) {
+	pool.threads[i] = Thread_Create(Pool_Main, NULL);
+	if (!pool.threads[i])
+	    break;
+	pool.count++;
+    }
+}
+
+int
+Thread_PoolSize(void)
+{
+    return pool.count;
+}
@@ -18,46 +18,130 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 */
 // vid_null.c -- null video driver to aid porting efforts
+//
+// Renders into memory and never presents, so it can also be used to run
+// benchmarks without a display.  The size of the buffer can be set with
+// -width and -height.
 
-#include "quakedef.h"
+#include <stdlib.h>
+
+#include "common.h"
+#include "console.h"
 #include "d_local.h"
+#include "input.h"
+#include "quakedef.h"
+#include "sys.h"
+#include "vid.h"
+
+#ifdef NQ_HACK
+#include "host.h"
+#endif
+#ifdef QW_HACK
+#include "client.h"
+#endif
 
 viddef_t vid;			// global video state
 
 #define	BASEWIDTH	320
 #define	BASEHEIGHT	200
 
-byte vid_buffer[BASEWIDTH * BASEHEIGHT];
-short zbuffer[BASEWIDTH * BASEHEIGHT];
-byte surfcache[256 * 1024];
+int vid_modenum = VID_MODE_NONE;
 
 unsigned short d_8to16table[256];
 unsigned d_8to24table[256];
 
+static int VID_highhunkmark;
+
 void
-VID_SetPalette(unsigned char *palette)
+VID_SetPalette(const byte *palette)
 {
 }
 
 void
-VID_ShiftPalette(unsigned char *palette)
+VID_ShiftPalette(const byte *palette)
 {
 }
 
-void
-VID_Init(unsigned char *palette)
+qboolean
+VID_CheckAdequateMem(int width, int height)
 {
-    vid.maxwarpwidth = vid.width = vid.conwidth = BASEWIDTH;
-    vid.maxwarpheight = vid.height = vid.conheight = BASEHEIGHT;
-    vid.aspect = 1.0;
+    return true;
+}
+
+qboolean
+VID_SetMode(const qvidmode_t *mode, const byte *palette)
+{
+    int surfcachesize, buffersize;
+    byte *surfcache;
+
     vid.numpages = 1;
+    vid.width = vid.conwidth = mode->width;
+    vid.height = vid.conheight = mode->height;
+    vid.maxwarpwidth = WARP_WIDTH;
+    vid.maxwarpheight = WARP_HEIGHT;
+    vid.aspect = ((float)vid.height / (float)vid.width) * (320.0 / 240.0);
+
     vid.colormap = host_colormap;
     vid.fullbright = 256 - LittleLong(*((int *)vid.colormap + 2048));
-    vid.buffer = vid.conbuffer = vid_buffer;
-    vid.rowbytes = vid.conrowbytes = BASEWIDTH;
 
-    d_pzbuffer = zbuffer;
-    D_InitCaches(surfcache, sizeof(surfcache));
+    if (d_pzbuffer) {
+	D_FlushCaches();
+	Hunk_FreeToHighMark(VID_highhunkmark);
+	d_pzbuffer = NULL;
+    }
+
+    surfcachesize = D_SurfaceCacheForRes(vid.width, vid.height);
+    buffersize = vid.width * vid.height * sizeof(*d_pzbuffer);
+
+    VID_highhunkmark = Hunk_HighMark();
+    d_pzbuffer = Hunk_HighAllocName(buffersize + surfcachesize, "video");
+    surfcache = (byte *)d_pzbuffer + buffersize;
+
+    vid.buffer = vid.conbuffer = vid.direct =
+	Hunk_HighAllocName(vid.width * vid.height, "vidbuf");
+    vid.rowbytes = vid.conrowbytes = vid.width;
+
+    D_InitCaches(surfcache, surfcachesize);
+
+    vid_modenum = mode - modelist;
+    vid.recalc_refdef = 1;
+
+    return true;
+}
+
+void
+VID_Init(const byte *palette)
+{
+    int width, height;
+    qvidmode_t *mode;
+
+    VID_InitModeCvars();
+
+    width = COM_CheckParm("-width");
+    width = (width && com_argc > width + 1) ? atoi(com_argv[width + 1]) : 0;
+    height = COM_CheckParm("-height");
+    height = (height && com_argc > height + 1) ? atoi(com_argv[height + 1]) : 0;
+    if (!width && !height) {
+	width = BASEWIDTH;
+	height = BASEHEIGHT;
+    } else if (!width) {
+	width = height * 4 / 3;
+    } else if (!height) {
+	height = width * 3 / 4;
+    }
+    if (width > MAXWIDTH || height > MAXHEIGHT)
+	Sys_Error("%s: %dx%d is larger than the maximum (%dx%d)", __func__,
+		  width, height, MAXWIDTH, MAXHEIGHT);
+
+    mode = modelist;
+    mode->modenum = 0;
+    mode->width = width;
+    mode->height = height;
+    mode->bpp = 8;
+    mode->refresh = 0;
+    nummodes = 1;
+
+    VID_SetMode(mode, palette);
 }
 
 void
@@ -70,6 +154,28 @@ VID_Update(vrect_t *rects)
 {
 }
 
+void
+VID_LockBuffer(void)
+{
+}
+
+void
+VID_UnlockBuffer(void)
+{
+}
+
+qboolean
+VID_IsFullScreen(void)
+{
+    return false;
+}
+
+qboolean
+window_visible(void)
+{
+    return true;
+}
+
 /*
 ================
 D_BeginDirectRect
@@ -90,3 +196,11 @@ void
 D_EndDirectRect(int x, int y, int width, int height)
 {
 }
+
+#ifndef _WIN32
+void
+Sys_SendKeyEvents(void)
+{
+    IN_ProcessEvents();
+}
+#endif
@@ -211,8 +211,8 @@ void *COM_LoadStackFile(const char *path, void *buffer, int bufsize,
 void *COM_LoadTempFile(const char *path);
 void *COM_LoadHunkFile(const char *path);
 void COM_LoadCacheFile(const char *path, struct cache_user_s *cu);
-#ifdef QW_HACK
 void COM_CreatePath(const char *path);
+#ifdef QW_HACK
 void COM_Gamedir(const char *dir);
 #endif
 
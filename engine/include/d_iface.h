@@ -29,8 +29,22 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "mathlib.h"
 #include "model.h"
 #include "qtypes.h"
+#include "render.h"
+#include "thread.h"
 #include "vid.h"
 
+/*
+ * The state the span drawers and the surface builder work from has a copy
+ * per thread, so the span fill and the surface cache builds can be split
+ * between threads (see D_DrawSurfaces).  The assembly versions need it in
+ * plain globals.
+ */
+#ifdef USE_X86_ASM
+#define SPANSTATE
+#else
+#define SPANSTATE THREAD_LOCAL
+#endif
+
 // d_iface.h: interface header file for rasterization driver modules
 
 #define WARP_WIDTH		320
@@ -101,7 +115,9 @@ typedef struct {
 } spritedesc_t;
 
 extern cvar_t r_drawflat;
-extern int r_framecount;	// sequence # of current frame since Quake started
+extern VIEWSTATE qboolean r_concurrentview;	// see R_RenderViews
+extern VIEWSTATE int r_framecount;	// sequence # of current frame since Quake started
+extern int r_sceneframe;	// r_framecount of the first view in the scene
 extern qboolean r_recursiveaffinetriangles;	// true if a driver wants to use
 
 					    //  recursive triangular subdivison
@@ -114,17 +130,17 @@ extern float r_aliasuvscale;	// scale-up factor for screen u and v
 
 				//  on Alias vertices passed to driver
 extern int r_pixbytes;
-extern qboolean r_dowarp;
+extern VIEWSTATE qboolean r_dowarp;
 
-extern affinetridesc_t r_affinetridesc;
-extern spritedesc_t r_spritedesc;
+extern VIEWSTATE affinetridesc_t r_affinetridesc;
+extern VIEWSTATE spritedesc_t r_spritedesc;
 
 extern int d_con_indirect;	// if 0, Quake will draw console directly
 				//  to vid.buffer; if 1, Quake will
 				//  draw console via D_DrawRect. Must be
 				//  defined by driver
 
-extern vec3_t r_pright, r_pup, r_ppn;
+extern VIEWSTATE vec3_t r_pright, r_pup, r_ppn;
 
 
 void D_Aff8Patch(void *pcolormap);
@@ -136,7 +152,9 @@ void D_PolysetDraw(void);
 void D_PolysetDrawFinalVerts(finalvert_t *fv, int numverts);
 void D_DrawParticle(particle_t *pparticle);
 void D_DrawSprite(void);
-void D_DrawSurfaces(void);
+void D_DrawSurfaces(int top, int bottom);
+extern VIEWSTATE int d_spanbands;		// bands of rows to split the span fill into
+				// (0 = draw the spans on this thread)
 void D_EnableBackBufferAccess(void);
 void D_EndParticles(void);
 void D_Init(void);
@@ -166,7 +184,7 @@ extern byte *r_skysource;
 // !!! must be kept the same as in quakeasm.h !!!
 #define TRANSPARENT_COLOR	0xFF
 
-extern void *acolormap;		// FIXME: should go away
+extern VIEWSTATE void *acolormap;		// FIXME: should go away
 
 //=======================================================================//
 
@@ -183,9 +201,10 @@ typedef struct {
     int surfmip;		// mipmapped ratio surface texels/world pixels
     int surfwidth;		// in mipmapped texels
     int surfheight;		// in mipmapped texels
+    int ambientlight;		// r_refdef.ambientlight of the view
 } drawsurf_t;
 
-extern drawsurf_t r_drawsurf;
+extern SPANSTATE drawsurf_t r_drawsurf;
 
 void R_DrawSurface(void);
 
@@ -208,6 +227,6 @@ extern float skytime;
 extern int c_surf;
 extern vrect_t scr_vrect;
 
-extern byte *r_warpbuffer;
+extern VIEWSTATE byte *r_warpbuffer;
 
 #endif /* D_IFACE_H */
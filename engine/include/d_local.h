@@ -49,6 +49,8 @@ typedef struct surfcache_s {
     unsigned height;		// DEBUG only needed for debug
     float mipscale;
     struct texture_s *texture;	// checked for animating textures
+    int batch;			// see D_BeginSurfaceBatch
+    int building;		// being built by another view (see sc_lock)
     byte data[4];		// width*height elements
 } surfcache_t;
 
@@ -57,23 +59,23 @@ typedef struct sspan_s {
     int u, v, count;
 } sspan_t;
 
-extern float scale_for_mip;
+extern VIEWSTATE float scale_for_mip;
 
 extern qboolean d_roverwrapped;
 extern surfcache_t *sc_rover;
 extern surfcache_t *d_initial_rover;
 
-extern float d_sdivzstepu, d_tdivzstepu, d_zistepu;
-extern float d_sdivzstepv, d_tdivzstepv, d_zistepv;
-extern float d_sdivzorigin, d_tdivzorigin, d_ziorigin;
+extern SPANSTATE float d_sdivzstepu, d_tdivzstepu, d_zistepu;
+extern SPANSTATE float d_sdivzstepv, d_tdivzstepv, d_zistepv;
+extern SPANSTATE float d_sdivzorigin, d_tdivzorigin, d_ziorigin;
 
-fixed16_t sadjust, tadjust;
-fixed16_t bbextents, bbextentt;
+extern SPANSTATE fixed16_t sadjust, tadjust;
+extern SPANSTATE fixed16_t bbextents, bbextentt;
 
 
 void D_DrawSpans8(espan_t *pspans);
 void D_DrawSpans16(espan_t *pspans);
-extern void (*D_DrawSpans)(espan_t *pspan);
+extern VIEWSTATE void (*D_DrawSpans)(espan_t *pspan);
 
 void D_DrawZSpans(espan_t *pspans);
 void Turbulent8(espan_t *pspan);
@@ -87,26 +89,34 @@ void (*prealspandrawer) (void);
 surfcache_t *D_CacheSurface(const entity_t *e, msurface_t *surface,
 			    int miplevel);
 
+/*
+ * Surfaces cached between these calls must stay cached until the end, and
+ * the ones that need building are built by the job pool at the end.
+ * D_EndSurfaceBatch returns false if the cache could not hold them all.
+ */
+void D_BeginSurfaceBatch(void);
+qboolean D_EndSurfaceBatch(void);
+
 #ifdef USE_X86_ASM
 extern void D_PolysetAff8Start(void);
 extern void D_PolysetAff8End(void);
 #endif
 
-extern short *d_pzbuffer;
-extern unsigned int d_zrowbytes, d_zwidth;
+extern VIEWSTATE short *d_pzbuffer;
+extern VIEWSTATE unsigned int d_zrowbytes, d_zwidth;
 
 extern int *d_pscantable;
-extern int d_scantable[MAXHEIGHT];
+extern VIEWSTATE int d_scantable[MAXHEIGHT];
 
-extern int d_vrectx, d_vrecty, d_vrectright_particle, d_vrectbottom_particle;
+extern VIEWSTATE int d_vrectx, d_vrecty, d_vrectright_particle, d_vrectbottom_particle;
 
-extern int d_y_aspect_shift, d_pix_min, d_pix_max, d_pix_shift;
+extern VIEWSTATE int d_y_aspect_shift, d_pix_min, d_pix_max, d_pix_shift;
 
-extern pixel_t *d_viewbuffer;
+extern VIEWSTATE pixel_t *d_viewbuffer;
 
-extern short *zspantable[MAXHEIGHT];
+extern VIEWSTATE short *zspantable[MAXHEIGHT];
 
-extern int d_minmip;
-extern float d_scalemip[3];
+extern VIEWSTATE int d_minmip;
+extern VIEWSTATE float d_scalemip[3];
 
 #endif /* D_LOCAL_H */
@@ -7,5 +7,7 @@ void F_Init(void);
 void F_Shutdown(void);
 void F_RenderView(void);
 void F_WriteConfig(FILE *f);
+void F_FinishBenchmark(void);
+void F_DrawStats(void);
 
 #endif
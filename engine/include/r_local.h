@@ -94,17 +94,49 @@ typedef struct clipplane_s {
     byte reserved[2];
 } clipplane_t;
 
-extern clipplane_t view_clipplanes[4];
+extern VIEWSTATE clipplane_t view_clipplanes[4];
 
 //=============================================================================
 
+void R_BuildWorldList(void);
 void R_RenderWorld(void);
 
+/*
+ * Frustum clip flags for the world's nodes and leafs (nodes first), and the
+ * sort keys of its leafs, as found by R_RenderWorld for the current view.
+ * Each thread drawing a view has its own.
+ */
+extern VIEWSTATE int *r_worldclipflags;
+extern VIEWSTATE int *r_leafkeys;
+
+static inline int
+R_NumWorldClipFlags(void)
+{
+    return cl.worldmodel->numnodes + cl.worldmodel->numleafs + 1;
+}
+
+static inline int *
+R_NodeClipFlags(const mnode_t *node)
+{
+    const brushmodel_t *world = cl.worldmodel;
+
+    if (node->contents < 0)
+	return &r_worldclipflags[world->numnodes +
+				 ((const mleaf_t *)node - world->leafs)];
+    return &r_worldclipflags[node - world->nodes];
+}
+
+static inline int *
+R_LeafKey(const mleaf_t *leaf)
+{
+    return &r_leafkeys[leaf - cl.worldmodel->leafs];
+}
+
 //=============================================================================
 
-extern mplane_t screenedge[4];
-extern vec3_t r_origin;
-extern vec3_t r_entorigin;
+extern VIEWSTATE mplane_t screenedge[4];
+extern VIEWSTATE vec3_t r_origin;
+extern VIEWSTATE vec3_t r_entorigin;
 extern int r_visframecount;
 
 //=============================================================================
@@ -115,12 +147,14 @@ extern int r_visframecount;
 
 void R_DrawSprite(const entity_t *e);
 void R_RenderFace(const entity_t *e, msurface_t *fa, int clipflags);
-void R_RenderBmodelFace(const entity_t *e, bedge_t *pedges, msurface_t *psurf);
+void R_RenderBmodelFace(const entity_t *e, bedge_t *pedges, msurface_t *psurf,
+			int clipflags);
 void R_TransformPlane(mplane_t *p, float *normal, float *dist);
 void R_TransformFrustum(void);
 void R_SetSkyFrame(void);
 void R_DrawSurfaceBlock16(void);
 void R_DrawSurfaceBlock8(void);
+void R_InitSurfaceKernels(void);
 
 #ifdef USE_X86_ASM
 
@@ -135,12 +169,15 @@ void R_GenSkyTile(void *pdest);
 void R_GenSkyTile16(void *pdest);
 void R_Surf8Patch(void);
 void R_Surf16Patch(void);
-void R_DrawSubmodelPolygons(const entity_t *entity, int clipflags);
-void R_DrawSolidClippedSubmodelPolygons(const entity_t *entity);
+void R_DrawSubmodelPolygons(const entity_t *entity, int clipflags,
+			    mnode_t *topnode);
+void R_DrawSolidClippedSubmodelPolygons(const entity_t *entity, int clipflags,
+					mnode_t *topnode);
 
 void R_AddPolygonEdges(emitpoint_t *pverts, int numverts, int miplevel);
 surf_t *R_GetSurf(void);
-void R_AliasDrawModel(entity_t *e, alight_t *plighting);
+void R_AliasDrawModel(const entity_t *e, alight_t *plighting,
+		      int trivial_accept);
 void R_BeginEdgeFrame(void);
 void R_ScanEdges(void);
 void R_InsertNewEdges(edge_t *edgestoadd, edge_t *edgelist);
@@ -156,16 +193,16 @@ extern void R_EdgeCodeEnd(void);
 
 extern void R_RotateBmodel(const entity_t *e);
 
-extern int c_faceclip;
-extern int r_polycount;
+extern VIEWSTATE int c_faceclip;
+extern VIEWSTATE int r_polycount;
 
 // !!! if this is changed, it must be changed in asm_draw.h too !!!
 #define	NEAR_CLIP	0.01
 
-extern int ubasestep, errorterm, erroradjustup, erroradjustdown;
+extern VIEWSTATE int ubasestep, errorterm, erroradjustup, erroradjustdown;
 
-extern fixed16_t sadjust, tadjust;
-extern fixed16_t bbextents, bbextentt;
+extern SPANSTATE fixed16_t sadjust, tadjust;
+extern SPANSTATE fixed16_t bbextents, bbextentt;
 
 #define MAXBVERTINDEXES	1000	// new clipped vertices when clipping bmodels
 				// to the world BSP
@@ -173,8 +210,8 @@ extern mvertex_t *r_ptverts, *r_ptvertsmax;
 
 extern vec3_t sbaseaxis[3], tbaseaxis[3];
 
-extern int r_currentkey;
-extern int r_currentbkey;
+extern VIEWSTATE int r_currentkey;
+extern VIEWSTATE int r_currentbkey;
 
 //=========================================================
 // Alias models
@@ -184,13 +221,13 @@ extern int r_currentbkey;
 #define ALIAS_Z_CLIP_PLANE	5
 
 extern int numverts;
-extern int a_skinwidth;
+extern VIEWSTATE int a_skinwidth;
 extern int numtriangles;
 extern float leftclip, topclip, rightclip, bottomclip;
 extern int r_acliptype;
 extern float r_avertexnormals[][3];
 
-qboolean R_AliasCheckBBox(entity_t *e);
+qboolean R_AliasCheckBBox(const entity_t *e, int *trivial_accept);
 
 //=========================================================
 // turbulence stuff
@@ -208,27 +245,27 @@ void R_ClearParticles(void);
 void R_ReadPointFile_f(void);
 void R_SurfacePatch(void);
 
-extern int r_amodels_drawn;
-extern edge_t *auxedges;
+extern VIEWSTATE int r_amodels_drawn;
+extern VIEWSTATE edge_t *auxedges;
 extern int r_numallocatededges;
-extern edge_t *r_edges, *edge_p, *edge_max;
+extern VIEWSTATE edge_t *r_edges, *edge_p, *edge_max;
 
-extern edge_t *newedges[MAXHEIGHT];
-extern edge_t *removeedges[MAXHEIGHT];
+extern VIEWSTATE edge_t *newedges[MAXHEIGHT];
+extern VIEWSTATE edge_t *removeedges[MAXHEIGHT];
 
-extern int screenwidth;
+extern VIEWSTATE int screenwidth;
 
 // FIXME: make stack vars when debugging done
-extern edge_t edge_head;
-extern edge_t edge_tail;
-extern edge_t edge_aftertail;
-extern int r_bmodelactive;
+extern VIEWSTATE edge_t edge_head;
+extern VIEWSTATE edge_t edge_tail;
+extern VIEWSTATE edge_t edge_aftertail;
+extern VIEWSTATE int r_bmodelactive;
 
-extern float aliasxscale, aliasyscale, aliasxcenter, aliasycenter;
-extern float r_aliastransition, r_resfudge;
+extern VIEWSTATE float aliasxscale, aliasyscale, aliasxcenter, aliasycenter;
+extern VIEWSTATE float r_aliastransition, r_resfudge;
 
-extern int r_outofsurfaces;
-extern int r_outofedges;
+extern VIEWSTATE int r_outofsurfaces;
+extern VIEWSTATE int r_outofedges;
 extern int r_maxvalidedgeoffset;
 
 void R_AliasClipTriangle(mtriangle_t *ptri, finalvert_t *pfinalverts, auxvert_t *pauxverts);
@@ -243,13 +280,13 @@ extern float dp_time1, dp_time2, db_time1, db_time2, rw_time1, rw_time2;
 extern float se_time1, se_time2, de_time1, de_time2, dv_time1, dv_time2;
 extern int r_maxsurfsseen, r_maxedgesseen;
 extern cshift_t cshift_water;
-extern qboolean r_dowarpold, r_viewchanged;
+extern VIEWSTATE qboolean r_dowarpold, r_viewchanged;
 
 extern mleaf_t *r_viewleaf, *r_oldviewleaf;
 
-extern vec3_t r_emins, r_emaxs;
-extern mnode_t *r_pefragtopnode;
-extern int r_clipflags;
+extern VIEWSTATE vec3_t r_emins, r_emaxs;
+extern VIEWSTATE mnode_t *r_pefragtopnode;
+extern VIEWSTATE int r_clipflags;
 extern int r_dlightframecount;
 
 void R_StoreEfrags(efrag_t **ppefrag);
@@ -260,6 +297,7 @@ void R_PrintTimes(void);
 void R_PrintDSpeeds(void);
 void R_AnimateLight(void);
 int R_LightPoint(const vec3_t point);
+void R_SetupScene(void);
 void R_SetupFrame(void);
 void R_cshift_f(void);
 void R_EmitEdge(mvertex_t *pv0, mvertex_t *pv1);
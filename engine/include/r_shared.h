@@ -47,13 +47,13 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 //===================================================================
 
-extern int cachewidth;
-extern pixel_t *cacheblock;
-extern int screenwidth;
+extern SPANSTATE int cachewidth;
+extern SPANSTATE pixel_t *cacheblock;
+extern VIEWSTATE int screenwidth;
 
-extern float pixelAspect;
+extern VIEWSTATE float pixelAspect;
 
-extern int r_drawnpolycount;
+extern VIEWSTATE int r_drawnpolycount;
 
 extern cvar_t r_clearcolor;
 
@@ -61,9 +61,9 @@ extern cvar_t r_clearcolor;
 extern int sintable[TURB_TABLE_SIZE];
 extern int intsintable[TURB_TABLE_SIZE];
 
-extern vec3_t vup, base_vup;
-extern vec3_t vpn, base_vpn;
-extern vec3_t vright, base_vright;
+extern VIEWSTATE vec3_t vup, base_vup;
+extern VIEWSTATE vec3_t vpn, base_vpn;
+extern VIEWSTATE vec3_t vright, base_vright;
 
 // FIXME - reasoning behind number choice?
 #define NUMSTACKEDGES		3000
@@ -100,7 +100,7 @@ typedef struct surf_s {
     int pad[2];			// to 64 bytes
 } surf_t;
 
-extern surf_t *surfaces, *surface_p, *surf_max;
+extern VIEWSTATE surf_t *surfaces, *surface_p, *surf_max;
 
 // surfaces are generated in back to front order by the bsp, so if a surf
 // pointer is greater than another one, it should be drawn in front
@@ -113,12 +113,12 @@ extern surf_t *surfaces, *surface_p, *surf_max;
 extern vec3_t sxformaxis[4];	// s axis transformed into viewspace
 extern vec3_t txformaxis[4];	// t axis transformed into viewspac
 
-extern vec3_t modelorg, base_modelorg;
+extern VIEWSTATE vec3_t modelorg, base_modelorg;
 
-extern float xcenter, ycenter;
-extern float xscale, yscale;
-extern float xscaleinv, yscaleinv;
-extern float xscaleshrink, yscaleshrink;
+extern VIEWSTATE float xcenter, ycenter;
+extern VIEWSTATE float xscale, yscale;
+extern VIEWSTATE float xscaleinv, yscaleinv;
+extern VIEWSTATE float xscaleshrink, yscaleshrink;
 
 extern int d_lightstylevalue[256];	// 8.8 frac of base light value
 
@@ -129,7 +129,7 @@ extern void SetUpForLineScan(fixed8_t startvertu, fixed8_t startvertv,
 extern int r_skymade;
 extern void R_MakeSky(void);
 
-extern int ubasestep, errorterm, erroradjustup, erroradjustdown;
+extern VIEWSTATE int ubasestep, errorterm, erroradjustup, erroradjustdown;
 
 // flags in finalvert_t.flags
 #define ALIAS_LEFT_CLIP				0x0001
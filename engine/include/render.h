@@ -24,6 +24,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "cvar.h"
 #include "mathlib.h"
 #include "model.h"
+#include "thread.h"
 #include "vid.h"
 
 #ifdef NQ_HACK
@@ -35,6 +36,17 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 // render.h -- public interface to refresh functions
 
+/*
+ * The state of the view being drawn.  The software renderer keeps a copy of
+ * it per thread, so that the views of one scene can be drawn at the same
+ * time (see R_RenderViews).  The assembly and GL renderers use plain globals.
+ */
+#if defined(GLQUAKE) || defined(USE_X86_ASM)
+#define VIEWSTATE
+#else
+#define VIEWSTATE THREAD_LOCAL
+#endif
+
 #define	TOP_RANGE	16	// soldier uniform colors
 #define	BOTTOM_RANGE	96
 
@@ -149,8 +161,8 @@ typedef struct {
 // refresh
 //
 
-extern refdef_t r_refdef;
-extern vec3_t r_origin, vpn, vright, vup;
+extern VIEWSTATE refdef_t r_refdef;
+extern VIEWSTATE vec3_t r_origin, vpn, vright, vup;
 
 extern struct texture_s *r_notexture_mip;
 
@@ -160,9 +172,30 @@ void R_Init(void);
 void R_InitTextures(void);
 void R_InitEfrags(void);
 void R_RenderView(void);	// must set r_refdef first
+void R_BeginScene(void);	// views rendered to a target until the next call
+				// share the origin, PVS and dynamic lights
+qboolean R_RenderViews(thread_job_t job, void *arg, int count);
+				// the views of one scene at the same time,
+				// each job calling R_RenderView once
 void R_ViewChanged(vrect_t *pvrect, int lineadj, float aspect);
 				// called whenever r_refdef or vid change
 
+/*
+ * Offscreen render target. While one is set, R_RenderView draws a view
+ * covering the whole target into its buffer instead of into vid.buffer.
+ * (width <= MAXWIDTH, height <= MAXHEIGHT)
+ */
+typedef struct {
+    byte *buffer;
+    int rowbytes;
+    short *zbuffer;		// width * height
+    int width, height;
+    vrect_t scissor;		// only draw inside this (width 0 = everywhere)
+} rendertarget_t;
+
+extern VIEWSTATE rendertarget_t *r_target;
+void R_SetRenderTarget(rendertarget_t *target);	// NULL = back to vid
+
 void R_InitSky(struct texture_s *mt);	// called at level load
 
 void R_AddEfrags(entity_t *ent);
@@ -208,6 +241,16 @@ int D_SurfaceCacheForRes(int width, int height);
 void D_FlushCaches(void);
 void D_DeleteSurfaceCache(void);
 void D_InitCaches(void *buffer, int size);
+void D_ReserveSurfaceCache(int size);
+int D_SurfaceCacheSize(void);
+
+// surface cache counters, since startup (see D_CacheSurface)
+typedef struct {
+    unsigned hits;		// cached surface reused
+    unsigned misses;		// surface not cached, built into a new block
+    unsigned rebuilds;		// cached surface rebuilt for new light or animation
+} surfcache_stats_t;
+extern surfcache_stats_t d_surfcache_stats;
 void R_SetVrect(const vrect_t *pvrectin, vrect_t *pvrect, int lineadj);
 
 #endif /* RENDER_H */
@@ -0,0 +1,81 @@
+/*
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "qtypes.h"
+
+// thread.h -- minimal portable threads (pthreads or win32)
+
+typedef struct thread_s thread_t;
+typedef void (*thread_func_t)(void *arg);
+
+/*
+ * Start running func(arg) on a new thread.
+ * Returns NULL if the thread could not be created.
+ */
+thread_t *Thread_Create(thread_func_t func, void *arg);
+
+/* Wait for the thread to return and free it */
+void Thread_Join(thread_t *thread);
+
+/* Number of processors available to run threads on (at least 1) */
+int Thread_NumCPUs(void);
+
+/* Storage class for a variable with a separate copy on each thread */
+#define THREAD_LOCAL __thread
+
+/*
+ * Atomically add to an int shared between threads, returning the previous
+ * value. This is also a full memory barrier.
+ */
+#define Thread_AtomicAdd(ptr, value) __sync_fetch_and_add((ptr), (value))
+
+/*
+ * Mutual exclusion lock, for state shared between threads that is changed
+ * in more than one step.  Thread_CreateMutex returns NULL on failure.
+ */
+typedef struct thread_mutex_s thread_mutex_t;
+
+thread_mutex_t *Thread_CreateMutex(void);
+void Thread_DestroyMutex(thread_mutex_t *mutex);
+void Thread_LockMutex(thread_mutex_t *mutex);
+void Thread_UnlockMutex(thread_mutex_t *mutex);
+
+/* Let another thread run (while waiting on one) */
+void Thread_Yield(void);
+
+/*
+ * Job pool: a set of persistent threads for splitting short pieces of
+ * per-frame work across processors.
+ */
+typedef void (*thread_job_t)(void *arg, int index);
+
+/*
+ * Run job(arg, index) for each index in [0, count) on the pool threads and
+ * the calling thread, returning once they have all finished. The jobs must
+ * be independent of each other. Only call this from the main thread.
+ */
+void Thread_RunJobs(thread_job_t job, void *arg, int count);
+
+/* Set the number of pool threads (0 = run all jobs on the calling thread) */
+void Thread_SetPoolSize(int count);
+int Thread_PoolSize(void);
+
+#endif /* THREAD_H */
@@ -5,6 +5,9 @@ lens_width = 2*pi
 
 onload = "f_cover"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "cylinder"
+
 function lens_inverse(x,y)
    if abs(x) > pi then
       return nil
@@ -6,6 +6,9 @@ lens_height = pi
 
 onload = "f_contain"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "equirect"
+
 function lens_inverse(x,y)
    if abs(y) > pi/2 or abs(x) > pi then
       return nil
@@ -6,6 +6,9 @@ lens_height = 2*pi
 
 onload = "f_contain"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "fisheye1"
+
 function lens_inverse(x,y)
    local r = sqrt(x*x+y*y)
 
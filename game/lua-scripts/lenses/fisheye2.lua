@@ -8,6 +8,9 @@ lens_height = maxr*2
 
 onload = "f_contain"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "fisheye2"
+
 function lens_inverse(x,y)
    local r = sqrt(x*x+y*y)
    if r > maxr then
@@ -6,6 +6,9 @@ lens_height = sqrt(2)*2
 
 onload = "f_contain"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "hammer"
+
 function lens_inverse(x,y)
    if x*x/8+y*y/2 > 1 then 
       return nil
@@ -8,6 +8,9 @@ lens_height = maxy*2
 
 onload = "f_contain"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "miller"
+
 function lens_inverse(x,y)
    if abs(y) > maxy or abs(x) > pi then
       return nil
@@ -8,6 +8,9 @@ lens_height = sqrt(2)*2
 
 onload = "f_contain"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "mollweide"
+
 function solveTheta(lat)
    local t = lat
    local dt
@@ -5,6 +5,9 @@ max_vfov = 180
 
 onload = "f_fov 180"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "panini"
+
 function lens_inverse(x,y)
    local k = x*x/((d+1)*(d+1))
    local dscr = k*k*d*d - (k+1)*(k*d*d-1)
@@ -24,6 +27,40 @@ function lens_forward(x,y,z)
    return x,y
 end
 
+-- batched versions of the above (one lua call per row)
+
+function lens_inverse_row(y,x0,dx,n,rays)
+   for i=0,n-1 do
+      local x = x0+i*dx
+      local k = x*x/((d+1)*(d+1))
+      local dscr = k*k*d*d - (k+1)*(k*d*d-1)
+      local clon = (-k*d+sqrt(dscr))/(k+1)
+      local S = (d+1)/(d+clon)
+      local lon = atan2(x,S*clon)
+      local lat = atan2(y,S)
+
+      -- (inlined latlon_to_ray)
+      local clat = cos(lat)
+      rays[3*i+1] = sin(lon)*clat
+      rays[3*i+2] = sin(lat)
+      rays[3*i+3] = cos(lon)*clat
+   end
+end
+
+function lens_forward_batch(rays,n,xy)
+   for i=0,n-1 do
+      local x,y,z = rays[3*i+1], rays[3*i+2], rays[3*i+3]
+
+      -- (inlined ray_to_latlon)
+      local lon = atan2(x,z)
+      local lat = atan2(y,sqrt(x*x+z*z))
+
+      local S = (d+1)/(d+cos(lon))
+      xy[2*i+1] = S*sin(lon)
+      xy[2*i+2] = S*tan(lat)
+   end
+end
+
 --function xy_to_ray(x,y)
 --   -- for d=1 only
 --   local t = 4/(x*x+4)
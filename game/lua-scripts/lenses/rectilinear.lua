@@ -4,6 +4,9 @@ max_vfov = 180
 -- Popular FOVs on Quake Live are from 100-120
 onload = "f_fov 110"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "rectilinear"
+
 function lens_inverse(x,y)
    local r = sqrt(x*x+y*y)
 
@@ -22,6 +25,35 @@ function lens_forward(x,y,z)
    return x*c, y*c
 end
 
+-- batched versions of the above (one lua call per row)
+
+function lens_inverse_row(y,x0,dx,n,rays)
+   for i=0,n-1 do
+      local x = x0+i*dx
+      local r = sqrt(x*x+y*y)
+
+      local theta = atan(r)
+
+      local s = sin(theta)
+      rays[3*i+1] = x/r*s
+      rays[3*i+2] = y/r*s
+      rays[3*i+3] = cos(theta)
+   end
+end
+
+function lens_forward_batch(rays,n,xy)
+   for i=0,n-1 do
+      local x,y,z = rays[3*i+1], rays[3*i+2], rays[3*i+3]
+      local theta = acos(z)
+
+      local r = tan(theta)
+
+      local c = r/sqrt(x*x+y*y)
+      xy[2*i+1] = x*c
+      xy[2*i+2] = y*c
+   end
+end
+
 --function lens_forward(x,y,z)
 --   local lat,lon = ray_to_latlon(x,y,z)
 --   local cosc = cos(lat)*cos(lon)
@@ -7,6 +7,9 @@ lens_height = pi
 
 onload = "f_contain"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "sinusoidal"
+
 function lens_forward(x,y,z)
    local lat,lon = ray_to_latlon(x,y,z)
    local x = lon*cos(lat)
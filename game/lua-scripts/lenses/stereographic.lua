@@ -5,6 +5,9 @@ max_vfov = 360
 
 onload = "f_fov 180"
 
+-- use the built-in C version of this lens (remove this if you edit the functions below)
+native = "stereographic"
+
 function lens_inverse(x,y)
    local r = sqrt(x*x+y*y)
    local theta = atan(r)/angleScale